@@ -0,0 +1,103 @@
+#!/bin/sh
+#
+# CPU throughput benchmark
+#
+# Usage: bench.sh [-s] runner [workload ...]
+#
+# Runs each workload (all of them when none are named) on a fresh copy of the
+# A: and D: disks from cpm/, checks its result and prints one JSON line per
+# workload with what it cost, as reported by the runner's -j statistics.
+# When bench/baseline.json exists every line is also compared against it.
+# With -s the results are stored as the new baseline instead.
+#
+# Workloads:
+#   zexdoc  ZEXDOC instruction exerciser, must pass every test
+#   zexall  ZEXALL instruction exerciser, must pass every test
+#   mix     Synthetic instruction mix kernel (MIX.Z80), checksum must match
+#   basic   MBASIC arithmetic loops (BENCH.BAS), printed results must match
+#   asm     Z80ASM assembling the CCPZ sources 100 times, binary must match cpm/ccp
+#
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(dirname "$BENCH")
+BASELINE=$BENCH/baseline.json
+ASM_RUNS=100
+LIMIT=1800		# Seconds a workload may take before it is considered hung
+
+MIX_RESULT="MIX 8D76"
+BASIC_RESULT=" 5.00029E+08  10261684.73842698  80  92.3794"
+
+store=no
+if [ "$1" = "-s" ]; then
+	store=yes
+	shift
+fi
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 [-s] runner [workload ...]" >&2
+	exit 2
+fi
+RUNNER=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shift
+WORKLOADS=${*:-"zexdoc zexall mix basic asm"}
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/runcpm-bench.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+. "$BENCH/common.sh"
+
+(cd "$WORK" && tar xzf "$ROOT/cpm/a.tar.gz" && tar xzf "$ROOT/cpm/d.tar.gz") || exit 1
+cpm_text "$BENCH/MIX.Z80" "$WORK/A/0/MIX.Z80"
+cpm_text "$BENCH/BENCH.BAS" "$WORK/A/0/BENCH.BAS"
+cp "$WORK/D/0/CCPZ.Z80" "$WORK/A/0/CCPZ.Z80"
+i=0
+while [ $i -lt $ASM_RUNS ]; do
+	echo "Z80ASM CCPZ"
+	i=$((i + 1))
+done > "$WORK/asm.txt"
+cpm_text "$WORK/asm.txt" "$WORK/A/0/ASMBENCH.SUB"
+if ! run setup "Z80ASM MIX" || [ ! -f "$WORK/A/0/MIX.COM" ]; then
+	echo "Unable to assemble the instruction mix kernel." >&2
+	exit 1
+fi
+
+failed=0
+lines=
+for name in $WORKLOADS; do
+	case $name in
+	zexdoc) command=ZEXDOC ;;
+	zexall) command=ZEXALL ;;
+	mix)    command=MIX ;;
+	basic)  command="MBASIC BENCH" ;;
+	asm)    command="SUBMIT ASMBENCH"; rm -f "$WORK/A/0/CCPZ.COM" ;;
+	*)      echo "Unknown workload $name." >&2; exit 2 ;;
+	esac
+	echo "Running $name..." >&2
+	ok=false
+	if run $name "$command"; then
+		case $name in
+		zex*)  grep -q "Tests complete" "$WORK/$name.out" && ! grep -q "ERROR" "$WORK/$name.out" && ok=true ;;
+		mix)   grep -q "$MIX_RESULT" "$WORK/$name.out" && ok=true ;;
+		basic) grep -q "$BASIC_RESULT" "$WORK/$name.out" && ok=true ;;
+		asm)   cmp -s "$WORK/A/0/CCPZ.COM" "$ROOT/cpm/ccp/CCP-CCPZ.64K" && ok=true ;;
+		esac
+	fi
+	[ $ok = true ] || failed=1
+	line="{\"name\": \"$name\", \"ok\": $ok"
+	if [ -f "$WORK/$name.json" ]; then
+		for f in instructions wall_seconds cpu_seconds instructions_per_second host_cycles cycles_per_instruction; do
+			line="$line, \"$f\": $(field "$WORK/$name.json" $f)"
+		done
+		if [ $store = no ] && [ -f "$BASELINE" ]; then
+			base=$(grep "\"name\": \"$name\"" "$BASELINE" > "$WORK/base" && field "$WORK/base" instructions_per_second)
+			if [ -n "$base" ]; then
+				line="$line, \"baseline_instructions_per_second\": $base"
+				line="$line, \"speedup\": $(ratio "$(field "$WORK/$name.json" instructions_per_second)" "$base")"
+				[ "$(field "$WORK/base" instructions)" = "$(field "$WORK/$name.json" instructions)" ] ||
+					echo "Warning: $name executed a different number of instructions than the baseline." >&2
+			fi
+		fi
+	fi
+	add_line "$line"
+done
+
+finish
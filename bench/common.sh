@@ -0,0 +1,55 @@
+#
+# Helpers shared by the benchmark scripts
+#
+# Expects RUNNER (absolute path of the runcpm to measure), WORK (the folder
+# holding the drives) and LIMIT (seconds before a run counts as hung).
+#
+
+# CP/M text files have CR/LF line ends and a ^Z at the end
+cpm_text() {
+	awk '{ printf "%s\r\n", $0 } END { printf "\032" }' "$1" > "$2"
+}
+
+# Runs a command line on the machine, statistics go to $WORK/$1.json
+run() {
+	if command -v timeout > /dev/null; then
+		(cd "$WORK" && timeout $LIMIT "$RUNNER" -j "$WORK/$1.json" "$2" < /dev/null > "$WORK/$1.out" 2>&1)
+	else
+		(cd "$WORK" && "$RUNNER" -j "$WORK/$1.json" "$2" < /dev/null > "$WORK/$1.out" 2>&1)
+	fi
+}
+
+# Field of a statistics file or of a workload line
+field() {
+	sed -n "s/.*\"$2\": \([^,}]*\).*/\1/p" "$1" | head -n 1
+}
+
+ratio() {
+	awk "BEGIN { if ($2 > 0) printf \"%.3f\", $1 / $2; else print \"null\" }"
+}
+
+# Adds a workload line to the results
+add_line() {
+	lines="$lines${lines:+,
+}		$1}"
+}
+
+# Prints the results and stores them as the baseline when asked to
+finish() {
+	result="{
+	\"runner\": \"$(basename "$RUNNER")\",
+	\"workloads\": [
+$lines
+	]
+}"
+	echo "$result"
+	if [ $store = yes ]; then
+		if [ $failed = 1 ]; then
+			echo "Not storing a baseline from a failed run." >&2
+		else
+			echo "$result" > "$BASELINE"
+			echo "Stored as the new baseline." >&2
+		fi
+	fi
+	exit $failed
+}
@@ -0,0 +1,182 @@
+#!/bin/sh
+#
+# BDOS and file system benchmark
+#
+# Usage: iobench.sh [-s] [-n files] [-k size] [-b size] runner [workload ...]
+#
+# Before every workload the drives are populated afresh: A: with the disk
+# from cpm/, B: with files F0000.DAT and up of the given size in KB plus a
+# text file BIG.DAT of the given size in KB, and an empty C:. Each workload is
+# checked and reported as one JSON line with its operations per second and
+# the host calls it took per operation, from the runner's -j statistics.
+# When bench/iobaseline.json exists every line is also compared against it.
+# With -s the results are stored as the new baseline instead.
+#
+#   -n files  Number of small files on B: (default 500)
+#   -k size   Size of every small file in KB (default 4)
+#   -b size   Size of BIG.DAT in KB (default 4096)
+#
+# Workloads, with what counts as one operation:
+#   seqwrite   Sequential writes (BDOS 21) of a file the size of BIG.DAT, a record
+#   seqread    Sequential reads (BDOS 20) of BIG.DAT, a record
+#   random     Random reads and writes (BDOS 33, 34, 40) on BIG.DAT, a record
+#   openclose  Opening and closing (BDOS 15, 16) all the small files 20 times, a file
+#   search     Search first/next (BDOS 17, 18) over B:*.DAT 10 times, a file found
+#   delete     Wildcard delete (BDOS 19) of all the small files, a file
+#   dir        DIR of B:, a file listed
+#   pip        PIP copying BIG.DAT to C:, a record
+#   submit     A chain of 20 SUBMIT files of 100 commands each, a command
+#
+# Syscalls per operation are an estimate: one for every open, close, seek,
+# stat, remove, rename, truncate and directory scan, plus the read and write
+# system calls the kernel counted.
+#
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(dirname "$BENCH")
+BASELINE=$BENCH/iobaseline.json
+LIMIT=600		# Seconds a workload may take before it is considered hung
+
+FILES=500
+FILE_KB=4
+BIG_KB=4096
+RANDOM_OPS=60000
+OPEN_PASSES=20
+SEARCH_PASSES=10
+SUBMIT_FILES=20
+SUBMIT_LINES=100	# SUBMIT.COM has room for a few hundred short lines only
+
+store=no
+while getopts sn:k:b: option; do
+	case $option in
+	s) store=yes ;;
+	n) FILES=$OPTARG ;;
+	k) FILE_KB=$OPTARG ;;
+	b) BIG_KB=$OPTARG ;;
+	*) exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 [-s] [-n files] [-k size] [-b size] runner [workload ...]" >&2
+	exit 2
+fi
+if [ $FILES -gt 10000 ] || [ $((BIG_KB * 8)) -gt 65535 ]; then
+	echo "At most 10000 files and 8191 KB for BIG.DAT." >&2
+	exit 2
+fi
+RUNNER=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shift
+WORKLOADS=${*:-"seqwrite seqread random openclose search delete dir pip submit"}
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/runcpm-iobench.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+. "$BENCH/common.sh"
+
+# Text of the given size in KB, with CR/LF line ends and no ^Z
+text_kb() {
+	awk -v size=$(($1 * 1024)) 'BEGIN {
+		while (n < size) {
+			line = sprintf("%06d The quick brown fox jumps over the lazy dog.\r\n", ++i)
+			printf "%s", line
+			n += length(line)
+		}
+	}' | head -c $(($1 * 1024))
+}
+
+text_kb $FILE_KB > "$WORK/small"
+text_kb $BIG_KB > "$WORK/big"
+
+populate() {
+	rm -rf "$WORK/B" "$WORK/C"
+	mkdir -p "$WORK/B/0" "$WORK/C/0"
+	i=0
+	while [ $i -lt $FILES ]; do
+		cp "$WORK/small" "$WORK/B/0/$(printf 'F%04d.DAT' $i)"
+		i=$((i + 1))
+	done
+	cp "$WORK/big" "$WORK/B/0/BIG.DAT"
+}
+
+(cd "$WORK" && tar xzf "$ROOT/cpm/a.tar.gz") || exit 1
+cpm_text "$BENCH/IOBENCH.Z80" "$WORK/A/0/IOBENCH.Z80"
+i=0
+while [ $i -lt $SUBMIT_FILES ]; do
+	j=0
+	while [ $j -lt $SUBMIT_LINES ]; do
+		echo "USER 0"
+		j=$((j + 1))
+	done > "$WORK/submit.txt"
+	[ $((i + 1)) -lt $SUBMIT_FILES ] && echo "SUBMIT CHAIN$((i + 1))" >> "$WORK/submit.txt"
+	cpm_text "$WORK/submit.txt" "$WORK/A/0/CHAIN$i.SUB"
+	i=$((i + 1))
+done
+if ! run setup "Z80ASM IOBENCH" || [ ! -f "$WORK/A/0/IOBENCH.COM" ]; then
+	echo "Unable to assemble the I/O benchmark program." >&2
+	exit 1
+fi
+
+failed=0
+lines=
+for name in $WORKLOADS; do
+	records=$((BIG_KB * 8))
+	case $name in
+	seqwrite)  command="IOBENCH W $records"; ops=$records ;;
+	seqread)   command="IOBENCH R"; ops=$records ;;
+	random)    command="IOBENCH X $RANDOM_OPS"; ops=$RANDOM_OPS ;;
+	openclose) command="IOBENCH O $OPEN_PASSES"; ops=$((FILES * OPEN_PASSES)) ;;
+	search)    command="IOBENCH S $SEARCH_PASSES"; ops=$(((FILES + 1) * SEARCH_PASSES)) ;;
+	delete)    command="IOBENCH D $FILES"; ops=$FILES ;;
+	dir)       command="DIR B:"; ops=$((FILES + 1)) ;;
+	pip)       command="PIP C:=B:BIG.DAT"; ops=$records ;;
+	submit)    command="SUBMIT CHAIN0"; ops=$((SUBMIT_FILES * (SUBMIT_LINES + 1) - 1)) ;;
+	*)         echo "Unknown workload $name." >&2; exit 2 ;;
+	esac
+	populate
+	echo "Running $name..." >&2
+	ok=false
+	if run $name "$command"; then
+		case $name in
+		dir)    grep -q "$(printf 'F%04d' $((FILES - 1)))" "$WORK/$name.out" && ok=true ;;
+		pip)    cmp -s "$WORK/B/0/BIG.DAT" "$WORK/C/0/BIG.DAT" && ok=true ;;
+		submit) [ "$(grep -c "A>USER 0" "$WORK/$name.out")" = $((SUBMIT_FILES * SUBMIT_LINES)) ] && ok=true ;;
+		*)      grep -q "OPS $(printf '%08X' $ops)" "$WORK/$name.out" && ok=true ;;
+		esac
+	fi
+	[ $ok = true ] || failed=1
+	line="{\"name\": \"$name\", \"ok\": $ok, \"operations\": $ops"
+	if [ -f "$WORK/$name.json" ]; then
+		stats=$WORK/$name.json
+		wall=$(field "$stats" wall_seconds)
+		calls=0
+		for f in file_opens file_closes file_seeks file_reads file_writes file_removes file_renames file_stats file_truncates dir_scans; do
+			calls=$((calls + $(field "$stats" $f)))
+		done
+		syscalls=$(($(field "$stats" file_opens) + $(field "$stats" file_closes) + $(field "$stats" file_seeks) + \
+			$(field "$stats" file_stats) + $(field "$stats" file_removes) + $(field "$stats" file_renames) + \
+			$(field "$stats" file_truncates) + $(field "$stats" dir_scans)))
+		syscr=$(field "$stats" read_syscalls)
+		syscw=$(field "$stats" write_syscalls)
+		if [ "$syscr" = null ] || [ "$syscw" = null ]; then
+			syscalls=null
+		else
+			syscalls=$(ratio $((syscalls + syscr + syscw)) $ops)
+		fi
+		line="$line, \"wall_seconds\": $wall, \"cpu_seconds\": $(field "$stats" cpu_seconds)"
+		line="$line, \"operations_per_second\": $(ratio $ops "$wall")"
+		line="$line, \"file_calls_per_operation\": $(ratio $calls $ops), \"syscalls_per_operation\": $syscalls"
+		if [ $store = no ] && [ -f "$BASELINE" ]; then
+			base=$(grep "\"name\": \"$name\"" "$BASELINE" > "$WORK/base" && field "$WORK/base" operations_per_second)
+			if [ -n "$base" ]; then
+				line="$line, \"baseline_operations_per_second\": $base"
+				line="$line, \"speedup\": $(ratio "$(ratio $ops "$wall")" "$base")"
+				[ "$(field "$WORK/base" operations)" = "$ops" ] ||
+					echo "Warning: $name ran a different number of operations than the baseline." >&2
+			fi
+		fi
+	fi
+	add_line "$line"
+done
+
+finish
@@ -0,0 +1,64 @@
+#!/bin/sh
+#
+# Keystroke latency benchmark for interactive workloads
+#
+# Usage: latency.sh [-l load] [-i interval] runner [workload ...]
+#
+# Runs the runner on a pseudo terminal through tools/echolat, which types the
+# keys of each workload script (bench/latency/*.script) one at a time and
+# times each from being typed to the first byte of output coming back. Every
+# workload gets a fresh copy of the A: disk from cpm/, and is reported as one
+# JSON line with the latency percentiles in microseconds. Keys with no output
+# at all within a second are counted as no_echo instead.
+#
+#   -l load      Number of busy processes running alongside (default 0), one
+#                per CPU keeps the host saturated
+#   -i interval  Milliseconds between keys (default 100)
+#
+# Workloads:
+#   ccp     Command lines typed at the CCP
+#   mbasic  Typing in, listing and running a short MBASIC program
+#   zde     Editing a new file in ZDE, a WordStar style editor
+#
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(dirname "$BENCH")
+ECHOLAT=$ROOT/runcpm/echolat
+
+LOAD=0
+INTERVAL=100
+while getopts l:i: option; do
+	case $option in
+	l) LOAD=$OPTARG ;;
+	i) INTERVAL=$OPTARG ;;
+	*) exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 [-l load] [-i interval] runner [workload ...]" >&2
+	exit 2
+fi
+if [ ! -x "$ECHOLAT" ]; then
+	echo "$ECHOLAT not found, build it with make echolat in runcpm/." >&2
+	exit 1
+fi
+RUNNER=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shift
+WORKLOADS=${*:-"ccp mbasic zde"}
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/runcpm-latency.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+failed=0
+for name in $WORKLOADS; do
+	if [ ! -f "$BENCH/latency/$name.script" ]; then
+		echo "Unknown workload $name." >&2
+		exit 2
+	fi
+	echo "Running $name..." >&2
+	rm -rf "$WORK/A"
+	(cd "$WORK" && tar xzf "$ROOT/cpm/a.tar.gz") || exit 1
+	(cd "$WORK" && "$ECHOLAT" -l $LOAD -i $INTERVAL "$RUNNER" "$BENCH/latency/$name.script") || failed=1
+done
+exit $failed
@@ -0,0 +1,357 @@
+#include "defaults.h"
+
+#ifdef EMULATOR_ACCEL
+
+#include "globals.h"
+#include "cpu.h"
+#include "cpu_ops.h"
+#include "ram.h"
+#include "pal.h"
+#include "trap.h"
+#include "accel.h"
+
+#ifdef EMULATOR_OS_POSIX
+#include "itrace.h"
+#include "verify.h"
+#endif
+
+#ifdef DEBUG_LOG
+#include <stdio.h>
+#endif
+
+/*
+	Known runtime routines run natively
+
+	Every program the emulated CCP loads is searched for the byte signatures
+	of runtime routines known to be hot, and a trap (trap.c) is set on each
+	one found, so the routine runs natively with no setup from the user.
+	Signatures leave out the absolute addresses in the code, and a check on
+	the match makes sure the calls and jumps it makes go where the routine's
+	own do, so a routine is found wherever a build of the program puts it.
+
+	The handlers here do the rounds of a routine's loop that lead back to
+	its start natively, and leave the last round, the one that returns, to
+	the guest code. That round sets every register the routine leaves, so
+	the result is exactly the guest's, only in fewer instructions. Before
+	each call a handler checks the signature still holds, in case an overlay
+	has replaced the code since.
+
+	Signatures come from the binaries themselves, not from memory:
+	  MBASIC 5.21 (BASIC-80 Rev. 5.21) FNDLNH, the search for a program
+	    line by number (GOTO, GOSUB, RESTORE, ...)
+	  MBASIC 5.21 BLTLOP, the downward block move of program text, arrays
+	    and strings
+	  MBASIC 5.21 FMULT and FDIV, the bit by bit loops at the core of the
+	    single precision multiply and divide (and of the functions built on
+	    them, SQR, LOG, EXP, SIN, ...)
+
+	Nothing is set while instructions are traced (-i) or an engine is
+	verified (-V), which need to see the guest code run. How often each
+	routine was found and called goes in the run statistics (-j).
+*/
+
+#define ACCEL_ANY -1	// Matches any byte
+#define ACCEL_END -2
+#define ACCEL_ROUNDS 4096	// Rounds a handler does at a time, then the guest runs one and traps again
+
+typedef struct {
+	const char *name;
+	const int16_t *pattern;
+	uint16_t trap;							// Where the trap goes, from the start of the match
+	uint8_t (*check)(uint16_t address);		// Whether the match at the trap address is the routine
+	trap_handler_t handler;
+} accel_sig_t;
+
+static uint8_t accel_match(const int16_t *pattern, uint16_t address) {
+	for (; *pattern != ACCEL_END; pattern++, address++) {
+		if (*pattern != ACCEL_ANY && ram_read(address) != *pattern)
+			return(0);
+	}
+	return(1);
+}
+
+/*===============================================================================*/
+/* MBASIC 5.21                                                                   */
+/*===============================================================================*/
+
+// DCOMPR, compares HL with DE
+static const int16_t accel_mbasic_dcompr[] = { 0x7c, 0x92, 0xc0, 0x7d, 0x93, 0xc9, ACCEL_END };
+
+static const int16_t accel_mbasic_fndlnh[] = {
+	0x44, 0x4d, 0x7e, 0x23, 0xb6, 0x2b, 0xc8, 0x23,			// MOV B,H; MOV C,L; MOV A,M; INX H; ORA M; DCX H; RZ; INX H
+	0x23, 0x7e, 0x23, 0x66, 0x6f, 0xcd, ACCEL_ANY, ACCEL_ANY,	// INX H; MOV A,M; INX H; MOV H,M; MOV L,A; CALL DCOMPR
+	0x60, 0x69, 0x7e, 0x23, 0x66, 0x6f, 0x3f, 0xc8,			// MOV H,B; MOV L,C; MOV A,M; INX H; MOV H,M; MOV L,A; CMC; RZ
+	0x3f, 0xd0, 0xc3, ACCEL_ANY, ACCEL_ANY, ACCEL_END		// CMC; RNC; JMP FNDLNH
+};
+
+static const int16_t accel_mbasic_bltlop[] = {
+	0xcd, ACCEL_ANY, ACCEL_ANY, 0x7e, 0x02, 0xc8, 0x0b, 0x2b,	// CALL DCOMPR; MOV A,M; STAX B; RZ; DCX B; DCX H
+	0xc3, ACCEL_ANY, ACCEL_ANY, ACCEL_END						// JMP BLTLOP
+};
+
+// The CALL at call goes to DCOMPR and the JMP at jump back to the trap
+static uint8_t accel_mbasic_loop(uint16_t address, uint16_t call, uint16_t jump) {
+	return(accel_match(accel_mbasic_dcompr, ram_read16(address + call + 1)) && ram_read16(address + jump + 1) == address);
+}
+
+static uint8_t accel_mbasic_fndlnh_check(uint16_t address) {
+	return(accel_mbasic_loop(address, 13, 26));
+}
+
+static uint8_t accel_mbasic_bltlop_check(uint16_t address) {
+	return(accel_mbasic_loop(address, 0, 8));
+}
+
+// Walks the links from the line at HL past the lines numbered below DE
+static uint8_t accel_mbasic_fndlnh_run(uint16_t address, void *data) {
+	uint16_t hl = CPU_WORD16(cpu_regs.hl);
+	uint16_t de = CPU_WORD16(cpu_regs.de);
+	uint16_t link;
+	uint32_t rounds = 0;
+
+	while (rounds < ACCEL_ROUNDS) {
+		link = ram_read16(hl);
+		if (!link || ram_read16(hl + 2) >= de)
+			break;
+		hl = link;
+		rounds++;
+	}
+	if (rounds) {
+		cpu_regs.hl = hl;
+		ram_write16(CPU_WORD16(cpu_regs.sp - 2), address + 16);	// What the last CALL DCOMPR left below the stack
+	}
+	return(TRAP_PASS);
+}
+
+// Moves bytes down from HL to BC until HL gets to DE
+static uint8_t accel_mbasic_bltlop_run(uint16_t address, void *data) {
+	uint16_t hl = CPU_WORD16(cpu_regs.hl);
+	uint16_t bc = CPU_WORD16(cpu_regs.bc);
+	uint16_t de = CPU_WORD16(cpu_regs.de);
+	uint32_t rounds = 0;
+
+	while (hl != de && rounds < ACCEL_ROUNDS) {
+		ram_write(bc--, ram_read(hl--));
+		rounds++;
+	}
+	if (rounds) {
+		cpu_regs.hl = hl;
+		cpu_regs.bc = bc;
+		ram_write16(CPU_WORD16(cpu_regs.sp - 2), address + 3);
+	}
+	return(TRAP_PASS);
+}
+
+// FMULT's inner loop, a round for each bit of a byte of the multiplier. FMULT
+// patches the multiplicand into the LXI D and ACI operands before it starts
+static const int16_t accel_mbasic_fmult[] = {
+	0x1f, 0x57, 0x79, 0xd2, ACCEL_ANY, ACCEL_ANY,			// RAR; MOV D,A; MOV A,C; JNC FMULT5
+	0xd5, 0x11, ACCEL_ANY, ACCEL_ANY, 0x19, 0xd1, 0xce, ACCEL_ANY,	// PUSH D; LXI D,low; DAD D; POP D; ACI high
+	0x1f, 0x4f, 0x7c, 0x1f, 0x67, 0x7d, 0x1f, 0x6f,			// FMULT5: RAR; MOV C,A; MOV A,H; RAR; MOV H,A; MOV A,L; RAR; MOV L,A
+	0x78, 0x1f, 0x47, 0xe6, 0x10, 0xca, ACCEL_ANY, ACCEL_ANY,	// MOV A,B; RAR; MOV B,A; ANI 10H; JZ FMULT6
+	0x78, 0xf6, 0x20, 0x47, 0x1d, 0x7a, 0xc2, ACCEL_ANY,		// MOV A,B; ORI 20H; MOV B,A; FMULT6: DCR E; MOV A,D; JNZ FMULT4
+	ACCEL_ANY, ACCEL_END
+};
+
+// FDIV's inner loop, a round for each bit of the quotient. FDIV patches the
+// divisor into the SUI and SBI operands, and the MVI A operand holds the
+// top byte of the remainder
+static const int16_t accel_mbasic_fdiv[] = {
+	0xe5, 0xc5, 0x7d, 0xd6, ACCEL_ANY, 0x6f, 0x7c, 0xde,		// PUSH H; PUSH B; MOV A,L; SUI low; MOV L,A; MOV A,H; SBI middle
+	ACCEL_ANY, 0x67, 0x78, 0xde, ACCEL_ANY, 0x47, 0x3e, ACCEL_ANY,	// MOV H,A; MOV A,B; SBI high; MOV B,A; MVI A,top
+	0xde, 0x00, 0x3f, 0xd2, ACCEL_ANY, ACCEL_ANY, 0x32, ACCEL_ANY,	// SBI 0; CMC; JNC FDIV2; STA top
+	ACCEL_ANY, 0xf1, 0xf1, 0x37, 0xd2, 0xc1, 0xe1, 0x79,		// POP PSW; POP PSW; STC; JNC (FDIV2: POP B; POP H); MOV A,C
+	0x3c, 0x3d, 0x1f, 0xf2, ACCEL_ANY, ACCEL_ANY, 0x17, 0x3a,	// INR A; DCR A; RAR; JP FDIV3; RAL; LDA top
+	ACCEL_ANY, ACCEL_ANY, 0x1f, 0xe6, 0xc0, 0xf5, 0x78, 0xb4,	// RAR; ANI 0C0H; PUSH PSW; MOV A,B; ORA H
+	0xb5, 0xca, ACCEL_ANY, ACCEL_ANY, 0x3e, 0x20, 0xe1, 0xb4,	// ORA L; JZ FDIV4; MVI A,20H; FDIV4: POP H; ORA H
+	0xc3, ACCEL_ANY, ACCEL_ANY, 0x17, 0x7b, 0x17, 0x5f, 0x7a,	// JMP ROUNDB; FDIV3: RAL; MOV A,E; RAL; MOV E,A; MOV A,D
+	0x17, 0x57, 0x79, 0x17, 0x4f, 0x29, 0x78, 0x17,			// RAL; MOV D,A; MOV A,C; RAL; MOV C,A; DAD H; MOV A,B; RAL
+	0x47, 0x3a, ACCEL_ANY, ACCEL_ANY, 0x17, 0x32, ACCEL_ANY, ACCEL_ANY,	// MOV B,A; LDA top; RAL; STA top
+	0x79, 0xb2, 0xb3, 0xc2, ACCEL_ANY, ACCEL_ANY, 0xe5, 0x21,	// MOV A,C; ORA D; ORA E; JNZ FDIV1; PUSH H; LXI H,FACEXP
+	ACCEL_ANY, ACCEL_ANY, 0x35, 0xe1, 0xc2, ACCEL_ANY, ACCEL_ANY, ACCEL_END	// DCR M; POP H; JNZ FDIV1
+};
+
+// The jumps of the loop go where FMULT's own do
+static uint8_t accel_mbasic_fmult_check(uint16_t address) {
+	return(ram_read16(address + 4) == address + 14 && ram_read16(address + 28) == address + 34 && ram_read16(address + 37) == address);
+}
+
+// The jumps of the loop go where FDIV's own do, and the LDA and STA are of the MVI A operand
+static uint8_t accel_mbasic_fdiv_check(uint16_t address) {
+	return(ram_read16(address + 20) == address + 29 && ram_read16(address + 23) == address + 15 &&
+		ram_read16(address + 36) == address + 59 && ram_read16(address + 40) == address + 15 &&
+		ram_read16(address + 50) == address + 54 && ram_read16(address + 74) == address + 15 &&
+		ram_read16(address + 78) == address + 15 && ram_read16(address + 84) == address && ram_read16(address + 93) == address);
+}
+
+// Rotates x right through carry, as RAR does
+static uint8_t accel_rar(uint8_t x, uint8_t *carry) {
+	uint8_t out = (uint8_t)(*carry << 7 | x >> 1);
+
+	*carry = x & 1;
+	return(out);
+}
+
+// Shifts the multiplier in A right a bit at a time, adding the multiplicand to
+// the product in C, H, L for every bit set, and shifting the product right into
+// B, which keeps a sticky bit (20H) for the rounding. E counts the bits
+static uint8_t accel_mbasic_fmult_run(uint16_t address, void *data) {
+	uint8_t a = CPU_REG_GET_HIGH(cpu_regs.af);
+	uint8_t b = CPU_REG_GET_HIGH(cpu_regs.bc);
+	uint8_t c = CPU_REG_GET_LOW(cpu_regs.bc);
+	uint8_t d = CPU_REG_GET_HIGH(cpu_regs.de);
+	uint8_t e = CPU_REG_GET_LOW(cpu_regs.de);
+	uint8_t h = CPU_REG_GET_HIGH(cpu_regs.hl);
+	uint8_t l = CPU_REG_GET_LOW(cpu_regs.hl);
+	uint8_t carry = TST_FLAG(C);
+	uint16_t low = ram_read16(address + 8);
+	uint8_t high = ram_read(address + 13);
+	uint16_t pushed = 0, sum;
+	uint32_t rounds = 0;
+
+	while (e > 1) {
+		d = accel_rar(a, &carry);
+		a = c;
+		if (carry) {
+			pushed = (uint16_t)(d << 8 | e);
+			sum = (uint16_t)(h << 8 | l) + low;
+			carry = sum < low;
+			h = (uint8_t)(sum >> 8);
+			l = (uint8_t)sum;
+			sum = a + high + carry;
+			a = (uint8_t)sum;
+			carry = sum > 0xff;
+		}
+		c = accel_rar(a, &carry);
+		h = accel_rar(h, &carry);
+		l = accel_rar(l, &carry);
+		b = accel_rar(b, &carry);
+		if (b & 0x10)
+			b |= 0x20;
+		carry = 0;	// ANI and ORI leave it clear for the next RAR
+		e--;
+		a = d;
+		rounds++;
+	}
+	if (rounds) {
+		CPU_REG_SET_HIGH(cpu_regs.af, a);
+		SET_FLAG(C, 0);
+		cpu_regs.bc = b << 8 | c;
+		cpu_regs.de = d << 8 | e;
+		cpu_regs.hl = h << 8 | l;
+		if (pushed)
+			ram_write16(CPU_WORD16(cpu_regs.sp - 2), pushed);	// What the last PUSH D left below the stack
+	}
+	return(TRAP_PASS);
+}
+
+// Divides the remainder in top, B, H, L by the divisor a bit at a time, shifting
+// the bits of the quotient into C, D, E until the top one gets to C's bit 7.
+// While the quotient is still 0 each round takes one off the exponent instead
+static uint8_t accel_mbasic_fdiv_run(uint16_t address, void *data) {
+	uint32_t remainder = (uint32_t)ram_read(address + 15) << 24 | (uint32_t)CPU_REG_GET_HIGH(cpu_regs.bc) << 16 | CPU_WORD16(cpu_regs.hl);
+	uint32_t divisor = (uint32_t)ram_read(address + 12) << 16 | ram_read(address + 8) << 8 | ram_read(address + 4);
+	uint32_t quotient = (uint32_t)CPU_REG_GET_LOW(cpu_regs.bc) << 16 | CPU_WORD16(cpu_regs.de);
+	uint16_t exponent = ram_read16(address + 88);
+	uint8_t exp = ram_read(exponent);
+	uint16_t pushed_hl = 0, pushed_bc = 0;
+	uint32_t next, shifted, rounds = 0;
+	uint8_t bit;
+
+	while (!(quotient & 0x800000) && rounds < ACCEL_ROUNDS) {
+		bit = remainder >= divisor;
+		next = (bit ? remainder - divisor : remainder) << 1;
+		shifted = (quotient << 1 | bit) & 0xffffff;
+		if (!shifted && exp == 1)
+			break;	// The exponent underflows, the round does not lead back
+		pushed_hl = (uint16_t)remainder;
+		pushed_bc = (uint16_t)((remainder >> 8 & 0xff00) | quotient >> 16);
+		if (!shifted) {
+			exp--;
+			pushed_hl = (uint16_t)next;	// The PUSH H around the DCR M
+		}
+		quotient = shifted;
+		remainder = next;
+		rounds++;
+	}
+	if (rounds) {
+		ram_write(address + 15, (uint8_t)(remainder >> 24));
+		ram_write(exponent, exp);
+		cpu_regs.bc = (remainder >> 8 & 0xff00) | quotient >> 16;
+		cpu_regs.de = quotient & 0xffff;
+		cpu_regs.hl = remainder & 0xffff;
+		ram_write16(CPU_WORD16(cpu_regs.sp - 2), pushed_hl);	// What the last PUSH H and PUSH B left below the stack
+		ram_write16(CPU_WORD16(cpu_regs.sp - 4), pushed_bc);
+	}
+	return(TRAP_PASS);
+}
+
+/*===============================================================================*/
+/* Signatures                                                                    */
+/*===============================================================================*/
+
+// Patterns start with a byte that is not ACCEL_ANY
+static const accel_sig_t accel_sigs[] = {
+	{ "MBASIC 5.21 FNDLNH", accel_mbasic_fndlnh, 0, accel_mbasic_fndlnh_check, accel_mbasic_fndlnh_run },
+	{ "MBASIC 5.21 BLTLOP", accel_mbasic_bltlop, 0, accel_mbasic_bltlop_check, accel_mbasic_bltlop_run },
+	{ "MBASIC 5.21 FMULT", accel_mbasic_fmult, 0, accel_mbasic_fmult_check, accel_mbasic_fmult_run },
+	{ "MBASIC 5.21 FDIV", accel_mbasic_fdiv, 0, accel_mbasic_fdiv_check, accel_mbasic_fdiv_run }
+};
+
+#define ACCEL_SIGS (sizeof(accel_sigs) / sizeof(accel_sigs[0]))
+
+static uint64_t accel_installs[ACCEL_SIGS];
+static uint64_t accel_calls[ACCEL_SIGS];
+
+// Runs the routine's handler while the code at the trap is still the routine's
+static uint8_t accel_run(uint16_t address, void *data) {
+	const accel_sig_t *sig = (const accel_sig_t*)data;
+
+	if (!accel_match(sig->pattern, address - sig->trap) || !sig->check(address)) {
+		trap_clear(address);
+		return(TRAP_PASS);
+	}
+	GLB_COUNT(accel_calls[sig - accel_sigs], 1);
+	return(sig->handler(address, data));
+}
+
+// Sets a trap on every known routine found in the program loaded between start and end
+void accel_scan(uint16_t start, uint16_t end) {
+	const accel_sig_t *sig;
+	uint16_t address, trap;
+
+#ifdef EMULATOR_OS_POSIX
+	if (itrace_enabled || verify_enabled)
+		return;
+#endif
+	for (sig = accel_sigs; sig < accel_sigs + ACCEL_SIGS; sig++) {
+		for (address = start; address < end; address++) {
+			if (ram_read(address) != sig->pattern[0] || !accel_match(sig->pattern, address))
+				continue;
+			trap = address + sig->trap;
+			if (!sig->check(trap) || trap_set(trap, accel_run, (void*)sig))
+				continue;
+			GLB_COUNT(accel_installs[sig - accel_sigs], 1);
+#ifdef DEBUG_LOG
+			{
+				uint8_t buffer[64];
+
+				snprintf((char*)buffer, sizeof(buffer), "ACCEL %s at %04x\n", sig->name, trap);
+				pal_log_buffer(buffer);
+			}
+#endif
+		}
+	}
+}
+
+// Tells the name of routine i and how often it was set and run, returns 0 past the last one
+uint8_t accel_count(uint16_t i, const char **name, uint64_t *installs, uint64_t *calls) {
+	if (i >= ACCEL_SIGS)
+		return(0);
+	*name = accel_sigs[i].name;
+	*installs = accel_installs[i];
+	*calls = accel_calls[i];
+	return(1);
+}
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef _ACCEL_H
+#define _ACCEL_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+extern void accel_scan(uint16_t start, uint16_t end);
+extern uint8_t accel_count(uint16_t i, const char **name, uint64_t *installs, uint64_t *calls);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,147 @@
+#include "defaults.h"
+
+#ifdef EMULATOR_AOT
+
+#include "globals.h"
+#include "cpu.h"
+#include "ram.h"
+#include "pal.h"
+#include "trap.h"
+#include "aot.h"
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+	Runs the programs com2c translated (see aot.h)
+
+	The translations live in the directory given with -a, one shared object
+	per image, <hash>-<core>.so, hash being aot_hash of the image in 16
+	hexadecimal digits and core AOT_CORE, the cksum of the cpu.c this RunCPM
+	was built from, in 8. A translation that is there but cannot be used is
+	reported on the console, and the program runs on the interpreter. A
+	translation once opened stays open for the next runs of the
+	same program, up to EMULATOR_AOT_MODULES of them per machine.
+
+	The translated code is only entered when no traps are set (trap.c), as it
+	has no stop for them between instructions.
+*/
+
+typedef struct {
+	uint64_t hash;
+	aot_exec_t exec;
+} aot_module_t;
+
+#ifndef AOT_CORE
+#define AOT_CORE 0u	// Set by the Makefile
+#endif
+
+static const char *aot_dir = NULL;
+
+// Tells why a translation is not used, why names it
+static void aot_report(const char *why) {
+	pal_puts("Translation not used: ");
+	pal_puts(why);
+	pal_puts("\r\n");
+}
+
+static GLB_TLS aot_module_t aot_modules[EMULATOR_AOT_MODULES];
+static GLB_TLS uint8_t aot_next = 0;		// Slot the next module opened goes in
+static GLB_TLS aot_exec_t aot_exec = NULL;	// Translation of the program running, if any
+
+// Sets the directory translations are looked up in, returns 1 if it cannot be read
+uint8_t aot_init(const char *dir) {
+	FILE *file;
+	char path[1024];
+
+	snprintf(path, sizeof(path), "%s/.", dir);
+	file = fopen(path, "r");
+	if (!file)
+		return(1);
+	fclose(file);
+	aot_dir = dir;
+	return(0);
+}
+
+// Looks for a translation of the image from start to end, the program about to run, returns 1 if there is one
+uint8_t aot_load(uint16_t start, uint16_t end) {
+	char path[1024];
+	uint64_t hash;
+	void *handle;
+	const uint32_t *abi;
+	uint8_t i;
+
+	aot_exec = NULL;
+	if (!aot_dir || end <= start)
+		return(0);
+	hash = aot_hash(ram_base() + start, end - start);
+	for (i = 0; i < EMULATOR_AOT_MODULES; i++) {
+		if (aot_modules[i].exec && aot_modules[i].hash == hash) {
+			aot_exec = aot_modules[i].exec;
+			cpu_engine = aot_run;
+			return(1);
+		}
+	}
+	snprintf(path, sizeof(path), "%s/%016llx-%08x.so", aot_dir, (unsigned long long)hash, AOT_CORE);
+	if (access(path, F_OK))		// No translation of this program
+		return(0);
+	handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!handle) {
+		aot_report(dlerror());
+		return(0);
+	}
+	abi = (const uint32_t*)dlsym(handle, "aot_abi");
+	*(void**)(&aot_exec) = dlsym(handle, "aot_exec");
+	if (!abi || *abi != AOT_ABI || !aot_exec) {
+		strncat(path, ": made by another version of com2c", sizeof(path) - strlen(path) - 1);
+		aot_report(path);
+		aot_exec = NULL;
+		dlclose(handle);
+		return(0);
+	}
+	aot_modules[aot_next].hash = hash;
+	aot_modules[aot_next].exec = aot_exec;		// The one it replaces stays open, a run may still be using it
+	aot_next = (aot_next + 1) % EMULATOR_AOT_MODULES;
+	cpu_engine = aot_run;
+	return(1);
+}
+
+// Back to the reference engine once the program is done
+void aot_unload(void) {
+	aot_exec = NULL;
+	cpu_engine = NULL;
+}
+
+/*
+	The "aot" engine: translated code for as long as it goes, then the one
+	instruction it stopped at on the reference core. Without a translation
+	it is the reference core.
+*/
+uint8_t aot_run(uint32_t budget) {
+	aot_env_t env;
+	uint32_t ran;
+	uint8_t result;
+
+	env.regs = &cpu_regs;
+	env.ram = ram_base();
+	env.put_byte = PUT_BYTE;
+	env.put_word = PUT_WORD;
+	while (budget) {
+		if (aot_exec && !trap_count && !cpu_status) {
+			ran = aot_exec(&env, budget);
+			cpu_icount += ran;
+			budget -= ran;
+			if (!budget)
+				break;
+		}
+		result = cpu_engines[0].run(1);
+		budget--;
+		if (result != CPU_RUN_BUDGET)
+			return(result);
+	}
+	return(cpu_status ? CPU_RUN_STATUS : CPU_RUN_BUDGET);
+}
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef _AOT_H
+#define _AOT_H
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+/*
+	Programs translated ahead of time to native code
+
+	com2c (tools/com2c.c) turns the code it finds reachable in a .COM image
+	into C, copying every instruction from the reference core in cpu.c, and
+	compiles it into a shared object named after the FNV-1a hash of the image
+	and the cksum of cpu.c (AOT_CORE).
+	When RunCPM runs with -a and the program the CCP loaded has a translation
+	in that directory, it is run by the "aot" engine: the translated blocks
+	run natively, anything else (the BDOS and BIOS, ports, prefixed Z80
+	instructions, code never found or changed since) one instruction at a
+	time on the reference core, until the program gets back to translated
+	code. A block runs only if its bytes still are those com2c translated.
+*/
+
+#define AOT_ABI 1	// Bumped when aot_env_t or the generated code changes
+
+// What the generated code gets to run on
+typedef struct {
+	cpu_regs_t *regs;
+	uint8_t *ram;
+	void (*put_byte)(uint32_t address, uint32_t value);
+	void (*put_word)(uint32_t address, uint32_t value);
+} aot_env_t;
+
+// Runs translated blocks from regs->pc, up to budget instructions, and returns how many it ran
+typedef uint32_t (*aot_exec_t)(aot_env_t *env, uint32_t budget);
+
+// What translations are named after, the 64 bit FNV-1a hash of the image as loaded (in 128 byte records)
+static inline uint64_t aot_hash(const uint8_t *image, uint32_t len) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (len--) {
+		hash ^= *image++;
+		hash *= 0x100000001b3ULL;
+	}
+	return(hash);
+}
+
+#ifdef AOT_MODULE
+
+/*
+	For the generated code. The cpu.c instruction bodies run on *R, read M
+	directly and write through the env, so itrace and verify see the writes.
+	A write into the block being run marks it stale, it is left right after.
+	PC is only kept up to date where the code leaves, PCX not at all.
+*/
+#include <string.h>
+#include "cpu_ops.h"
+#include "cpu_tables.h"
+
+static inline uint8_t aot_get_byte(const uint8_t *ram, uint32_t address) {
+	return(ram[address & ADDRMASK]);
+}
+
+static inline uint16_t aot_get_word(const uint8_t *ram, uint32_t address) {
+	return(ram[address & ADDRMASK] | (ram[(address + 1) & ADDRMASK] << 8));
+}
+
+static inline uint32_t aot_put_byte(aot_env_t *env, uint32_t address, uint32_t value, uint32_t lo, uint32_t len) {
+	env->put_byte(address, value);
+	return(((address - lo) & ADDRMASK) < len);
+}
+
+static inline uint32_t aot_put_word(aot_env_t *env, uint32_t address, uint32_t value, uint32_t lo, uint32_t len) {
+	env->put_word(address, value);
+	return(((address - lo) & ADDRMASK) < len || ((address + 1 - lo) & ADDRMASK) < len);
+}
+
+#define cpu_regs (*R)
+#define GET_BYTE(a) aot_get_byte(M, (a))
+#define GET_WORD(a) aot_get_word(M, (a))
+#define PUT_BYTE(a, v) (stale |= aot_put_byte(E, (a), (v), lo, len))
+#define PUT_WORD(a, v) (stale |= aot_put_word(E, (a), (v), lo, len))
+
+// Enters the block at start, size bytes and count instructions, when it is unchanged and the budget allows
+#define AOT_BLOCK(start, size, count) \
+	if (budget < (count) || memcmp(M + (start), aot_image + (start) - AOT_ORIGIN, (size))) { \
+		cpu_regs.pc = (start); \
+		goto out; \
+	} \
+	budget -= (count); \
+	lo = (start); \
+	len = (size); \
+	stale = 0;
+
+// Leaves for the interpreter at to, left being how many of the block's count were not run
+#define AOT_LEAVE(to, left) { \
+		cpu_regs.pc = (to); \
+		budget += (left); \
+		goto out; \
+	}
+
+#else
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+extern uint8_t aot_init(const char *dir);
+extern uint8_t aot_load(uint16_t start, uint16_t end);
+extern void aot_unload(void);
+extern uint8_t aot_run(uint32_t budget);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef _CCP_H
 #define _CCP_H
 
+#include <stdint.h>
+
 #ifdef EMULATOR_CCP_INTERNAL
 extern unsigned char ccp_bin[];
 extern unsigned int ccp_len;
@@ -13,6 +15,9 @@ extern "C"
 {
 #endif
 extern void ccp(void);
+extern void ccp_command(const char *cmdline);
+extern uint8_t ccp_preload(const char *name);
+extern uint8_t ccp_run(const char *cmdline);
 #ifdef __cplusplus
 }
 #endif
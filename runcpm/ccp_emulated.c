@@ -2,6 +2,9 @@
 #include "globals.h"
 #include "ram.h"
 #include "pal.h"
+#include "trap.h"
+#include "accel.h"
+#include "aot.h"
 #include "disk.h"
 #include "cpu.h"
 #include "cpm.h"
@@ -43,14 +46,18 @@
 #define CCP_PG_SIZE 24                  // for TYPE
 
 // CCP global variables
-static uint8_t ccp_cur_drive;   // 0 -> 15 = A -> P	.. Current drive for the CCP (same as RAM[0x0004]
-static uint8_t ccp_par_drive;   // 0 -> 15 = A -> P .. Drive for the first file parameter
-static uint8_t ccp_cur_user;    // 0 -> 15			.. Current user aread to access
-static uint8_t ccp_s_flag;  //					.. Submit Flag
-static uint8_t ccp_prompt[5] = "\r\n >";
-static uint16_t ccp_pbuf;
-static uint16_t ccp_perr;
-static uint8_t ccp_blen;                            // Actual size of the typed command line (size of the buffer)
+static GLB_TLS uint8_t ccp_cur_drive;   // 0 -> 15 = A -> P	.. Current drive for the CCP (same as RAM[0x0004]
+static GLB_TLS uint8_t ccp_par_drive;   // 0 -> 15 = A -> P .. Drive for the first file parameter
+static GLB_TLS uint8_t ccp_cur_user;    // 0 -> 15			.. Current user aread to access
+static GLB_TLS uint8_t ccp_s_flag;  //					.. Submit Flag
+static GLB_TLS uint8_t ccp_prompt[5] = "\r\n >";
+static GLB_TLS uint16_t ccp_pbuf;
+static GLB_TLS uint16_t ccp_perr;
+static GLB_TLS uint8_t ccp_blen;                            // Actual size of the typed command line (size of the buffer)
+static GLB_TLS const char *ccp_once;                        // Command line to run once instead of reading the console
+static GLB_TLS uint8_t ccp_once_done;                       // Set after the one time command line was handed to the CCP
+static GLB_TLS uint16_t ccp_load_end = CCP_DEF_LOAD;                 // Where the program last loaded ends
+static GLB_TLS uint8_t ccp_preloaded[8];                    // Name of the program already sitting on the TPA (if any)
 
 static const char *ccp_commands[] =
 {
@@ -412,9 +419,8 @@ static uint8_t ccp_lua(void) {
 }
 #endif
 
-// External (.COM) command
-static uint8_t ccp_ext(void) {
-	uint8_t error = 1;
+// Loads the program on the Command FCB onto the TPA
+static uint8_t ccp_load(void) {
 	uint8_t found, drive, user = 0;
 	uint16_t load_addr = CCP_DEF_LOAD;
 
@@ -441,19 +447,54 @@ static uint8_t ccp_ext(void) {
 		}
 	}
 	if (found) {
-		pal_puts("\r\n");
 		ccp_bdos(CCP_F_DMAOFF, load_addr);
 		while (!ccp_bdos(CCP_F_READ, CCP_CMD_FCB)) {
 			load_addr += 128;
 			ccp_bdos(CCP_F_DMAOFF, load_addr);
 		}
 		ccp_bdos(CCP_F_DMAOFF, CCP_DEF_DMA);
+		ccp_load_end = load_addr;
+	}
 
-		if (user) {                                 // If a user was selected
-			user = 0;
-			ccp_bdos(CCP_F_USERNUM, ccp_cur_user);          // Set it back
-		}
-		ram_write(CCP_CMD_FCB, drive);
+	if (user) {                                 // If a user was selected
+		ccp_bdos(CCP_F_USERNUM, ccp_cur_user);          // Set it back
+	}
+	ram_write(CCP_CMD_FCB, drive);
+
+	return(found);
+}
+
+// Checks if the program on the Command FCB is the one preloaded onto the TPA
+static uint8_t ccp_is_preloaded(void) {
+	uint8_t i;
+
+	if (!ccp_preloaded[0] || ram_read(CCP_CMD_FCB))
+		return(0);
+	for (i = 0; i < 8; i++) {
+		if (ram_read(CCP_CMD_FCB + i + 1) != ccp_preloaded[i])
+			return(0);
+	}
+	return(1);
+}
+
+// External (.COM) command, newline is set when it was typed at the prompt
+static uint8_t ccp_ext(uint8_t newline) {
+	uint8_t error = 1;
+	uint8_t found;
+	uint16_t load_addr;
+
+	if (ccp_is_preloaded()) {
+		found = 1;
+		ram_write(CCP_CMD_FCB + 9, 'C');
+		ram_write(CCP_CMD_FCB + 10, 'O');
+		ram_write(CCP_CMD_FCB + 11, 'M');
+	} else {
+		found = ccp_load();
+	}
+	ccp_preloaded[0] = 0;                       // The TPA image is only good for the first run
+	if (found) {
+		if (newline)
+			pal_puts("\r\n");
 
 		// Place a trampoline to call the external command
 		// as it may return using RET instead of CCP_JP 0000h
@@ -467,18 +508,54 @@ static uint8_t ccp_ext(void) {
 		CPU_REG_SET_LOW(cpu_regs.bc, ram_read(0x0004)); // Sets C to the current drive/user
 		cpu_regs.pc = load_addr;        // Sets CP/M application jump point
 		cpu_regs.sp = GLB_BDOS_JUMP_PAGE;
+#ifdef EMULATOR_ACCEL
+#ifdef EMULATOR_AOT
+		if (!aot_load(CCP_DEF_LOAD, ccp_load_end))    // A translation runs all of the program natively, traps would keep it off
+#endif
+			accel_scan(CCP_DEF_LOAD, ccp_load_end);
+#elif defined(EMULATOR_AOT)
+		aot_load(CCP_DEF_LOAD, ccp_load_end);
+#endif
 
 		cpu_run();          // Starts simulation
+		trap_clear_all();
+#ifdef EMULATOR_AOT
+		aot_unload();
+#endif
 
 		error = 0;
 	}
 
-	if (user) {                                 // If a user was selected
-		ccp_bdos(CCP_F_USERNUM, ccp_cur_user);          // Set it back
+	return(error);
+}
+
+// Splits the command line at ccp_pbuf into the command FCB, the command tail at 0x0080 and the
+// parameter FCB, returns 1 if the command name is not valid and 2 if it is only a drive
+static uint8_t ccp_parse(void) {
+	uint8_t i;
+
+	ccp_init_fcb(CCP_CMD_FCB);                      // Initializes the command FCB
+
+	ccp_perr = ccp_pbuf;                                // Saves the pointer in case there's an error
+	if (ccp_name_to_fcb(CCP_CMD_FCB) > 8)           // Extracts the command from the buffer
+		return(1);
+
+	if (ram_read(CCP_CMD_FCB) && ram_read(CCP_CMD_FCB + 1) == ' ')
+		return(2);
+
+	ram_write(CCP_DEF_DMA, ccp_blen);                   // Move the command line at this point to 0x0080
+	for (i = 0; i < ccp_blen; i++) {
+		ram_write(CCP_DEF_DMA + i + 1, ram_read(ccp_pbuf + i));
 	}
-	ram_write(CCP_CMD_FCB, drive);
+	ram_write(CCP_DEF_DMA + i + 1, 0);
 
-	return(error);
+	while (ram_read(ccp_pbuf) == ' ' && ccp_blen) {     // Skips any leading spaces
+		ccp_pbuf++; ccp_blen--;
+	}
+
+	ccp_init_fcb(CCP_PAR_FCB);                      // Initializes the parameter FCB
+	ccp_name_to_fcb(CCP_PAR_FCB);                       // Loads the next file parameter onto the parameter FCB
+	return(0);
 }
 
 // Prints a command error
@@ -541,11 +618,65 @@ static void ccp_read_input(void) {
 			ccp_bdos(CCP_F_DELETE, GLB_BATCH_FCB_ADDR);         // Or else just deletes it
 			ccp_s_flag = 0;                             // and clears the submit flag
 		}
+	} else if (ccp_once && !ccp_once_done) {          // Is there a command line to run once?
+		for (i = 0; i < CMD_LEN && ccp_once[i]; i++)
+			ram_write(CCP_IN_BUFFER + i + 2, ccp_once[i]);
+		ram_write(CCP_IN_BUFFER + 1, i);
+		pal_put_con_ram(CCP_IN_BUFFER + 2, i);             // Echoes the command line as it is run, cut to CMD_LEN
+		ccp_once_done = 1;
 	} else {
 		ccp_bdos(CCP_C_READSTR, CCP_IN_BUFFER);             // Reads the command line from console
 	}
 }
 
+// Sets a command line to be run instead of reading the console
+// RunCPM ends once it (and any SUBMIT it started) is done
+void ccp_command(const char *cmdline) {
+	ccp_once = cmdline;
+	ccp_once_done = 0;
+}
+
+// Runs the program (a .COM, built in commands are not looked for) on a command line given by
+// a script (luah.c), as if it had been typed at the prompt, returns 1 if there is no such program
+uint8_t ccp_run(const char *cmdline) {
+	uint16_t pbuf = ccp_pbuf, perr = ccp_perr;
+	uint8_t blen = ccp_blen;
+	uint8_t line[CMD_LEN + 3];                          // The script's command line, which ccp_cmd_error may show yet
+	uint8_t i, result = 1;
+
+	ram_read_block(CCP_IN_BUFFER, line, sizeof(line));
+	for (i = 0; i < CMD_LEN && cmdline[i]; i++)
+		ram_write(CCP_IN_BUFFER + i + 2, cmdline[i]);
+	ram_write(CCP_IN_BUFFER + i + 2, 0);
+	ccp_pbuf = CCP_IN_BUFFER + 2;
+	ccp_blen = i;
+	while (ram_read(ccp_pbuf) == ' ' && ccp_blen) {     // Skips any leading spaces
+		ccp_pbuf++; ccp_blen--;
+	}
+	if (ccp_blen && !ccp_parse())
+		result = ccp_ext(0);
+
+	ram_write_block(CCP_IN_BUFFER, line, sizeof(line));
+	ccp_pbuf = pbuf;                                    // The script's own command line is still being run
+	ccp_perr = perr;
+	ccp_blen = blen;
+	return(result);
+}
+
+// Loads a program onto the TPA ahead of time, so running it skips the disk
+uint8_t ccp_preload(const char *name) {
+	uint8_t i;
+
+	ccp_init_fcb(CCP_CMD_FCB);
+	for (i = 0; i < 8 && name[i] && name[i] != '.'; i++)
+		ram_write(CCP_CMD_FCB + i + 1, toupper(name[i]));
+	if (!ccp_load())
+		return(1);
+	for (i = 0; i < 8; i++)
+		ccp_preloaded[i] = ram_read(CCP_CMD_FCB + i + 1);
+	return(0);
+}
+
 // Main CCP code
 void ccp(void) {
 
@@ -558,6 +689,10 @@ void ccp(void) {
 		ram_write(GLB_BATCH_FCB_ADDR + i, ram_read(GLB_TMP_FCB_ADDR + i));
 
 	while (1) {
+		if (ccp_once_done && !ccp_s_flag) {                     // The one time command line is done
+			cpu_status = 1;
+			break;
+		}
 		ccp_cur_drive = (uint8_t)ccp_bdos(CCP_DRV_GET, 0x0000);         // Get current drive
 		ccp_cur_user = (uint8_t)ccp_bdos(CCP_F_USERNUM, 0x00FF);            // Get current user
 		ram_write(0x0004, (ccp_cur_user << 4) + ccp_cur_drive); // Set user/drive on addr 0x0004
@@ -586,32 +721,16 @@ void ccp(void) {
 			if (ram_read(ccp_pbuf) == ';')                  // Found a comment line
 				continue;
 
-			ccp_init_fcb(CCP_CMD_FCB);                      // Initializes the command FCB
-
-			ccp_perr = ccp_pbuf;                                // Saves the pointer in case there's an error
-			if (ccp_name_to_fcb(CCP_CMD_FCB) > 8) {         // Extracts the command from the buffer
+			i = ccp_parse();
+			if (i == 1) {
 				ccp_cmd_error();                        // Command name cannot be non-unique or have an extension
 				continue;
 			}
-
-			if (ram_read(CCP_CMD_FCB) && ram_read(CCP_CMD_FCB + 1) == ' ') {    // Command was a simple drive select
+			if (i == 2) {                               // Command was a simple drive select
 				ccp_bdos(CCP_DRV_SET, ram_read(CCP_CMD_FCB) - 1);
 				continue;
 			}
 
-			ram_write(CCP_DEF_DMA, ccp_blen);                   // Move the command line at this point to 0x0080
-			for (i = 0; i < ccp_blen; i++) {
-				ram_write(CCP_DEF_DMA + i + 1, ram_read(ccp_pbuf + i));
-			}
-			ram_write(CCP_DEF_DMA + i + 1, 0);
-
-			while (ram_read(ccp_pbuf) == ' ' && ccp_blen) {     // Skips any leading spaces
-				ccp_pbuf++; ccp_blen--;
-			}
-
-			ccp_init_fcb(CCP_PAR_FCB);                      // Initializes the parameter FCB
-			ccp_name_to_fcb(CCP_PAR_FCB);                       // Loads the next file parameter onto the parameter FCB
-
 			i = 0;                                  // Checks if the command is valid and executes
 			switch (ccp_cnum()) {
 			case 0:     // DIR
@@ -634,7 +753,7 @@ void ccp(void) {
 			case 8:     // EXIT
 				cpu_status = 1;         break;
 			case 255:   // It is an external command
-				i = ccp_ext();
+				i = ccp_ext(1);
 #ifdef EMULATOR_HAS_LUA
 				if (i)
 					i = ccp_lua();
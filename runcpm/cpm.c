@@ -5,11 +5,24 @@
 #include "ram.h"
 #include "disk.h"
 #include "pal.h"
+#include "trap.h"
 
 #ifdef EMULATOR_HAS_LUA
 #include "luah.h"
 #endif
 
+#ifdef EMULATOR_OS_POSIX
+#include "stats.h"
+#include "trace.h"
+#include "replay.h"
+#else
+#define STATS_CALL_BEGIN(start)
+#define STATS_CALL_END(kind, function, start)
+#define TRACE_CALL_BEGIN(record, kind, function)
+#define TRACE_CALL_END(record)
+#define REPLAY_CLOCK(value) (value)
+#endif
+
 /* see main.c for definition */
 
 #define NOP     0x00
@@ -102,27 +115,38 @@ static void cpm_patch(void) {
 }
 
 
-void cpm_loop() {
-	while (1) {
+static GLB_TLS uint8_t cpm_warm = 0;	// Set when the CCP is already loaded and page zero patched
+
+uint8_t cpm_init(void) {
 #ifdef GLB_CCP_FILE
-		if(!pal_file_exists((uint8_t*)GLB_CCP_NAME)) {
-			pal_puts("Unable to find CCP. CPU halted.\r\n");
-			break;
-		}
-		if (pal_load_file((uint8_t*)GLB_CCP_NAME, GLB_CCP_ADDR)) {
-			pal_puts("Unable to load CCP. CPU halted.\r\n");
-			break;
-		}
+	if(!pal_file_exists((uint8_t*)GLB_CCP_NAME)) {
+		pal_puts("Unable to find CCP. CPU halted.\r\n");
+		return(1);
+	}
+	if (pal_load_file((uint8_t*)GLB_CCP_NAME, GLB_CCP_ADDR)) {
+		pal_puts("Unable to load CCP. CPU halted.\r\n");
+		return(1);
+	}
 #else
 #ifdef EMULATOR_CCP_INTERNAL
-		if (pal_load_buffer(ccp_bin, ccp_len, GLB_CCP_ADDR)) {
-			fprintf(stderr, "%p %u\n",ccp_bin, ccp_len);
-			pal_puts("Unable to load CCP. CPU halted.\r\n");
-			break;
-		}
+	if (pal_load_buffer(ccp_bin, ccp_len, GLB_CCP_ADDR)) {
+		fprintf(stderr, "%p %u\n",ccp_bin, ccp_len);
+		pal_puts("Unable to load CCP. CPU halted.\r\n");
+		return(1);
+	}
 #endif
 #endif
-		cpm_patch();    // Patches the CP/M entry points and other things in
+	cpm_patch();    // Patches the CP/M entry points and other things in
+	cpm_warm = 1;
+	return(0);
+}
+
+void cpm_loop() {
+	while (1) {
+		if (!cpm_warm && cpm_init())
+			break;
+		cpm_warm = 0;	// Next time around the CCP gets reloaded
+		trap_clear_all();	// Traps do not outlive the program they were set for
 #ifdef EMULATOR_CCP_EMULATED
 		cpu_status=0;
 		ccp();
@@ -295,8 +319,43 @@ static void _log_bdos_out(uint8_t ch) {
 }
 #endif
 
+// Calls made by the guest, for BDOS call 248
+static GLB_TLS uint32_t cpm_bios_calls = 0;
+static GLB_TLS uint32_t cpm_bdos_calls[256];
+
+// Writes value at address as count little endian bytes
+static void cpm_put_counter(uint16_t address, uint64_t value, uint8_t count) {
+	while (count--) {
+		ram_write(address++, (uint8_t)value);
+		value >>= 8;
+	}
+}
+
+static uint8_t cpm_bcd(uint8_t value) {
+	return((value / 10) << 4 | value % 10);
+}
+
+// While cpu_run_for is running, a console input call with nothing to read returns to its caller instead of blocking
+static uint8_t cpm_input_wait(void) {
+	if (!cpu_yield || pal_kbhit())
+		return(0);
+	cpu_regs.pc = cpu_regs.pcx;     // The call is made again when the CPU resumes
+	cpu_status = CPU_STATUS_INPUT;
+	return(1);
+}
+
 void cpm_bios(void) {
 	uint8_t ch = CPU_REG_GET_LOW(cpu_regs.pcx);
+	uint64_t started = 0;
+#ifdef EMULATOR_OS_POSIX
+	trace_record_t traced = { 0 };
+#endif
+
+	if (ch == 0x09 && cpm_input_wait())
+		return;
+	STATS_CALL_BEGIN(started);
+	cpm_bios_calls++;
+	TRACE_CALL_BEGIN(traced, TRACE_BIOS, ch / 3);
 
 #ifdef DEBUG_LOG
 #ifdef DEBUG_LOG_ONLY
@@ -376,12 +435,23 @@ void cpm_bios(void) {
 #endif
 	_log_bios_out(ch);
 #endif
-
+	TRACE_CALL_END(traced);
+	STATS_CALL_END(STATS_BIOS, ch / 3, started);
 }
 
 void cpm_bdos(void) {
 	int32_t i, j, c, chr, count;
 	uint8_t ch = CPU_REG_GET_LOW(cpu_regs.bc);
+	uint64_t started = 0;
+#ifdef EMULATOR_OS_POSIX
+	trace_record_t traced = { 0 };
+#endif
+
+	if ((ch == 1 || ch == 10) && cpm_input_wait())
+		return;
+	STATS_CALL_BEGIN(started);
+	cpm_bdos_calls[ch]++;
+	TRACE_CALL_BEGIN(traced, TRACE_BDOS, ch);
 
 #ifdef DEBUG_LOG
 #ifdef DEBUG_LOG_ONLY
@@ -479,8 +549,11 @@ void cpm_bdos(void) {
 	   Sends the $ terminated string pointed by (cpu_regs.de) to the screen
 	 */
 	case 9:
-		while ((ch = ram_read(cpu_regs.de++)) != '$')
-			pal_put_con(ch);
+		count = 0;
+		while (ram_read(cpu_regs.de + count) != '$' && count < 0xffff)  // Finds the whole run
+			count++;
+		pal_put_con_ram(cpu_regs.de, count);
+		cpu_regs.de += count + 1;
 		break;
 	/*
 	   C = 10 (0Ah) : Buffered input
@@ -727,6 +800,21 @@ void cpm_bdos(void) {
 	case 40:
 		cpu_regs.hl = disk_write_rand(cpu_regs.de);
 		break;
+	/*
+	   C = 105 (69h) : Get date and time (CP/M 3)
+	   DE = Address of the 4 byte date and time: days since 31 Dec 1977 (word), hours and minutes (BCD)
+	   Returns: A = Seconds (BCD)
+	 */
+	case 105: {
+		uint16_t days;
+		uint8_t hours, minutes, seconds = pal_date_time(&days, &hours, &minutes);
+
+		ram_write16(cpu_regs.de, days);
+		ram_write(cpu_regs.de + 2, cpm_bcd(hours));
+		ram_write(cpu_regs.de + 3, cpm_bcd(minutes));
+		cpu_regs.hl = cpm_bcd(seconds);
+		break;
+	}
 	/*
 	   C = 220 (DCh) : PinMode
 	 */
@@ -757,6 +845,39 @@ void cpm_bdos(void) {
 	case 224:
 		pal_analog_set(CPU_REG_GET_HIGH(cpu_regs.de), CPU_REG_GET_LOW(cpu_regs.de));
 		break;
+	/*
+	   C = 248 (F8h) : Get performance counters
+	   DE = Address of a 28 byte buffer, filled with little endian counters:
+	     +0  Host monotonic clock, in microseconds (8 bytes)
+	     +8  Instructions executed, every repetition of a block instruction counts (8 bytes)
+	     +16 BDOS calls made, this one included (4 bytes)
+	     +20 BIOS calls made (4 bytes)
+	     +24 Calls made to the BDOS function whose number was at +24 on entry (4 bytes)
+	   Returns: A = 0x00
+	 */
+	case 248: {
+		uint32_t calls = 0;
+
+		for (i = 0; i < 256; i++)
+			calls += cpm_bdos_calls[i];
+		cpm_put_counter(cpu_regs.de, REPLAY_CLOCK(pal_clock_us()), 8);
+		cpm_put_counter(cpu_regs.de + 8, cpu_icount, 8);
+		cpm_put_counter(cpu_regs.de + 16, calls, 4);
+		cpm_put_counter(cpu_regs.de + 20, cpm_bios_calls, 4);
+		cpm_put_counter(cpu_regs.de + 24, cpm_bdos_calls[ram_read(cpu_regs.de + 24)], 4);
+		cpu_regs.hl = 0x0000;
+		break;
+	}
+#ifdef EMULATOR_OS_POSIX
+	/*
+	   C = 249 (F9h) : Trace BDOS and BIOS calls
+	   E = 0 - Off / 1 - On
+	   Returns: A = 0x00 - Was off / 0x01 - Was on / 0xFF - Tracing is not available
+	 */
+	case 249:
+		cpu_regs.hl = trace_set(CPU_REG_GET_LOW(cpu_regs.de));
+		break;
+#endif
 	/*
 	   C = 250 (FAh) : EMULATOR_HOSTOS
 	   Returns: A = 0x00 - Windows / 0x01 - Arduino / 0x02 - Posix / 0x03 - Dos
@@ -826,5 +947,6 @@ void cpm_bdos(void) {
 #endif
 	_log_bdos_out(ch);
 #endif
-
+	TRACE_CALL_END(traced);
+	STATS_CALL_END(STATS_BDOS, ch, started);
 }
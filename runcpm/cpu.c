@@ -4,24 +4,68 @@
 #include "cpm.h"
 #include "ram.h"
 #include "pal.h"
+#include "trap.h"
+#include "port.h"
+#include "aot.h"
+#include "spin.h"
+
+#ifdef EMULATOR_OS_POSIX
+#include "itrace.h"
+#include "verify.h"
+#else
+#define VERIFY_WRITE(address)
+#endif
 
 /* see main.c for definition */
 
-cpu_regs_t cpu_regs;
+GLB_TLS cpu_regs_t cpu_regs;
 
-int32_t cpu_status = 0; /* cpu_status of the CPU 0=running 1=end request 2=back to CCP */
-int32_t cpu_debug = 0;
-int32_t cpu_break = -1;
-int32_t cpu_step = -1;
+GLB_TLS int32_t cpu_status = 0; /* cpu_status of the CPU 0=running 1=end request 2=back to CCP */
+GLB_TLS int32_t cpu_debug = 0;
+GLB_TLS int32_t cpu_break = -1;
+GLB_TLS int32_t cpu_step = -1;
+GLB_TLS uint64_t cpu_icount = 0;
+GLB_TLS uint8_t cpu_yield = 0;
+GLB_TLS cpu_engine_run_t cpu_engine = NULL;
 
 /*
 	Functions needed by the soft CPU implementation
+
+	The IN and OUT on the BDOS and BIOS pages call them, any other goes to the
+	device bound to its port (port.h), or to the BDOS or BIOS if there is none.
 */
+
+/* Whether the IN or OUT just run is on the BDOS or the BIOS page, never a device's */
+#define CPU_CPM_PAGE() (CPU_REG_GET_HIGH(cpu_regs.pcx) == (GLB_BDOS_PAGE >> 8) || CPU_REG_GET_HIGH(cpu_regs.pcx) == (GLB_BIOS_PAGE >> 8))
+
 static void cpu_out(const uint32_t Port, const uint32_t Value) {
-  cpm_bios();
+  const port_device_t *device = &port_devices[Port & 0xff];
+
+#ifdef EMULATOR_OS_POSIX
+  if (verify_shadow) {
+    verify_port();      // Only the reference engine gets to call the BIOS or a device
+    return;
+  }
+#endif
+  if (device->out && !CPU_CPM_PAGE()) {
+    device->out(Port & 0xff, Value & 0xff);
+  } else {
+    cpm_bios();
+  }
 }
 
 uint32_t cpu_in(const uint32_t Port) {
+  const port_device_t *device = &port_devices[Port & 0xff];
+
+#ifdef EMULATOR_OS_POSIX
+  if (verify_shadow) {
+    verify_port();
+    return (CPU_REG_GET_HIGH(cpu_regs.af));
+  }
+#endif
+  if (device->in && !CPU_CPM_PAGE()) {
+    return (device->in(Port & 0xff));
+  }
   cpm_bdos();
   return (CPU_REG_GET_HIGH(cpu_regs.af));
 }
@@ -35,50 +79,7 @@ uint32_t cpu_in(const uint32_t Port) {
 #define STOP_INSTR      3   /* breakpoint   (instruction access)                */
 #define STOP_OPCODE     4   /* invalid operation encountered (8080, Z80, 8086)  */
 
-#define ADDRMASK        0xffff
-
-#define FLAG_C  1
-#define FLAG_N  2
-#define FLAG_P  4
-#define FLAG_H  16
-#define FLAG_Z  64
-#define FLAG_S  128
-
-#define SET_FLAG(f,c)    (cpu_regs.af = (c) ? cpu_regs.af | FLAG_ ## f : cpu_regs.af & ~FLAG_ ## f)
-#define TST_FLAG(f)      ((cpu_regs.af & FLAG_ ## f) != 0)
-
-#define PARITY(x)   _parity_table[(x) & 0xff]
-/*  SET_PV and SET_PV2 are used to provide correct PARITY flag semantics for the 8080 in cases
-  where the Z80 uses the overflow flag
-*/
-#define SET_PVS(s)  (((cbits >> 6) ^ (cbits >> 5)) & 4)
-#define SET_PV      (SET_PVS(sum))
-#define SET_PV2(x)  ((temp == (x)) << 2)
-
-#define POP(x)  {                               \
-    register uint32_t y = RAM_PP(cpu_regs.sp);             \
-    x = y + (RAM_PP(cpu_regs.sp) << 8);                  \
-  }
-
-#define JPC(cond) {                             \
-    if (cond) {                                 \
-      cpu_regs.pc = GET_WORD(cpu_regs.pc);                      \
-    }                                           \
-    else {                                      \
-      cpu_regs.pc += 2;                                \
-    }                                           \
-  }
-
-#define CALLC(cond) {                           \
-    if (cond) {                                 \
-      register uint32_t adrr = GET_WORD(cpu_regs.pc);    \
-      PUSH(cpu_regs.pc + 2);                           \
-      cpu_regs.pc = adrr;                              \
-    }                                           \
-    else {                                      \
-      cpu_regs.pc += 2;                                \
-    }                                           \
-  }
+#include "cpu_ops.h"
 
 /* the following tables precompute some common subexpressions
   _parity_table[i]          0..255  (number of 1's in i is odd) ? 0 : 4
@@ -119,10 +120,13 @@ uint8_t GET_BYTE(register uint32_t Addr) {
 }
 
 void PUT_BYTE(register uint32_t Addr, register uint32_t Value) {
+  VERIFY_WRITE(Addr);
   ram_write(Addr & ADDRMASK, Value);
 }
 
 void PUT_WORD(register uint32_t Addr, register uint32_t Value) {
+  VERIFY_WRITE(Addr);
+  VERIFY_WRITE(Addr + 1);
   ram_write(Addr & ADDRMASK, Value);
   ram_write((Addr + 1) & ADDRMASK, Value >> 8);
 }
@@ -131,18 +135,6 @@ uint16_t GET_WORD(register uint32_t a) {
   return GET_BYTE(a) | (GET_BYTE(a + 1) << 8);
 }
 
-#define RAM_MM(a)   GET_BYTE(a--)
-#define RAM_PP(a)   GET_BYTE(a++)
-
-#define PUT_BYTE_PP(a,v) PUT_BYTE(a++, v)
-#define PUT_BYTE_MM(a,v) PUT_BYTE(a--, v)
-#define MM_PUT_BYTE(a,v) PUT_BYTE(--a, v)
-
-#define PUSH(x) do {            \
-    MM_PUT_BYTE(cpu_regs.sp, (x) >> 8);  \
-    MM_PUT_BYTE(cpu_regs.sp, x);         \
-  } while (0)
-
 /*  Macros for the IN/OUT instructions INI/INIR/IND/INDR/OUTI/OTIR/OUTD/OTDR
 
   Pre condition
@@ -459,7 +451,27 @@ void cpu_debug_out(void) {
 }
 #endif
 
-void cpu_run(void) {
+/* Keeps a block instruction going while there is budget left for another repetition */
+#define BUDGET_MORE() (budget ? (budget--, 1) : 0)
+
+/* Brings cpu_icount up to date, so the BDOS and BIOS see the exact count */
+#define ICOUNT_SYNC() (cpu_icount += start - budget, start = budget)
+
+/* Hands a loop just branched back to at most 3 bytes to spin.c, which may fast-forward it */
+#ifdef EMULATOR_SPIN
+#define SPIN_CHECK() if ((uint16_t)(cpu_regs.pcx - cpu_regs.pc) <= 3) budget -= spin_skip(budget)
+#else
+#define SPIN_CHECK()
+#endif
+
+/*
+  Runs up to budget instructions. Block instructions (LDIR, CPIR, ...) count every
+  repetition and stop with PC back on the instruction when the budget runs out,
+  like the Z80 does between repetitions, so they resume exactly where they left.
+*/
+static uint8_t cpu_exec(uint32_t budget) {
+  uint32_t start = budget;
+  uint8_t result = CPU_RUN_BUDGET;
   register uint32_t temp = 0;
   register uint32_t acu = 0;
   register uint32_t sum;
@@ -469,11 +481,12 @@ void cpu_run(void) {
 
 
   /* main instruction fetch/decode loop */
-  while (1) {	/* loop until cpu_status != 0 */
+  while (1) {	/* loop until cpu_status != 0 or the budget is over */
 
-    if (cpu_status) {
+    if (cpu_status || !budget) {
         break;
     }
+    budget--;
 #ifdef DEBUG
     if (cpu_regs.pc == cpu_break) {
       pal_puts(":BREAK at ");
@@ -490,6 +503,13 @@ void cpu_run(void) {
     }
 #endif
 
+    if (TRAP_HIT(cpu_regs.pc)) {
+      ICOUNT_SYNC();
+      if (trap_run(cpu_regs.pc)) {  /* Done natively, RET included */
+        continue;
+      }
+    }
+
     cpu_regs.pcx = cpu_regs.pc;
 
     switch (RAM_PP(cpu_regs.pc)) {
@@ -574,9 +594,10 @@ void cpu_run(void) {
         break;
 
       case 0x10:      /* DJNZ dd */
-        if ((cpu_regs.bc -= 0x100) & 0xff00)
+        if ((cpu_regs.bc -= 0x100) & 0xff00) {
           cpu_regs.pc += (int8_t)GET_BYTE(cpu_regs.pc) + 1;
-        else
+          SPIN_CHECK();
+        } else
           cpu_regs.pc++;
         break;
 
@@ -657,8 +678,10 @@ void cpu_run(void) {
       case 0x20:      /* JR NZ,dd */
         if (TST_FLAG(Z))
           cpu_regs.pc++;
-        else
+        else {
           cpu_regs.pc += (int8_t)GET_BYTE(cpu_regs.pc) + 1;
+          SPIN_CHECK();
+        }
         break;
 
       case 0x21:      /* LD cpu_regs.hl,nnnn */
@@ -1065,6 +1088,7 @@ void cpu_run(void) {
         pal_getch();
 #endif
         cpu_regs.pc--;
+        result = CPU_RUN_HALT;
         goto end_decode;
         break;
 
@@ -1527,6 +1551,7 @@ void cpu_run(void) {
 
       case 0xc2:      /* JP NZ,nnnn */
         JPC(!TST_FLAG(Z));
+        SPIN_CHECK();
         break;
 
       case 0xc3:      /* JP nnnn */
@@ -1748,6 +1773,7 @@ cbshflg1:
         break;
 
       case 0xd3:      /* OUT (nn),A */
+        ICOUNT_SYNC();
         cpu_out(RAM_PP(cpu_regs.pc), CPU_REG_GET_HIGH(cpu_regs.af));
         break;
 
@@ -1794,6 +1820,7 @@ cbshflg1:
         break;
 
       case 0xdb:      /* IN A,(nn) */
+        ICOUNT_SYNC();
         CPU_REG_SET_HIGH(cpu_regs.af, cpu_in(RAM_PP(cpu_regs.pc)));
         break;
 
@@ -2858,9 +2885,11 @@ cbshflg2:
             do {
               acu = RAM_PP(cpu_regs.hl);
               PUT_BYTE_PP(cpu_regs.de, acu);
-            } while (--cpu_regs.bc);
+            } while (--cpu_regs.bc && BUDGET_MORE());
             acu += CPU_REG_GET_HIGH(cpu_regs.af);
-            cpu_regs.af = (cpu_regs.af & ~0x3e) | (acu & 8) | ((acu & 2) << 4);
+            cpu_regs.af = (cpu_regs.af & ~0x3e) | (acu & 8) | ((acu & 2) << 4) | ((cpu_regs.bc != 0) << 2);
+            if (cpu_regs.bc)
+              cpu_regs.pc = (cpu_regs.pc - 2) & ADDRMASK;
             break;
 
           case 0xb1:      /* CPIR */
@@ -2872,7 +2901,9 @@ cbshflg2:
               temp = RAM_PP(cpu_regs.hl);
               op = --cpu_regs.bc != 0;
               sum = acu - temp;
-            } while (op && sum != 0);
+            } while (op && sum != 0 && BUDGET_MORE());
+            if (op && sum != 0)
+              cpu_regs.pc = (cpu_regs.pc - 2) & ADDRMASK;
             cbits = acu ^ temp ^ sum;
             cpu_regs.af = (cpu_regs.af & ~0xfe) | (sum & 0x80) | (!(sum & 0xff) << 6) |
                           (((sum - ((cbits & 16) >> 4)) & 2) << 4) |
@@ -2890,7 +2921,14 @@ cbshflg2:
               acu = cpu_in(CPU_REG_GET_LOW(cpu_regs.bc));
               PUT_BYTE(cpu_regs.hl, acu);
               ++cpu_regs.hl;
-            } while (--temp);
+            } while (--temp && BUDGET_MORE());
+            if (temp) {
+              CPU_REG_SET_HIGH(cpu_regs.bc, temp);
+              temp++;
+              INOUTFLAGS_NONZERO((CPU_REG_GET_LOW(cpu_regs.bc) + 1) & 0xff);
+              cpu_regs.pc = (cpu_regs.pc - 2) & ADDRMASK;
+              break;
+            }
             temp = CPU_REG_GET_HIGH(cpu_regs.bc);
             CPU_REG_SET_HIGH(cpu_regs.bc, 0);
             INOUTFLAGS_ZERO((CPU_REG_GET_LOW(cpu_regs.bc) + 1) & 0xff);
@@ -2904,7 +2942,14 @@ cbshflg2:
               acu = GET_BYTE(cpu_regs.hl);
               cpu_out(CPU_REG_GET_LOW(cpu_regs.bc), acu);
               ++cpu_regs.hl;
-            } while (--temp);
+            } while (--temp && BUDGET_MORE());
+            if (temp) {
+              CPU_REG_SET_HIGH(cpu_regs.bc, temp);
+              temp++;
+              INOUTFLAGS_NONZERO(CPU_REG_GET_LOW(cpu_regs.hl));
+              cpu_regs.pc = (cpu_regs.pc - 2) & ADDRMASK;
+              break;
+            }
             temp = CPU_REG_GET_HIGH(cpu_regs.bc);
             CPU_REG_SET_HIGH(cpu_regs.bc, 0);
             INOUTFLAGS_ZERO(CPU_REG_GET_LOW(cpu_regs.hl));
@@ -2917,9 +2962,11 @@ cbshflg2:
             do {
               acu = RAM_MM(cpu_regs.hl);
               PUT_BYTE_MM(cpu_regs.de, acu);
-            } while (--cpu_regs.bc);
+            } while (--cpu_regs.bc && BUDGET_MORE());
             acu += CPU_REG_GET_HIGH(cpu_regs.af);
-            cpu_regs.af = (cpu_regs.af & ~0x3e) | (acu & 8) | ((acu & 2) << 4);
+            cpu_regs.af = (cpu_regs.af & ~0x3e) | (acu & 8) | ((acu & 2) << 4) | ((cpu_regs.bc != 0) << 2);
+            if (cpu_regs.bc)
+              cpu_regs.pc = (cpu_regs.pc - 2) & ADDRMASK;
             break;
 
           case 0xb9:      /* CPDR */
@@ -2931,7 +2978,9 @@ cbshflg2:
               temp = RAM_MM(cpu_regs.hl);
               op = --cpu_regs.bc != 0;
               sum = acu - temp;
-            } while (op && sum != 0);
+            } while (op && sum != 0 && BUDGET_MORE());
+            if (op && sum != 0)
+              cpu_regs.pc = (cpu_regs.pc - 2) & ADDRMASK;
             cbits = acu ^ temp ^ sum;
             cpu_regs.af = (cpu_regs.af & ~0xfe) | (sum & 0x80) | (!(sum & 0xff) << 6) |
                           (((sum - ((cbits & 16) >> 4)) & 2) << 4) |
@@ -2949,7 +2998,14 @@ cbshflg2:
               acu = cpu_in(CPU_REG_GET_LOW(cpu_regs.bc));
               PUT_BYTE(cpu_regs.hl, acu);
               --cpu_regs.hl;
-            } while (--temp);
+            } while (--temp && BUDGET_MORE());
+            if (temp) {
+              CPU_REG_SET_HIGH(cpu_regs.bc, temp);
+              temp++;
+              INOUTFLAGS_NONZERO((CPU_REG_GET_LOW(cpu_regs.bc) - 1) & 0xff);
+              cpu_regs.pc = (cpu_regs.pc - 2) & ADDRMASK;
+              break;
+            }
             temp = CPU_REG_GET_HIGH(cpu_regs.bc);
             CPU_REG_SET_HIGH(cpu_regs.bc, 0);
             INOUTFLAGS_ZERO((CPU_REG_GET_LOW(cpu_regs.bc) - 1) & 0xff);
@@ -2963,7 +3019,14 @@ cbshflg2:
               acu = GET_BYTE(cpu_regs.hl);
               cpu_out(CPU_REG_GET_LOW(cpu_regs.bc), acu);
               --cpu_regs.hl;
-            } while (--temp);
+            } while (--temp && BUDGET_MORE());
+            if (temp) {
+              CPU_REG_SET_HIGH(cpu_regs.bc, temp);
+              temp++;
+              INOUTFLAGS_NONZERO(CPU_REG_GET_LOW(cpu_regs.hl));
+              cpu_regs.pc = (cpu_regs.pc - 2) & ADDRMASK;
+              break;
+            }
             temp = CPU_REG_GET_HIGH(cpu_regs.bc);
             CPU_REG_SET_HIGH(cpu_regs.bc, 0);
             INOUTFLAGS_ZERO(CPU_REG_GET_LOW(cpu_regs.hl));
@@ -3646,5 +3709,62 @@ cbshflg3:
     }
   }
 end_decode:
-  ;
+  cpu_icount += start - budget;
+  if (cpu_status == CPU_STATUS_INPUT) {
+    cpu_status = 0;
+    result = CPU_RUN_INPUT;
+  } else if (cpu_status) {
+    result = CPU_RUN_STATUS;
+  }
+  return(result);
+}
+
+/*
+  Engines that run guest code, for lockstep verification (verify.c) against the
+  reference, this switch core. They all write guest memory through PUT_BYTE and
+  PUT_WORD and reach the BDOS and BIOS through cpu_in and cpu_out.
+*/
+const cpu_engine_t cpu_engines[] = {
+  { "reference", cpu_exec },
+#ifdef EMULATOR_AOT
+  { "aot", aot_run },
+#endif
+  { NULL, NULL }
+};
+
+/* Runs until cpu_status is set or a HALT, console input waits block */
+void cpu_run(void) {
+  cpu_engine_run_t run = cpu_engine ? cpu_engine : cpu_exec;
+  uint8_t yield = cpu_yield;
+
+  cpu_yield = 0;
+#ifdef EMULATOR_OS_POSIX
+  while (itrace_enabled) {  // One instruction at a time, so cpu_exec itself pays nothing for tracing
+    itrace_step();
+    if (cpu_exec(1) != CPU_RUN_BUDGET) {
+      cpu_yield = yield;
+      return;
+    }
+  }
+  while (verify_enabled) {  // Every block also run by the engine under verification and compared
+    if (verify_run() != CPU_RUN_BUDGET) {
+      cpu_yield = yield;
+      return;
+    }
+  }
+#endif
+  while (run(CPU_RUN_SLICE) == CPU_RUN_BUDGET)  // Slices keep cpu_icount current for the statistics
+    ;
+  cpu_yield = yield;
+}
+
+/* Runs up to budget instructions, returning early on console input waits, a HALT or cpu_status set */
+uint8_t cpu_run_for(uint32_t budget) {
+  uint8_t yield = cpu_yield;
+  uint8_t result;
+
+  cpu_yield = 1;
+  result = cpu_engine ? cpu_engine(budget) : cpu_exec(budget);
+  cpu_yield = yield;
+  return(result);
 }
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+#include "globals.h"
+
 typedef struct _cpu_regs_t {
 	int32_t de;
 	int32_t bc;
@@ -21,12 +23,32 @@ typedef struct _cpu_regs_t {
 	int32_t ir;
 } cpu_regs_t;
 
-extern cpu_regs_t cpu_regs;
+extern GLB_TLS cpu_regs_t cpu_regs;
+
+extern GLB_TLS int32_t cpu_status; /* Status of the CPU 0=running 1=end request 2=back to CCP */
+extern GLB_TLS int32_t cpu_debug;
+extern GLB_TLS int32_t cpu_break;
+extern GLB_TLS int32_t cpu_step;
+extern GLB_TLS uint64_t cpu_icount;	/* Instructions executed so far, every repetition of a block instruction counts, exact during BDOS and BIOS calls */
+extern GLB_TLS uint8_t cpu_yield;	/* Set while console input waits make cpu_run_for return */
+
+#define CPU_STATUS_INPUT 4	/* Internal cpu_status, a console input call has to wait */
+
+/* cpu_run_for results */
+#define CPU_RUN_BUDGET  0	/* The whole budget was used, resumes where it stopped */
+#define CPU_RUN_INPUT   1	/* Guest waits for console input, resumes by making the same call again */
+#define CPU_RUN_HALT    2	/* HALT instruction */
+#define CPU_RUN_STATUS  3	/* cpu_status was set (exit, warm boot or back to the CCP) */
+
+/* A CPU engine runs up to budget instructions on cpu_regs and RAM and returns a CPU_RUN_ result */
+typedef uint8_t (*cpu_engine_run_t)(uint32_t budget);
+
+typedef struct {
+	const char *name;
+	cpu_engine_run_t run;
+} cpu_engine_t;
 
-extern int32_t cpu_status; /* Status of the CPU 0=running 1=end request 2=back to CCP */
-extern int32_t cpu_debug;
-extern int32_t cpu_break;
-extern int32_t cpu_step;
+#define CPU_RUN_SLICE   1000000	/* Instructions cpu_run runs between updates of cpu_icount */
 
 #define CPU_LOW_DIGIT(x)            ((x) & 0xf)
 #define CPU_HIGH_DIGIT(x)           (((x) >> 4) & 0xf)
@@ -44,6 +66,11 @@ extern "C"
 #endif
 extern void cpu_reset(void);
 extern void cpu_run(void);
+extern uint8_t cpu_run_for(uint32_t budget);
+extern const cpu_engine_t cpu_engines[];	/* The reference engine first, NULL name last */
+extern GLB_TLS cpu_engine_run_t cpu_engine;	/* Engine cpu_run and cpu_run_for use, NULL for the reference */
+extern void PUT_BYTE(uint32_t Addr, uint32_t Value);
+extern void PUT_WORD(uint32_t Addr, uint32_t Value);
 #ifdef __cplusplus
 }
 #endif
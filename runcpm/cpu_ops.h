@@ -0,0 +1,68 @@
+#ifndef _CPU_OPS_H
+#define _CPU_OPS_H
+
+/*
+	Flag, stack and operand macros of the Z80 soft core, shared by cpu.c and
+	the code com2c translates from it (aot.h). They work on cpu_regs through
+	GET_BYTE, GET_WORD, PUT_BYTE and PUT_WORD, which whoever includes this
+	provides.
+*/
+
+#define ADDRMASK        0xffff
+
+#define FLAG_C  1
+#define FLAG_N  2
+#define FLAG_P  4
+#define FLAG_H  16
+#define FLAG_Z  64
+#define FLAG_S  128
+
+#define SET_FLAG(f,c)    (cpu_regs.af = (c) ? cpu_regs.af | FLAG_ ## f : cpu_regs.af & ~FLAG_ ## f)
+#define TST_FLAG(f)      ((cpu_regs.af & FLAG_ ## f) != 0)
+
+#define PARITY(x)   _parity_table[(x) & 0xff]
+/*  SET_PV and SET_PV2 are used to provide correct PARITY flag semantics for the 8080 in cases
+  where the Z80 uses the overflow flag
+*/
+#define SET_PVS(s)  (((cbits >> 6) ^ (cbits >> 5)) & 4)
+#define SET_PV      (SET_PVS(sum))
+#define SET_PV2(x)  ((temp == (x)) << 2)
+
+#define POP(x)  {                               \
+    register uint32_t y = RAM_PP(cpu_regs.sp);             \
+    x = y + (RAM_PP(cpu_regs.sp) << 8);                  \
+  }
+
+#define JPC(cond) {                             \
+    if (cond) {                                 \
+      cpu_regs.pc = GET_WORD(cpu_regs.pc);                      \
+    }                                           \
+    else {                                      \
+      cpu_regs.pc += 2;                                \
+    }                                           \
+  }
+
+#define CALLC(cond) {                           \
+    if (cond) {                                 \
+      register uint32_t adrr = GET_WORD(cpu_regs.pc);    \
+      PUSH(cpu_regs.pc + 2);                           \
+      cpu_regs.pc = adrr;                              \
+    }                                           \
+    else {                                      \
+      cpu_regs.pc += 2;                                \
+    }                                           \
+  }
+
+#define RAM_MM(a)   GET_BYTE(a--)
+#define RAM_PP(a)   GET_BYTE(a++)
+
+#define PUT_BYTE_PP(a,v) PUT_BYTE(a++, v)
+#define PUT_BYTE_MM(a,v) PUT_BYTE(a--, v)
+#define MM_PUT_BYTE(a,v) PUT_BYTE(--a, v)
+
+#define PUSH(x) do {            \
+    MM_PUT_BYTE(cpu_regs.sp, (x) >> 8);  \
+    MM_PUT_BYTE(cpu_regs.sp, x);         \
+  } while (0)
+
+#endif
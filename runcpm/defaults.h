@@ -40,6 +40,46 @@
 
 //#define EMULATOR_HAS_LUA
 
+/* Lua scripts (with EMULATOR_HAS_LUA) */
+#define EMULATOR_LUA_CACHE   64	// Compiled scripts kept in memory, the cache starts over when it fills up
+//#define EMULATOR_LUA_LUC	// Also keeps every compiled script on disk, as FOO.LUC next to FOO.LUA
+#define EMULATOR_LUA_MEMORY  (1024 * 1024)	// Bytes of Lua memory a script may take on top of what the shared state holds, 0 for no limit
+#define EMULATOR_LUA_POOL    16384	// Size of the chunks small Lua objects are carved from
+#define EMULATOR_RUNCOM_POLLS 100000	// Console status checks a program run by RunCom (posix) may make with its input used up before it is stopped
+
+/* Traps on guest addresses, run natively (trap.c) */
+#define EMULATOR_TRAPS 64	// Traps that may be set at once (at most 255)
+#define EMULATOR_ACCEL		// Runs the known runtime routines found in programs loaded natively (accel.c)
+
+/* Host devices on I/O ports (port.c) */
+#define EMULATOR_PVDMA_PORT 0xE8	// Port of the paravirtual DMA engine (pvdma.c)
+
+/* Console buffering (posix) */
+#define EMULATOR_CON_BUFFER    4096	// Size of the console output buffer, it is written out in one go when full
+#define EMULATOR_CON_FLUSH_MS  20	// Buffered console output is written out after at most this many milliseconds
+#define EMULATOR_CON_TYPEAHEAD 4096	// Number of characters read ahead from the console (must be a power of 2)
+
+/* Terminal screen model (posix, selected with -t) */
+#define EMULATOR_SCREEN_ROWS   24
+#define EMULATOR_SCREEN_COLS   80
+
+/* Run statistics (posix) */
+#define EMULATOR_STATS_PATH    "runcpm.json"	// Where SIGUSR1 writes the statistics when no -j file was given
+#define EMULATOR_STATS_FILES   64	// Number of host files I/O is counted for one by one (must be a power of 2)
+
+/* BDOS and BIOS call tracing (posix) */
+#define EMULATOR_TRACE_PATH    "runcpm.trace"	// Where the trace goes when it is started without a -x file
+#define EMULATOR_TRACE_RECORDS 65536	// Calls buffered for the trace writer, more are dropped (must be a power of 2)
+#define EMULATOR_TRACE_DRAIN_MS 5	// How long the trace writer sleeps when there is nothing to write
+
+/* Instruction tracing (posix, -i) */
+#define EMULATOR_ITRACE_CHUNK  (1 << 20)	// Bytes of encoded instructions gathered in memory before they are written out
+
+/* Lockstep verification of CPU engines (posix, -V and -z) */
+#define EMULATOR_VERIFY_BLOCK_MAX 65536	// Largest number of instructions compared at a time
+#define EMULATOR_VERIFY_PROGRAMS  100000	// Random programs -z runs through both engines
+#define EMULATOR_VERIFY_STEPS     1000	// Instructions every random program runs at most
+
 /* Definitions for file/console based debugging */
 //#define DEBUG
 //#define DEBUG_LOG	// Writes extensive call trace information to RunCPM.log
@@ -47,6 +87,17 @@
 //#define DEBUG_LOG_ONLY 22	// If defined will log only this BDOS (or BIOS) function
 #define DEBUG_LOG_PATH "runcpm.log"
 
+/* Programs translated ahead of time by com2c (posix, -a) */
+#if defined(EMULATOR_OS_POSIX) && !defined(DEBUG)	// The translated code stops at no breakpoint
+#define EMULATOR_AOT
+#endif
+#define EMULATOR_AOT_MODULES 16	// Translations kept open at once
+
+/* Delay loops fast-forwarded (spin.c) */
+#ifndef DEBUG	// Breakpoints and single steps see every round
+#define EMULATOR_SPIN
+#endif
+
 /* RunCPM version for the greeting header */
 #define EMULATOR_VERSION	 "2.9"
 #define EMULATOR_VERSION_BCD 0x29
@@ -6,6 +6,7 @@
 #include "disk.h"
 
 #include <ctype.h>
+#include <string.h>
 
 #define TO_HEX(x)   (x < 10 ? x + 48 : x + 87)
 
@@ -77,12 +78,13 @@ int disk_select_disk(uint8_t dr) {
 	return (result);
 }
 
-uint8_t fcb_to_hostname(uint16_t fcbaddr, uint8_t *file_name) {
+// Host name of the drive byte and 11 name bytes of an FCB, returns 0 if the name has wildcards
+static uint8_t disk_hostname(const uint8_t *fcb, uint8_t *file_name) {
 	uint8_t add_dot = 1;
 	uint8_t i = 0;
 	uint8_t unique = 1;
 
-	uint8_t dr = ram_read(CPM_FCB_DR(fcbaddr));
+	uint8_t dr = fcb[0];
 	if (dr) {
 		*(file_name++) = (dr - 1) + 'A';
 	} else {
@@ -96,7 +98,7 @@ uint8_t fcb_to_hostname(uint16_t fcbaddr, uint8_t *file_name) {
 #endif
 
 	while (i < 8) {
-		uint8_t fn = ram_read(CPM_FCB_FN(fcbaddr) + i);
+		uint8_t fn = fcb[1 + i];
 		if (fn > 32)
 			*(file_name++) = toupper(fn);
 		if (fn == '?')
@@ -105,7 +107,7 @@ uint8_t fcb_to_hostname(uint16_t fcbaddr, uint8_t *file_name) {
 	}
 	i = 0;
 	while (i < 3) {
-		uint8_t tp = ram_read(CPM_FCB_TP(fcbaddr) + i);
+		uint8_t tp = fcb[9 + i];
 		if (tp > 32) {
 			if (add_dot) {
 				add_dot = 0;
@@ -122,6 +124,47 @@ uint8_t fcb_to_hostname(uint16_t fcbaddr, uint8_t *file_name) {
 	return (unique);
 }
 
+uint8_t fcb_to_hostname(uint16_t fcbaddr, uint8_t *file_name) {
+	uint8_t fcb[12];
+	uint8_t i;
+
+	for (i = 0; i < 12; i++)
+		fcb[i] = ram_read(fcbaddr + i);
+	return (disk_hostname(fcb, file_name));
+}
+
+// Host name of a CP/M file name given as [d:]name[.ext], on the current user area, returns
+// the drive (0 = A:) or 0xff if it is not the name of a single file
+uint8_t disk_name_to_hostname(const char *name, uint8_t *file_name) {
+	uint8_t fcb[12];
+	uint8_t i = 1;
+
+	memset(fcb, ' ', sizeof(fcb));
+	fcb[0] = 0;
+	if (name[0] && name[1] == ':') {
+		if (toupper((uint8_t)name[0]) < 'A' || toupper((uint8_t)name[0]) > 'P')
+			return (0xff);
+		fcb[0] = toupper((uint8_t)name[0]) - 'A' + 1;
+		name += 2;
+	}
+	for (; *name && *name != '.'; name++) {
+		if (i == 9 || (uint8_t)*name <= 32 || strchr("<>,;:=?*[]|/\\", *name))
+			return (0xff);
+		fcb[i++] = *name;
+	}
+	if (i == 1)
+		return (0xff);
+	if (*name == '.') {
+		for (i = 9, name++; *name; name++) {
+			if (i == 12 || (uint8_t)*name <= 32 || strchr("<>.,;:=?*[]|/\\", *name))
+				return (0xff);
+			fcb[i++] = *name;
+		}
+	}
+	disk_hostname(fcb, file_name);
+	return (fcb[0] ? fcb[0] - 1 : glb_c_drive);
+}
+
 void fcb_hostname_to_fcb(uint16_t fcbaddr, uint8_t *file_name) {
 	uint8_t i = 0;
 
@@ -6,6 +6,20 @@
 #define GLB_STR_HELPER(x) #x
 #define GLB_STR(x) GLB_STR_HELPER(x)
 
+// Machine state is per thread when the session server runs a machine on every session thread
+#ifdef EMULATOR_HAS_SESSIONS
+#define GLB_TLS __thread
+#else
+#define GLB_TLS
+#endif
+
+// Adds n to a counter kept for the whole process, which every session thread may add to at once
+#ifdef EMULATOR_HAS_SESSIONS
+#define GLB_COUNT(counter, n) __atomic_add_fetch(&(counter), n, __ATOMIC_RELAXED)
+#else
+#define GLB_COUNT(counter, n) ((counter) += (n))
+#endif
+
 #if defined(EMULATOR_OS_DOS) || defined(EMULATOR_OS_WIN32)
 #define GLB_FOLDER_SEP '\\'
 #else
@@ -87,15 +101,15 @@
 #define GLB_CCP_BANNER      "\r\nRunCPM Version " EMULATOR_VERSION " (CP/M 2.2 " GLB_STR(EMULATOR_RAM_SIZE) "K)\r\n"
 
 /* Definition of global variables */
-extern uint8_t glb_file_name[17];       // Current filename in host filesystem format
-extern uint8_t glb_new_name[17];        // New filename in host filesystem format
-extern uint8_t glb_fcb_name[13];        // Current filename in CP/M format
-extern uint8_t glb_pattern[13];         // File matching pattern in CP/M format
-extern uint16_t glb_dma_addr;   // Current dmaAddr
-extern uint8_t glb_c_drive;             // Old selected drive
-extern uint8_t glb_o_drive;             // Currently selected drive
-extern uint8_t glb_user_code;       // Current user code
-extern uint16_t glb_ro_vector;
-extern uint16_t glb_login_vector;
+extern GLB_TLS uint8_t glb_file_name[17];       // Current filename in host filesystem format
+extern GLB_TLS uint8_t glb_new_name[17];        // New filename in host filesystem format
+extern GLB_TLS uint8_t glb_fcb_name[13];        // Current filename in CP/M format
+extern GLB_TLS uint8_t glb_pattern[13];         // File matching pattern in CP/M format
+extern GLB_TLS uint16_t glb_dma_addr;   // Current dmaAddr
+extern GLB_TLS uint8_t glb_c_drive;             // Old selected drive
+extern GLB_TLS uint8_t glb_o_drive;             // Currently selected drive
+extern GLB_TLS uint8_t glb_user_code;       // Current user code
+extern GLB_TLS uint16_t glb_ro_vector;
+extern GLB_TLS uint16_t glb_login_vector;
 
 #endif
@@ -0,0 +1,177 @@
+#include "defaults.h"
+
+#ifdef EMULATOR_OS_POSIX
+
+#include "globals.h"
+#include "cpu.h"
+#include "ram.h"
+#include "itrace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+	Instruction tracing
+
+	With -i every instruction the CPU executes is recorded, for looking into
+	guest misbehaviour that is hard to reproduce and for performance analysis
+	afterwards. Records are kept small enough to leave tracing on for whole
+	batch jobs: most instructions take one tag byte saying how far PC moved,
+	plus the registers they changed. The code bytes at PC are only recorded
+	the first time PC is traced in a chunk, and again when they are not those
+	recorded last, so programs loaded or modified while tracing still decode
+	right. Comparing them here, rather than noting every memory write, leaves
+	the CPU emulation with nothing to do for tracing when it is off. Records
+	are gathered in memory and written out a chunk at a time (see itrace.h for
+	the format).
+
+	tools/itrace2asm.c decodes a trace into disassembly, with symbol names.
+	Tracing is only available to the console machine.
+*/
+
+uint8_t itrace_enabled = 0;
+
+static FILE *itrace_file;
+static uint8_t *itrace_buffer;
+static uint8_t *itrace_out;
+static uint8_t *itrace_limit;		// Past here there may not be room for another record
+static uint64_t itrace_count = 0;	// Instructions traced
+static uint16_t itrace_pc;
+static uint16_t itrace_regs[7];		// AF, BC, DE, HL, SP, IX and IY as last traced
+static uint32_t itrace_generation = 1;	// Bumped to forget every address known
+static uint32_t itrace_known[65536];	// Addresses whose code is recorded, when equal to itrace_generation
+static uint32_t itrace_code[65536];	// The code recorded for them
+
+#define ITRACE_PUT16(out, v) do { *out++ = (uint8_t)(v); *out++ = (uint8_t)((v) >> 8); } while (0)
+#define ITRACE_PUT32(out, v) do { ITRACE_PUT16(out, v); ITRACE_PUT16(out, (v) >> 16); } while (0)
+
+static uint32_t itrace_bytes(uint16_t pc) {
+	return(ram_read(pc) | ram_read(pc + 1) << 8 | ram_read(pc + 2) << 16 | (uint32_t)ram_read(pc + 3) << 24);
+}
+
+// Writes out the chunk gathered so far, the next record starts a new one
+static void itrace_spill(void) {
+	uint32_t size = itrace_out - itrace_buffer;
+
+	if (size && (fwrite(&size, sizeof(size), 1, itrace_file) != 1 || fwrite(itrace_buffer, 1, size, itrace_file) != size)) {
+		itrace_enabled = 0;	// Out of disk, what was written so far still decodes
+		return;
+	}
+	itrace_out = itrace_buffer;
+}
+
+// Records from now on carry the code bytes again, for a chunk to decode by itself
+static void itrace_forget(void) {
+	if (!++itrace_generation)
+		itrace_generation = 1;
+}
+
+static void itrace_sync(void) {
+	uint8_t *out;
+	uint16_t pc = cpu_regs.pc;
+	uint32_t code = itrace_bytes(pc);
+	int i;
+
+	itrace_spill();
+	itrace_forget();
+	itrace_known[pc] = itrace_generation;
+	itrace_code[pc] = code;
+	itrace_pc = pc;
+	itrace_regs[0] = cpu_regs.af;
+	itrace_regs[1] = cpu_regs.bc;
+	itrace_regs[2] = cpu_regs.de;
+	itrace_regs[3] = cpu_regs.hl;
+	itrace_regs[4] = cpu_regs.sp;
+	itrace_regs[5] = cpu_regs.ix;
+	itrace_regs[6] = cpu_regs.iy;
+
+	out = itrace_out;
+	*out++ = ITRACE_SYNC;
+	ITRACE_PUT16(out, pc);
+	ITRACE_PUT32(out, code);
+	for (i = 0; i < 7; i++)
+		ITRACE_PUT16(out, itrace_regs[i]);
+	for (i = 0; i < 8; i++)
+		*out++ = (uint8_t)(itrace_count >> (i * 8));
+	itrace_out = out;
+	itrace_count++;
+}
+
+// Records the instruction about to be executed at cpu_regs.pc
+void itrace_step(void) {
+	uint8_t *out = itrace_out;
+	uint16_t pc = cpu_regs.pc;
+	uint16_t delta = pc - itrace_pc - 1;
+	uint16_t af = cpu_regs.af, bc = cpu_regs.bc, de = cpu_regs.de, hl = cpu_regs.hl;
+	uint16_t sp = cpu_regs.sp, ix = cpu_regs.ix, iy = cpu_regs.iy;
+	uint32_t code;
+	uint8_t tag, ext;
+
+	if (out > itrace_limit || !itrace_count) {
+		itrace_sync();
+		return;
+	}
+	tag = (delta > ITRACE_DELTA ? ITRACE_JUMP : delta) |
+		(af != itrace_regs[0]) << 4 | (bc != itrace_regs[1]) << 5 | (de != itrace_regs[2]) << 6 | (hl != itrace_regs[3]) << 7;
+	code = itrace_bytes(pc);
+	ext = (itrace_known[pc] != itrace_generation || itrace_code[pc] != code) | (sp != itrace_regs[4]) << 1 | (ix != itrace_regs[5]) << 2 | (iy != itrace_regs[6]) << 3;
+	if (ext)
+		tag |= ITRACE_EXT;
+
+	// The registers are stored whether they changed or not, and only kept by
+	// moving out past them when they did, as branching on which ones changed
+	// would be mispredicted most of the time
+	out[0] = tag;
+	out[1] = ext;
+	out += ext ? 2 : 1;
+	if (tag & ITRACE_JUMP)
+		ITRACE_PUT16(out, pc);
+	if (ext & ITRACE_CODE) {
+		itrace_known[pc] = itrace_generation;
+		itrace_code[pc] = code;
+		ITRACE_PUT32(out, code);
+	}
+	out[0] = (uint8_t)af; out[1] = af >> 8; out += (tag >> 3) & 2;
+	out[0] = (uint8_t)bc; out[1] = bc >> 8; out += (tag >> 4) & 2;
+	out[0] = (uint8_t)de; out[1] = de >> 8; out += (tag >> 5) & 2;
+	out[0] = (uint8_t)hl; out[1] = hl >> 8; out += (tag >> 6) & 2;
+	out[0] = (uint8_t)sp; out[1] = sp >> 8; out += ext & 2;
+	out[0] = (uint8_t)ix; out[1] = ix >> 8; out += (ext >> 1) & 2;
+	out[0] = (uint8_t)iy; out[1] = iy >> 8; out += (ext >> 2) & 2;
+
+	itrace_regs[0] = af;
+	itrace_regs[1] = bc;
+	itrace_regs[2] = de;
+	itrace_regs[3] = hl;
+	itrace_regs[4] = sp;
+	itrace_regs[5] = ix;
+	itrace_regs[6] = iy;
+	itrace_out = out;
+	itrace_pc = pc;
+	itrace_count++;
+}
+
+// Starts tracing every instruction to path, returns 0 on success
+uint8_t itrace_init(const char *path) {
+	itrace_buffer = (uint8_t*)malloc(EMULATOR_ITRACE_CHUNK);
+	itrace_file = fopen(path, "wb");
+	if (!itrace_buffer || !itrace_file || fwrite(ITRACE_MAGIC, 1, 8, itrace_file) != 8)
+		return(1);
+	itrace_out = itrace_buffer;	// The first record is a sync, as itrace_count is 0
+	itrace_limit = itrace_buffer + EMULATOR_ITRACE_CHUNK - ITRACE_RECORD_MAX;
+	itrace_enabled = 1;
+	return(0);
+}
+
+// Writes out what is left, for when RunCPM ends
+void itrace_flush(void) {
+	if (!itrace_file)
+		return;
+	if (itrace_enabled)
+		itrace_spill();
+	itrace_enabled = 0;
+	fflush(itrace_file);
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef _ITRACE_H
+#define _ITRACE_H
+
+#include <stdint.h>
+
+/*
+	Instruction trace file format
+
+	ITRACE_MAGIC, then chunks of a 32 bit byte count (host byte order) and that
+	many bytes of records, one record per instruction executed, each describing
+	the machine as the instruction starts. Every chunk begins with a sync record
+	and can be decoded by itself.
+
+	A record is a tag byte and what the tag says follows, in this order:
+	  ITRACE_EXT    an extension byte
+	  ITRACE_JUMP   the PC (2 bytes), otherwise PC is the previous PC plus
+	                the tag's low two bits plus one
+	  ITRACE_CODE   (extension) the 4 bytes at PC, when PC was not traced yet
+	                in this chunk or memory may have changed since
+	  ITRACE_AF..HL, ITRACE_SP..IY (extension) the registers that changed,
+	                2 bytes each
+	A sync record is the ITRACE_SYNC tag followed by the PC, the 4 bytes at PC,
+	AF, BC, DE, HL, SP, IX, IY and the number of instructions traced before it
+	(8 bytes). Multibyte values are little endian.
+*/
+#define ITRACE_MAGIC "RCPMITR1"
+
+#define ITRACE_DELTA  0x03
+#define ITRACE_JUMP   0x04
+#define ITRACE_SYNC   0x07	// The whole tag, never a combination of the bits above
+#define ITRACE_EXT    0x08
+#define ITRACE_AF     0x10
+#define ITRACE_BC     0x20
+#define ITRACE_DE     0x40
+#define ITRACE_HL     0x80
+
+#define ITRACE_CODE   0x01	// Extension byte bits
+#define ITRACE_SP     0x02
+#define ITRACE_IX     0x04
+#define ITRACE_IY     0x08
+
+#define ITRACE_RECORD_MAX 32	// Largest record, sync included
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+extern uint8_t itrace_enabled;
+extern uint8_t itrace_init(const char *path);
+extern void itrace_step(void);
+extern void itrace_flush(void);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
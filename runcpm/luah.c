@@ -8,14 +8,82 @@
 #include "disk.h"
 #include "pal.h"
 #include "ram.h"
+#include "ccp.h"
+#include "trap.h"
 
+#ifdef EMULATOR_OS_POSIX
+#include "stats.h"
+#include "replay.h"
+#else
+#define STATS_FILE(call)
+#define STATS_IO(kind, filename, bytes)
+#define REPLAY_FILE(filename)
+#endif
 
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
 #include "lua.h"
 
-static lua_State *L;
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+	Scripts share one Lua state, made when the first one runs and kept until
+	the machine ends, so running a script only costs loading and running it.
+	Each script gets a table of globals of its own, which falls back on the
+	shared ones (the libraries and the functions below), so what a script
+	leaves in its globals is gone when it ends.
+
+	Scripts are compiled once and kept as bytecode (lua_dump) in a registry
+	table keyed by host file name, behind the size and modification time of
+	the source they were compiled from, and a script that no longer matches
+	its source is compiled again. With EMULATOR_LUA_LUC the same goes to a
+	FOO.LUC file next to FOO.LUA as well, so it outlives RunCPM. Lua loads
+	bytecode without checking it, so that is for trusted disks only.
+
+	The state allocates through luah_alloc rather than the C library. Small
+	objects (up to LUAH_SMALL bytes, which is most strings, tables and
+	closures) come from free lists by size class, filled from chunks of
+	EMULATOR_LUA_POOL bytes that are only given back all at once, when the
+	state is closed. What a script can add to the state while it runs is
+	capped at EMULATOR_LUA_MEMORY bytes, past that it fails with "not enough
+	memory", and a full collection after each script hands its garbage
+	back to the pools for the next one.
+*/
+
+#define LUAH_CACHE "luah_cache"	// Registry field of the cache
+#define LUAH_STAMP 16		// Bytes of source size and modification time in front of the bytecode
+#define LUAH_TRAPS "luah_traps"	// Registry field of the functions set by SetTrap, by address
+
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t room;
+} luah_dump_t;
+
+#define LUAH_GRAIN 16		// Small objects are rounded up to a multiple of this
+#define LUAH_SMALL 256		// and bigger ones go to malloc
+#define LUAH_CLASSES (LUAH_SMALL / LUAH_GRAIN)
+
+typedef struct luah_chunk_s {
+	struct luah_chunk_s *next;
+	size_t used;
+} luah_chunk_t;
+
+typedef struct {
+	void *free[LUAH_CLASSES];	// Freed small blocks, one list per size class
+	luah_chunk_t *chunks;		// Chunks small blocks are carved from, newest first
+	size_t in_use;				// Bytes Lua holds
+	size_t limit;				// in_use may not grow past this, 0 for no limit
+} luah_arena_t;
+
+static GLB_TLS lua_State *L;
+static GLB_TLS int luah_cached = 0;	// Scripts put in the cache since it started over
+static GLB_TLS luah_arena_t luah_arena;
 
 // Lua "Trampoline" functions
 static int luah_bdos_call(lua_State *L) {
@@ -25,6 +93,8 @@ static int luah_bdos_call(lua_State *L) {
 	CPU_REG_SET_LOW(cpu_regs.bc, function);
 	cpu_regs.de = de;
 	cpm_bdos();
+	if (cpu_status == 1)		// CP/M is ending (the session's client went away), so does the script
+		return(luaL_error(L, "CP/M was ended"));
 	uint16_t result = cpu_regs.hl & 0xffff;
 
 	lua_pushinteger(L, result);
@@ -57,104 +127,892 @@ static int lua_ram_read16(lua_State *L) {
 
 static int lua_ram_write16(lua_State *L) {
 	uint16_t addr = (uint16_t)luaL_checkinteger(L, 1);
-	uint16_t value = (uint8_t)luaL_checkinteger(L, 2);
+	uint16_t value = (uint16_t)luaL_checkinteger(L, 2);
 
 	ram_write16(addr, value);
 	return(0);
 }
 
+// A length of guest memory, which can be anything up to all of it
+static uint32_t luah_check_len(lua_State *L, int arg) {
+	lua_Integer len = luaL_checkinteger(L, arg);
+
+	luaL_argcheck(L, len >= 0 && len <= 0x10000, arg, "length out of range");
+	return((uint32_t)len);
+}
+
+// Block functions, addresses wrap around at the top of memory like the Z80's do
+static int lua_ram_read_block(lua_State *L) {
+	uint16_t addr = (uint16_t)luaL_checkinteger(L, 1);
+	uint32_t len = luah_check_len(L, 2);
+	luaL_Buffer b;
+
+	ram_read_block(addr, (uint8_t*)luaL_buffinitsize(L, &b, len), len);
+	luaL_pushresultsize(&b, len);
+	return(1);
+}
+
+static int lua_ram_write_block(lua_State *L) {
+	uint16_t addr = (uint16_t)luaL_checkinteger(L, 1);
+	size_t len;
+	const char *data = luaL_checklstring(L, 2, &len);
+
+	luaL_argcheck(L, len <= 0x10000, 2, "longer than memory");
+	ram_write_block(addr, (const uint8_t*)data, (uint32_t)len);
+	return(0);
+}
+
+static int lua_ram_fill(lua_State *L) {
+	uint16_t addr = (uint16_t)luaL_checkinteger(L, 1);
+	uint32_t len = luah_check_len(L, 2);
+	uint8_t value = (uint8_t)luaL_checkinteger(L, 3);
+
+	ram_fill(addr, len, value);
+	return(0);
+}
+
+// Copies as memmove does, overlapping or not
+static int lua_ram_copy(lua_State *L) {
+	uint16_t to = (uint16_t)luaL_checkinteger(L, 1);
+	uint16_t from = (uint16_t)luaL_checkinteger(L, 2);
+	uint32_t len = luah_check_len(L, 3);
+	luaL_Buffer b;
+	uint8_t *buf = (uint8_t*)luaL_buffinitsize(L, &b, len);
+
+	ram_read_block(from, buf, len);
+	ram_write_block(to, buf, len);
+	return(0);
+}
+
+// Address of the first occurrence of a string in a range, or nil
+static int lua_ram_find(lua_State *L) {
+	uint16_t addr = (uint16_t)luaL_checkinteger(L, 1);
+	uint32_t len = luah_check_len(L, 2);
+	size_t n;
+	const char *what = luaL_checklstring(L, 3, &n);
+	luaL_Buffer b;
+	uint8_t *buf = (uint8_t*)luaL_buffinitsize(L, &b, len);
+	uint8_t *at = buf;
+
+	ram_read_block(addr, buf, len);
+	if (!n) {
+		lua_pushinteger(L, addr);
+		return(1);
+	}
+	while (n <= len - (at - buf) && (at = (uint8_t*)memchr(at, what[0], len - (at - buf) - n + 1))) {
+		if (!memcmp(at, what, n)) {
+			lua_pushinteger(L, (addr + (at - buf)) & 0xffff);
+			return(1);
+		}
+		at++;
+	}
+	lua_pushnil(L);
+	return(1);
+}
+
+// Ram[addr] reads and writes guest memory a byte at a time, #Ram is its size
+static int lua_ram_index(lua_State *L) {
+	lua_pushinteger(L, ram_read((uint16_t)luaL_checkinteger(L, 2)));
+	return(1);
+}
+
+static int lua_ram_newindex(lua_State *L) {
+	ram_write((uint16_t)luaL_checkinteger(L, 2), (uint8_t)luaL_checkinteger(L, 3));
+	return(0);
+}
+
+static int lua_ram_len(lua_State *L) {
+	lua_pushinteger(L, EMULATOR_RAM_SIZE * 1024);
+	return(1);
+}
+
+// The registers, the first ones in the order ReadReg and WriteReg number them
+static const struct {
+	const char *name;
+	size_t offset;	// In cpu_regs
+	uint8_t shift;
+	uint16_t mask;
+} luah_regs[] = {
+	{ "pcx", offsetof(cpu_regs_t, pcx), 0, 0xffff },	/* external view of PC                          */
+	{ "af",  offsetof(cpu_regs_t, af),  0, 0xffff },
+	{ "bc",  offsetof(cpu_regs_t, bc),  0, 0xffff },
+	{ "de",  offsetof(cpu_regs_t, de),  0, 0xffff },
+	{ "hl",  offsetof(cpu_regs_t, hl),  0, 0xffff },
+	{ "ix",  offsetof(cpu_regs_t, ix),  0, 0xffff },
+	{ "iy",  offsetof(cpu_regs_t, iy),  0, 0xffff },
+	{ "pc",  offsetof(cpu_regs_t, pc),  0, 0xffff },	/* program counter                              */
+	{ "sp",  offsetof(cpu_regs_t, sp),  0, 0xffff },
+	{ "af'", offsetof(cpu_regs_t, af1), 0, 0xffff },	/* alternate registers                          */
+	{ "bc'", offsetof(cpu_regs_t, bc1), 0, 0xffff },
+	{ "de'", offsetof(cpu_regs_t, de1), 0, 0xffff },
+	{ "hl'", offsetof(cpu_regs_t, hl1), 0, 0xffff },
+	{ "iff", offsetof(cpu_regs_t, iff), 0, 0xffff },	/* Interrupt Flip Flop                          */
+	{ "ir",  offsetof(cpu_regs_t, ir),  0, 0xffff },	/* Interrupt (upper) / Refresh (lower) register */
+	{ "a",   offsetof(cpu_regs_t, af),  8, 0xff },
+	{ "f",   offsetof(cpu_regs_t, af),  0, 0xff },
+	{ "b",   offsetof(cpu_regs_t, bc),  8, 0xff },
+	{ "c",   offsetof(cpu_regs_t, bc),  0, 0xff },
+	{ "d",   offsetof(cpu_regs_t, de),  8, 0xff },
+	{ "e",   offsetof(cpu_regs_t, de),  0, 0xff },
+	{ "h",   offsetof(cpu_regs_t, hl),  8, 0xff },
+	{ "l",   offsetof(cpu_regs_t, hl),  0, 0xff },
+	{ "i",   offsetof(cpu_regs_t, ir),  8, 0xff },
+	{ "r",   offsetof(cpu_regs_t, ir),  0, 0xff },
+};
+#define LUAH_REG_NUMBERS 15	// Registers ReadReg and WriteReg reach
+#define LUAH_REGS (sizeof(luah_regs) / sizeof(luah_regs[0]))
+
+#define LUAH_REG(i) (*(int32_t*)((char*)&cpu_regs + luah_regs[i].offset))
+
+static uint16_t luah_reg_get(int i) {
+	return((LUAH_REG(i) >> luah_regs[i].shift) & luah_regs[i].mask);
+}
+
+static void luah_reg_set(int i, uint16_t value) {
+	int32_t mask = luah_regs[i].mask << luah_regs[i].shift;
+
+	LUAH_REG(i) = (LUAH_REG(i) & ~mask) | ((value << luah_regs[i].shift) & mask);
+}
+
 static int lua_read_reg(lua_State *L) {
 	uint8_t reg = (uint8_t)luaL_checkinteger(L, 1);
-	uint16_t result;
-
-	switch (reg) {
-	case 0:
-		result = cpu_regs.pcx & 0xffff;	break;	/* external view of PC                          */
-	case 1:
-		result = cpu_regs.af & 0xffff;	break;	/* AF register                                  */
-	case 2:
-		result = cpu_regs.bc & 0xffff;	break;	/* BC register                                  */
-	case 3:
-		result = cpu_regs.de & 0xffff;	break;	/* DE register                                  */
-	case 4:
-		result = cpu_regs.hl & 0xffff;	break;	/* HL register                                  */
-	case 5:
-		result = cpu_regs.ix & 0xffff;	break;	/* IX register                                  */
-	case 6:
-		result = cpu_regs.iy & 0xffff;	break;	/* IY register                                  */
-	case 7:
-		result = cpu_regs.pc & 0xffff;	break;	/* program counter                              */
-	case 8:
-		result = cpu_regs.sp & 0xffff;	break;	/* SP register                                  */
-	case 9:
-		result = cpu_regs.af1 & 0xffff;	break;	/* alternate AF register                        */
-	case 10:
-		result = cpu_regs.bc1 & 0xffff;	break;	/* alternate BC register                        */
-	case 11:
-		result = cpu_regs.de1 & 0xffff;	break;	/* alternate DE register                        */
-	case 12:
-		result = cpu_regs.hl1 & 0xffff;	break;	/* alternate HL register                        */
-	case 13:
-		result = cpu_regs.iff & 0xffff;	break;	/* Interrupt Flip Flop                          */
-	case 14:
-		result = cpu_regs.ir & 0xffff;	break;	/* Interrupt (upper) / Refresh (lower) register */
-	default:
-		result = -1;	break;
-	}
 
-	lua_pushinteger(L, result);
+	lua_pushinteger(L, reg < LUAH_REG_NUMBERS ? luah_reg_get(reg) : 0xffff);
 	return(1);
 }
 
 static int lua_write_reg(lua_State *L) {
 	uint8_t reg = (uint8_t)luaL_checkinteger(L, 1);
-	uint16_t value = (uint8_t)luaL_checkinteger(L, 2);
-
-	switch (reg) {
-	case 0:
-		cpu_regs.pcx = value;	break;	/* external view of PC                          */
-	case 1:
-		cpu_regs.af = value;		break;	/* AF register                                  */
-	case 2:
-		cpu_regs.bc = value;		break;	/* BC register                                  */
-	case 3:
-		cpu_regs.de = value;		break;	/* DE register                                  */
-	case 4:
-		cpu_regs.hl = value;		break;	/* HL register                                  */
-	case 5:
-		cpu_regs.ix = value;		break;	/* IX register                                  */
-	case 6:
-		cpu_regs.iy = value;		break;	/* IY register                                  */
-	case 7:
-		cpu_regs.pc = value;		break;	/* program counter                              */
-	case 8:
-		cpu_regs.sp = value;		break;	/* SP register                                  */
-	case 9:
-		cpu_regs.af1 = value;	break;	/* alternate AF register                        */
-	case 10:
-		cpu_regs.bc1 = value;	break;	/* alternate BC register                        */
-	case 11:
-		cpu_regs.de1 = value;	break;	/* alternate DE register                        */
-	case 12:
-		cpu_regs.hl1 = value;	break;	/* alternate HL register                        */
-	case 13:
-		cpu_regs.iff = value;	break;	/* Interrupt Flip Flop                          */
-	case 14:
-		cpu_regs.ir = value;		break;	/* Interrupt (upper) / Refresh (lower) register */
-	default:
-		break;
+	uint16_t value = (uint16_t)luaL_checkinteger(L, 2);
+
+	if (reg < LUAH_REG_NUMBERS)
+		luah_reg_set(reg, value);
+	return(0);
+}
+
+// Regs.hl, Regs.a, Regs["af'"] and so on read and write the registers by name
+static int luah_reg_check(lua_State *L) {
+	const char *name = luaL_checkstring(L, 2);
+	int i;
+
+	for (i = 0; i < (int)LUAH_REGS; i++)
+		if (!strcmp(name, luah_regs[i].name))
+			return(i);
+	return(luaL_error(L, "no register %s", name));
+}
+
+static int lua_regs_index(lua_State *L) {
+	lua_pushinteger(L, luah_reg_get(luah_reg_check(L)));
+	return(1);
+}
+
+static int lua_regs_newindex(lua_State *L) {
+	luah_reg_set(luah_reg_check(L), (uint16_t)luaL_checkinteger(L, 3));
+	return(0);
+}
+
+// Makes a global name for an object whose fields are handled by C functions
+static void luah_view(const char *name, lua_CFunction index, lua_CFunction newindex, lua_CFunction len) {
+	lua_newuserdata(L, 0);
+	lua_newtable(L);
+	lua_pushcfunction(L, index);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, newindex);
+	lua_setfield(L, -2, "__newindex");
+	if (len) {
+		lua_pushcfunction(L, len);
+		lua_setfield(L, -2, "__len");
+	}
+	lua_setmetatable(L, -2);
+	lua_setglobal(L, name);
+}
+
+/*
+	cpm.open(name, mode) opens a CP/M file, named as [d:]name[.ext] on the
+	current user area, straight on the host and keeps it open, so scripts
+	read and write it at host speed instead of a BDOS call per record. Modes
+	are those of io.open (r, w, a, each with an optional +), always binary,
+	plus t for CP/M text: reading stops at the first ^Z, closing a file
+	that was written to adds one at the end, and text appended goes over
+	the ^Z and padding that ended the last record. The opens, reads and
+	writes count in the statistics (-j) and recordings (-r) like the
+	guest's own.
+*/
+
+#define LUAH_FILE "luah_file"	// Metatable of the file objects
+
+typedef struct {
+	FILE *file;
+	uint8_t text;	// Text mode
+	uint8_t eof;	// Text mode came across the ^Z
+	uint8_t wrote;
+	uint8_t append;	// Text mode append, the padding is yet to be taken off
+	uint8_t name[17];	// Host name
+} luah_file_t;
+
+static luah_file_t *luah_file_check(lua_State *L) {
+	luah_file_t *f = (luah_file_t*)luaL_checkudata(L, 1, LUAH_FILE);
+
+	if (!f->file)
+		luaL_error(L, "attempt to use a closed file");
+	return(f);
+}
+
+// The nil, message pair io returns on failures
+static int luah_file_fail(lua_State *L, const char *what) {
+	lua_pushnil(L);
+	lua_pushstring(L, what);
+	return(2);
+}
+
+static int luah_cpm_open(lua_State *L) {
+	const char *name = luaL_checkstring(L, 1);
+	const char *mode = luaL_optstring(L, 2, "r");
+	char fmode[4] = { 0, 0, 'b', 0 };
+	uint8_t hostname[17];
+	uint8_t drive, text = 0;
+	luah_file_t *f;
+
+	luaL_argcheck(L, mode[0] == 'r' || mode[0] == 'w' || mode[0] == 'a', 2, "invalid mode");
+	fmode[0] = *mode++;
+	if (*mode == '+')
+		fmode[1] = *mode++;
+	else
+		fmode[1] = 'b', fmode[2] = 0;
+	if (*mode == 't')
+		text = *mode++;
+	luaL_argcheck(L, !*mode, 2, "invalid mode");
+
+	if ((drive = disk_name_to_hostname(name, hostname)) == 0xff)
+		return(luah_file_fail(L, "not a CP/M file name"));
+	if ((fmode[0] != 'r' || fmode[1] == '+') && (glb_ro_vector & (1 << drive)))
+		return(luah_file_fail(L, "drive is read only"));
+	f = (luah_file_t*)lua_newuserdata(L, sizeof(luah_file_t));
+	memset(f, 0, sizeof(luah_file_t));
+	luaL_setmetatable(L, LUAH_FILE);
+	if (fmode[0] != 'w')
+		REPLAY_FILE(hostname);	// What there was in it matters
+	STATS_FILE(STATS_FILE_OPEN);
+	if (!(f->file = fopen((char*)hostname, fmode)))
+		return(luah_file_fail(L, strerror(errno)));
+	memcpy(f->name, hostname, sizeof(f->name));
+	STATS_IO(STATS_IO_OPEN, f->name, 0);
+	f->text = text != 0;
+	f->append = f->text && fmode[0] == 'a';
+	return(1);
+}
+
+// Counts bytes read or written in the statistics, in the pieces stats_io takes
+static void luah_file_io(luah_file_t *f, uint8_t kind, long bytes) {
+	uint16_t n;
+
+	while (bytes > 0) {
+		n = bytes > 0xffff ? 0xffff : (uint16_t)bytes;
+		STATS_IO(kind, f->name, n);
+		bytes -= n;
+	}
+}
+
+// Before the first text append, cuts the file at the ^Z in its last record, if there is one
+static void luah_file_unpad(luah_file_t *f) {
+	uint8_t record[128];
+	long size, start;
+	size_t got, i;
+	FILE *file;
+
+	f->append = 0;
+	fflush(f->file);
+	STATS_FILE(STATS_FILE_OPEN);
+	if (!(file = fopen((char*)f->name, "rb")))
+		return;
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	start = size > 0 ? (size - 1) / 128 * 128 : 0;
+	fseek(file, start, SEEK_SET);
+	got = fread(record, 1, sizeof(record), file);
+	fclose(file);
+	for (i = 0; i < got && record[i] != 0x1a; i++)
+		;
+	if (i < got) {
+		STATS_FILE(STATS_FILE_TRUNCATE);
+		if (ftruncate(fileno(f->file), start + (long)i))
+			return;
+	}
+}
+
+// Reads a line, with the line end if keep is set, returns 0 at the end of the file
+static int luah_file_line(lua_State *L, luah_file_t *f, int keep) {
+	luaL_Buffer b;
+	int c = EOF;
+	size_t len;
+
+	luaL_buffinit(L, &b);
+	while (!f->eof && (c = getc(f->file)) != EOF && c != '\n') {
+		if (f->text && c == 0x1a) {
+			f->eof = 1;
+			break;
+		}
+		luaL_addchar(&b, (char)c);
+	}
+	if (c == '\n' && keep)
+		luaL_addchar(&b, '\n');
+	luaL_pushresult(&b);
+	len = lua_rawlen(L, -1);
+	if (c != '\n' && !len)
+		return(0);
+	if (!keep && len && lua_tostring(L, -1)[len - 1] == '\r') {	// CP/M lines end in CR LF
+		lua_pushlstring(L, lua_tostring(L, -1), len - 1);
+		lua_remove(L, -2);
+	}
+	return(1);
+}
+
+// Reads up to n bytes, all that is left when n is -1, returns 0 at the end of the file
+static int luah_file_bytes(lua_State *L, luah_file_t *f, lua_Integer n) {
+	luaL_Buffer b;
+	lua_Integer left = n;
+	size_t want, got;
+	char *p, *z;
+
+	luaL_buffinit(L, &b);
+	while (!f->eof && left) {
+		want = left < 0 || left > LUAL_BUFFERSIZE ? LUAL_BUFFERSIZE : (size_t)left;
+		p = luaL_prepbuffsize(&b, want);
+		if (!(got = fread(p, 1, want, f->file)))
+			break;
+		if (f->text && (z = (char*)memchr(p, 0x1a, got))) {
+			got = z - p;
+			f->eof = 1;
+		}
+		luaL_addsize(&b, got);
+		if (left > 0)
+			left -= got;
+	}
+	luaL_pushresult(&b);
+	return(n <= 0 || lua_rawlen(L, -1) > 0);
+}
+
+// f:read(...) takes the formats of io, a number of bytes, "l", "L" or "a"
+static int luah_file_read(lua_State *L) {
+	luah_file_t *f = luah_file_check(L);
+	int i, top = lua_gettop(L), ok = 1;
+	const char *fmt;
+
+	long start = ftell(f->file);
+
+	if (top == 1) {
+		lua_pushliteral(L, "l");
+		top = 2;
+	}
+	clearerr(f->file);
+	STATS_FILE(STATS_FILE_READ);
+	for (i = 2; i <= top && ok; i++) {
+		if (lua_type(L, i) == LUA_TNUMBER) {
+			ok = luah_file_bytes(L, f, luaL_checkinteger(L, i));
+			continue;
+		}
+		fmt = luaL_checkstring(L, i);
+		if (*fmt == '*')
+			fmt++;
+		switch (*fmt) {
+		case 'l': ok = luah_file_line(L, f, 0); break;
+		case 'L': ok = luah_file_line(L, f, 1); break;
+		case 'a': luah_file_bytes(L, f, -1); break;
+		default:  return(luaL_argerror(L, i, "invalid format"));
+		}
+	}
+	luah_file_io(f, STATS_IO_READ, ftell(f->file) - start);
+	if (ferror(f->file))
+		return(luah_file_fail(L, strerror(errno)));
+	if (!ok) {
+		lua_pop(L, 1);
+		lua_pushnil(L);
+	}
+	return(i - 2);
+}
+
+static int luah_file_next_line(lua_State *L) {
+	luah_file_t *f = (luah_file_t*)lua_touserdata(L, lua_upvalueindex(1));
+
+	if (!f->file)
+		return(luaL_error(L, "file is already closed"));
+	if (!luah_file_line(L, f, 0))
+		lua_pushnil(L);
+	return(1);
+}
+
+static int luah_file_lines(lua_State *L) {
+	luah_file_check(L);
+	lua_settop(L, 1);
+	lua_pushcclosure(L, luah_file_next_line, 1);
+	return(1);
+}
+
+static int luah_file_write(lua_State *L) {
+	luah_file_t *f = luah_file_check(L);
+	int i, top = lua_gettop(L);
+	const char *data;
+	size_t len;
+
+	if (f->append)
+		luah_file_unpad(f);
+	for (i = 2; i <= top; i++) {
+		data = luaL_checklstring(L, i, &len);
+		STATS_FILE(STATS_FILE_WRITE);
+		if (fwrite(data, 1, len, f->file) != len)
+			return(luah_file_fail(L, strerror(errno)));
+		luah_file_io(f, STATS_IO_WRITE, (long)len);
+		f->wrote = 1;
 	}
+	lua_settop(L, 1);
+	return(1);
+}
+
+static int luah_file_seek(lua_State *L) {
+	static const int whence[] = { SEEK_SET, SEEK_CUR, SEEK_END };
+	static const char *const names[] = { "set", "cur", "end", NULL };
+	luah_file_t *f = luah_file_check(L);
+	int op = luaL_checkoption(L, 2, "cur", names);
+	lua_Integer offset = luaL_optinteger(L, 3, 0);
+
+	STATS_FILE(STATS_FILE_SEEK);
+	if (fseek(f->file, (long)offset, whence[op]))
+		return(luah_file_fail(L, strerror(errno)));
+	f->eof = 0;
+	lua_pushinteger(L, (lua_Integer)ftell(f->file));
+	return(1);
+}
+
+static int luah_file_close(lua_State *L) {
+	luah_file_t *f = luah_file_check(L);
+	int result;
 
+	if (f->text && f->wrote && !fseek(f->file, 0, SEEK_END))	// At the end, wherever the last seek left off
+		putc(0x1a, f->file);
+	STATS_FILE(STATS_FILE_CLOSE);
+	result = fclose(f->file);
+	f->file = NULL;
+	if (result)
+		return(luah_file_fail(L, strerror(errno)));
+	lua_pushboolean(L, 1);
+	return(1);
+}
+
+static int luah_file_gc(lua_State *L) {
+	luah_file_t *f = (luah_file_t*)luaL_checkudata(L, 1, LUAH_FILE);
+
+	if (f->file)
+		luah_file_close(L);
 	return(0);
 }
 
+static const luaL_Reg luah_file_methods[] = {
+	{ "read", luah_file_read },
+	{ "lines", luah_file_lines },
+	{ "write", luah_file_write },
+	{ "seek", luah_file_seek },
+	{ "close", luah_file_close },
+	{ NULL, NULL }
+};
 
-static uint8_t luah_run_script(char *filename) {
+#if defined(EMULATOR_CCP_EMULATED) && defined(EMULATOR_OS_POSIX)
+/*
+	RunCom(cmdline, options) runs a .COM as the CCP would have had it been
+	typed at the prompt, and comes back to the script when it ends. options
+	is a table, where input is a string the program gets as console input
+	instead of the keyboard and capture, when true, makes its console output
+	come back as a string instead of being shown. It returns why the program
+	ended ("return", "warmboot", "exit", "halt" or "input" when it wanted
+	more input than it was given), the output captured (or nil) and the
+	number of instructions it took, or nil and a message if there is no such
+	program. The program is loaded onto the TPA, so this is only for scripts
+	run from the prompt, not from programs.
+*/
+static int luah_run_com(lua_State *L) {
+	const char *cmdline = luaL_checkstring(L, 1);
+	uint8_t *input = NULL, *output;
+	size_t input_len = 0;
+	uint32_t output_len;
+	int capture = 0;
+	cpu_regs_t regs = cpu_regs;		// What the script's own BDOS call gets back to
+	int32_t status = cpu_status;
+	uint16_t dma = glb_dma_addr;
+	uint8_t drive = glb_c_drive, user = glb_user_code;
+	uint64_t icount = cpu_icount;
+	uint8_t missing, ended;
+	const char *reason;
+
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		if (lua_getfield(L, 2, "input") != LUA_TNIL) {
+			const char *text = luaL_checklstring(L, -1, &input_len);
+
+			// Copied, as scripts the program runs share this stack
+			if (!(input = (uint8_t*)malloc(input_len + 1)))
+				return(luaL_error(L, "not enough memory"));
+			memcpy(input, text, input_len);
+		}
+		lua_getfield(L, 2, "capture");
+		capture = lua_toboolean(L, -1);
+		lua_pop(L, 2);
+	}
+	if (pal_capture_begin(input, (uint32_t)input_len, capture)) {
+		free(input);
+		return(luaL_error(L, "not enough memory"));
+	}
+
+	missing = ccp_run(cmdline);
+
+	ended = pal_capture_end(&output, &output_len);
+	free(input);
+	switch (cpu_status) {
+	case 1:  reason = "exit"; break;
+	case 2:  reason = ended & PAL_CAPTURE_STARVED ? "input" : "warmboot"; break;
+	case 3:  reason = "return"; break;
+	default: reason = "halt"; break;
+	}
+	icount = cpu_icount - icount;
+	cpu_regs = regs;
+	cpu_status = status;
+	glb_dma_addr = dma;
+	glb_c_drive = drive;
+	glb_user_code = user;
+
+	if (missing) {
+		free(output);
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: no such program", cmdline);
+		return(2);
+	}
+	if (ended & PAL_CAPTURE_LOST) {
+		free(output);
+		return(luaL_error(L, "not enough memory for the output of %s", cmdline));
+	}
+	lua_pushstring(L, reason);
+	if (capture)
+		lua_pushlstring(L, output ? (const char*)output : "", output_len);
+	else
+		lua_pushnil(L);
+	lua_pushinteger(L, (lua_Integer)icount);
+	free(output);
+	return(3);
+}
+#endif
+
+/*===============================================================================*/
+/* Traps                                                                         */
+/*===============================================================================*/
+
+// Runs the function set at address in place of the guest routine, unless it returns false
+static uint8_t luah_trap(uint16_t address, void *data) {
+	int top = lua_gettop(L);
+	uint8_t result = TRAP_RET;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAH_TRAPS);
+	lua_rawgeti(L, -1, address);
+	lua_pushinteger(L, address);
+	if (lua_pcall(L, 1, 1, 0)) {
+		pal_puts(lua_tostring(L, -1));
+		pal_puts("\r\n");
+		trap_clear(address);	// Once is enough, the guest routine takes over
+		result = TRAP_PASS;
+	} else if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+		result = TRAP_PASS;
+	}
+	lua_settop(L, top);
+	return(result);
+}
+
+// SetTrap(address, fn) runs fn(address) whenever PC gets to address, SetTrap(address) takes it away
+static int luah_set_trap(lua_State *L) {
+	lua_Integer address = luaL_checkinteger(L, 1);
+
+	luaL_argcheck(L, address >= 0 && address <= 0xffff, 1, "address out of range");
+	if (!lua_isnoneornil(L, 2))
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_settop(L, 2);
+	if (!trap_count) {	// Lets go of the functions of traps cleared since
+		lua_newtable(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, LUAH_TRAPS);
+	}
+	if (lua_isnil(L, 2)) {
+		trap_clear((uint16_t)address);
+	} else if (trap_set((uint16_t)address, luah_trap, NULL)) {
+		return(luaL_error(L, "too many traps"));
+	}
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAH_TRAPS);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, address);
+	return(0);
+}
+
+// print, through the console like the guest's own output, so it shows in order and goes where that goes
+static int luah_print(lua_State *L) {
+	int i, n = lua_gettop(L);
+	const char *text;
+	size_t len, part;
+
+	for (i = 1; i <= n; i++) {
+		text = luaL_tolstring(L, i, &len);
+		if (i > 1)
+			pal_putch('\t');
+		for (; len; text += part, len -= part) {
+			part = len > 0xffff ? 0xffff : len;
+			pal_putbuf((const uint8_t*)text, (uint16_t)part);
+		}
+		lua_pop(L, 1);
+	}
+	pal_puts("\r\n");
+	return(0);
+}
+
+// Collects what lua_dump writes
+static int luah_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+	luah_dump_t *dump = (luah_dump_t*)ud;
+	char *more;
+
+	if (dump->len + sz > dump->room) {
+		dump->room = (dump->len + sz) * 2;
+		if (!(more = (char*)realloc(dump->buf, dump->room)))
+			return(1);
+		dump->buf = more;
+	}
+	memcpy(dump->buf + dump->len, p, sz);
+	dump->len += sz;
+	return(0);
+}
+
+// Whether the top of the stack is bytecode compiled from the source with this stamp
+static int luah_fresh(const char *stamp) {
+	size_t len;
+	const char *code;
+
+	if (lua_type(L, -1) != LUA_TSTRING)
+		return(0);
+	code = lua_tolstring(L, -1, &len);
+	return(len > LUAH_STAMP && !memcmp(code, stamp, LUAH_STAMP));
+}
+
+// Pops the stamped bytecode on top of the stack into the cache
+static void luah_cache_put(const char *filename) {
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAH_CACHE);
+	if (++luah_cached > EMULATOR_LUA_CACHE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, LUAH_CACHE);
+		luah_cached = 1;
+	}
+	lua_insert(L, -2);
+	lua_setfield(L, -2, filename);
+	lua_pop(L, 1);
+}
+
+#ifdef EMULATOR_LUA_LUC
+static void luah_luc_name(const char *filename, char *luc) {
+	strcpy(luc, filename);
+	luc[strlen(luc) - 1] = 'C';
+}
+
+// Pushes the contents of the script's .LUC, or nil
+static void luah_luc_read(const char *filename) {
+	char luc[17];
+	luah_dump_t dump = { NULL, 0, 0 };
+	char buf[1024];
+	size_t got;
+	FILE *file;
+
+	luah_luc_name(filename, luc);
+	if (!(file = fopen(luc, "rb"))) {
+		lua_pushnil(L);
+		return;
+	}
+	while ((got = fread(buf, 1, sizeof(buf), file)) && !luah_writer(L, buf, got, &dump))
+		;
+	fclose(file);
+	if (dump.buf)
+		lua_pushlstring(L, dump.buf, dump.len);
+	else
+		lua_pushnil(L);
+	free(dump.buf);
+}
 
-	L = luaL_newstate();
+static void luah_luc_write(const char *filename, luah_dump_t *dump) {
+	char luc[17];
+	FILE *file;
+
+	luah_luc_name(filename, luc);
+	if ((file = fopen(luc, "wb"))) {
+		if (fwrite(dump->buf, 1, dump->len, file) != dump->len) {
+			fclose(file);
+			remove(luc);
+			return;
+		}
+		fclose(file);
+	}
+}
+#endif
+
+// Pushes the compiled script, or the error message, returns 0 on success
+static int luah_load(char *filename) {
+	char stamp[LUAH_STAMP];
+	int64_t size, mtime;
+	const char *code;
+	size_t len;
+	luah_dump_t dump = { NULL, 0, 0 };
+	int result;
+
+	if (pal_file_stamp((uint8_t*)filename, &size, &mtime))
+		return(luaL_loadfile(L, filename));	// No telling a stale copy apart
+	memcpy(stamp, &size, sizeof(size));
+	memcpy(stamp + sizeof(size), &mtime, sizeof(mtime));
+
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAH_CACHE);
+	lua_getfield(L, -1, filename);
+	lua_remove(L, -2);
+#ifdef EMULATOR_LUA_LUC
+	if (!luah_fresh(stamp)) {
+		lua_pop(L, 1);
+		luah_luc_read(filename);
+		if (luah_fresh(stamp)) {
+			lua_pushvalue(L, -1);
+			luah_cache_put(filename);
+		}
+	}
+#endif
+	if (luah_fresh(stamp)) {
+		code = lua_tolstring(L, -1, &len);
+		if (!luaL_loadbufferx(L, code + LUAH_STAMP, len - LUAH_STAMP, filename, "b")) {
+			lua_remove(L, -2);
+			return(0);
+		}
+		lua_pop(L, 1);	// Bad bytecode, compiles it afresh
+	}
+	lua_pop(L, 1);
+
+	result = luaL_loadfile(L, filename);
+	if (!result && !luah_writer(L, stamp, LUAH_STAMP, &dump) && !lua_dump(L, luah_writer, &dump, 0)) {
+		lua_pushlstring(L, dump.buf, dump.len);
+		luah_cache_put(filename);
+#ifdef EMULATOR_LUA_LUC
+		luah_luc_write(filename, &dump);
+#endif
+	}
+	free(dump.buf);
+	return(result);
+}
+
+/*===============================================================================*/
+/* Allocator                                                                     */
+/*===============================================================================*/
+
+// Chunks are laid out as the header, rounded up to the grain, then the blocks
+#define LUAH_CHUNK_HEAD ((sizeof(luah_chunk_t) + LUAH_GRAIN - 1) & ~(size_t)(LUAH_GRAIN - 1))
+
+static void *luah_small_alloc(luah_arena_t *a, int cls) {
+	size_t size = (size_t)(cls + 1) * LUAH_GRAIN;
+	luah_chunk_t *c = a->chunks;
+	void *p = a->free[cls];
+
+	if (p) {
+		a->free[cls] = *(void **)p;
+		return(p);
+	}
+	if (!c || c->used + size > EMULATOR_LUA_POOL) {
+		if (!(c = (luah_chunk_t *)malloc(EMULATOR_LUA_POOL)))
+			return(NULL);
+		c->next = a->chunks;
+		c->used = LUAH_CHUNK_HEAD;
+		a->chunks = c;
+	}
+	p = (char *)c + c->used;
+	c->used += size;
+	return(p);
+}
+
+static void luah_small_free(luah_arena_t *a, void *p, int cls) {
+	*(void **)p = a->free[cls];
+	a->free[cls] = p;
+}
+
+// The lua_Alloc of the shared state, Lua always passes the size a block was given as osize
+static void *luah_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	luah_arena_t *a = (luah_arena_t *)ud;
+	int ocls, ncls;
+	void *p;
+
+	if (!ptr)
+		osize = 0;
+	ocls = osize && osize <= LUAH_SMALL ? (int)((osize - 1) / LUAH_GRAIN) : -1;
+	ncls = nsize && nsize <= LUAH_SMALL ? (int)((nsize - 1) / LUAH_GRAIN) : -1;
+
+	if (nsize == 0) {
+		if (ptr) {
+			if (ocls >= 0)
+				luah_small_free(a, ptr, ocls);
+			else
+				free(ptr);
+			a->in_use -= osize;
+		}
+		return(NULL);
+	}
+	// Lua counts on shrinking never failing, so only growing is held to the limit
+	if (nsize > osize && a->limit && a->in_use + (nsize - osize) > a->limit)
+		return(NULL);
+
+	if (ptr && ocls >= 0 && ocls == ncls) {
+		p = ptr;	// Same size class, the block already fits
+	} else if (ocls < 0 && ncls < 0) {
+		if (!(p = realloc(ptr, nsize)))
+			return(NULL);
+	} else {
+		if (!(p = ncls >= 0 ? luah_small_alloc(a, ncls) : malloc(nsize)))
+			return(NULL);
+		if (ptr) {
+			memcpy(p, ptr, osize < nsize ? osize : nsize);
+			if (ocls >= 0)
+				luah_small_free(a, ptr, ocls);
+			else
+				free(ptr);
+		}
+	}
+	a->in_use += nsize;
+	a->in_use -= osize;
+	return(p);
+}
+
+// Hands the chunks back once the state that used them is closed
+static void luah_arena_drop(luah_arena_t *a) {
+	luah_chunk_t *c;
+
+	while ((c = a->chunks)) {
+		a->chunks = c->next;
+		free(c);
+	}
+	memset(a, 0, sizeof(luah_arena_t));
+}
+
+static int luah_panic(lua_State *L) {
+	pal_puts("Lua: ");
+	pal_puts(lua_tostring(L, -1));
+	pal_puts("\r\n");
+	return(0);
+}
+
+// Makes the shared state the first time a script runs
+static uint8_t luah_open(void) {
+	if (L)
+		return(0);
+	memset(&luah_arena, 0, sizeof(luah_arena_t));
+	if (!(L = lua_newstate(luah_alloc, &luah_arena))) {
+		luah_arena_drop(&luah_arena);
+		return(1);
+	}
+	lua_atpanic(L, luah_panic);
 	luaL_openlibs(L);
 
 	// Register Lua functions
+	lua_register(L, "print", luah_print);
 	lua_register(L, "BdosCall", luah_bdos_call);
 	lua_register(L, "RamRead", lua_ram_read);
 	lua_register(L, "RamWrite", lua_ram_write);
@@ -162,21 +1020,76 @@ static uint8_t luah_run_script(char *filename) {
 	lua_register(L, "RamWrite16", lua_ram_write16);
 	lua_register(L, "ReadReg", lua_read_reg);
 	lua_register(L, "WriteReg", lua_write_reg);
+	lua_register(L, "RamReadBlock", lua_ram_read_block);
+	lua_register(L, "RamWriteBlock", lua_ram_write_block);
+	lua_register(L, "RamFill", lua_ram_fill);
+	lua_register(L, "RamCopy", lua_ram_copy);
+	lua_register(L, "RamFind", lua_ram_find);
+	lua_register(L, "SetTrap", luah_set_trap);
+#if defined(EMULATOR_CCP_EMULATED) && defined(EMULATOR_OS_POSIX)
+	lua_register(L, "RunCom", luah_run_com);
+#endif
+	luah_view("Ram", lua_ram_index, lua_ram_newindex, lua_ram_len);
+	luah_view("Regs", lua_regs_index, lua_regs_newindex, NULL);
 
-	int result = luaL_loadfile(L, filename);
-	if (result) {
-		pal_puts(lua_tostring(L, -1));
-	} else {
-		result = lua_pcall(L, 0, LUA_MULTRET, 0);
-		if (result)
-			pal_puts(lua_tostring(L, -1));
-	}
+	luaL_newmetatable(L, LUAH_FILE);
+	luaL_newlib(L, luah_file_methods);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, luah_file_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+	lua_newtable(L);
+	lua_pushcfunction(L, luah_cpm_open);
+	lua_setfield(L, -2, "open");
+	lua_setglobal(L, "cpm");
 
-	lua_close(L);
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LUAH_CACHE);
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LUAH_TRAPS);
+	luah_cached = 0;
+	return(0);
+}
+
+static uint8_t luah_run_script(char *filename) {
+	size_t limit;
+	int result;
+
+	if (luah_open())
+		return(0xff);
+
+	limit = luah_arena.limit;	// A script run by RunCom from another one keeps to its limit as well
+	if (EMULATOR_LUA_MEMORY && (!limit || luah_arena.in_use + EMULATOR_LUA_MEMORY < limit))
+		luah_arena.limit = luah_arena.in_use + EMULATOR_LUA_MEMORY;
+
+	result = luah_load(filename);
+	if (!result) {
+		// Globals of its own, falling back on the shared ones, as the script's _ENV
+		lua_newtable(L);
+		lua_newtable(L);
+		lua_pushglobaltable(L);
+		lua_setfield(L, -2, "__index");
+		lua_setmetatable(L, -2);
+		lua_setupvalue(L, -2, 1);
+		result = lua_pcall(L, 0, 0, 0);
+	}
+	if (result)
+		pal_puts(lua_tostring(L, -1));
+	lua_settop(L, 0);
+	luah_arena.limit = limit;
+	lua_gc(L, LUA_GCCOLLECT, 0);
 
 	return(result);
 }
 
+// Ends the shared state, as the machine running the scripts ends
+void luah_close(void) {
+	if (L) {
+		lua_close(L);
+		L = NULL;
+		luah_arena_drop(&luah_arena);
+	}
+}
 
 uint8_t luah_run(uint16_t fcbaddr) {
 	uint8_t luascript[17];
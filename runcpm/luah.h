@@ -9,6 +9,7 @@ extern "C"
 {
 #endif
 extern uint8_t luah_run(uint16_t fcbaddr);
+extern void luah_close(void);
 #ifdef __cplusplus
 }
 #endif
@@ -15,12 +15,206 @@
 #include "globals.h"
 #include "pal.h"
 #include "ram.h"
-#include "cpm.h"        
+#include "cpm.h"
 
+#ifdef EMULATOR_CCP_EMULATED
+#include "ccp.h"
+#endif
+
+#ifdef EMULATOR_OS_POSIX
+#include "server.h"
+#include "screen.h"
+#include "stats.h"
+#include "trace.h"
+#include "itrace.h"
+#include "replay.h"
+#include "verify.h"
+#include "aot.h"
+#endif
+
+#ifdef EMULATOR_HAS_SESSIONS
+#include "session.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
 
 #ifndef ARDUINO
 
+#define MAIN_CMD_LEN 125	// Same as the CCP command line limit
+
+static void usage(void) {
+    pal_puts("Usage: runcpm [options] [command line]\r\n");
+#ifdef EMULATOR_OS_POSIX
+    pal_puts("  -s socket   Run as a fork server listening on socket\r\n");
+    pal_puts("  -c socket   Run the command line on the fork server at socket\r\n");
+    pal_puts("  -p program  Preload program onto the TPA (with -s)\r\n");
+    pal_puts("  -t terminal Render through a screen model of terminal (adm3a, vt52, ansi)\r\n");
+    pal_puts("  -j file     Write run statistics to file as JSON on exit and on SIGUSR1\r\n");
+    pal_puts("  -x file     Trace BDOS and BIOS calls to file (toggled by SIGUSR2)\r\n");
+    pal_puts("  -i file     Trace every instruction executed to file\r\n");
+    pal_puts("  -r file     Record the console input and files the guest sees to file\r\n");
+    pal_puts("  -R file     Replay a recording made with -r, checking the run matches it\r\n");
+    pal_puts("  -V engine   Run every instruction on engine too and stop where it differs from the\r\n");
+    pal_puts("              reference, engine:n compares n instructions at a time\r\n");
+    pal_puts("  -z seed     Compare the -V engine with the reference on random programs instead\r\n");
+#endif
+#ifdef EMULATOR_AOT
+    pal_puts("  -a dir      Run the programs com2c translated into dir natively\r\n");
+#endif
+#ifdef EMULATOR_HAS_SESSIONS
+    pal_puts("  -l address  Run as a session server on a Unix socket path or [host]:port\r\n");
+#endif
+}
+
 int main(int argc, char *argv[]) {
+    static char cmdline[MAIN_CMD_LEN + 1];
+    const char *server = NULL;
+    const char *client = NULL;
+    const char *preload = NULL;
+    const char *stats = NULL;
+    const char *trace = NULL;
+    const char *itrace = NULL;
+    const char *record = NULL;
+    const char *replay = NULL;
+    const char *verify = NULL;
+    const char *fuzz = NULL;
+#ifdef EMULATOR_AOT
+    const char *aot = NULL;
+#endif
+#ifdef EMULATOR_HAS_SESSIONS
+    const char *sessions = NULL;
+#endif
+    int i;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!argv[i][1] || argv[i][2] || i + 1 == argc) {
+            usage();
+            return -1;
+        }
+        switch (argv[i][1]) {
+        case 's':
+            server = argv[++i]; break;
+        case 'c':
+            client = argv[++i]; break;
+        case 'p':
+            preload = argv[++i]; break;
+#ifdef EMULATOR_HAS_SESSIONS
+        case 'l':
+            sessions = argv[++i]; break;
+#endif
+#ifdef EMULATOR_OS_POSIX
+        case 'j':
+            stats = argv[++i]; break;
+        case 'x':
+            trace = argv[++i]; break;
+        case 'i':
+            itrace = argv[++i]; break;
+        case 'r':
+            record = argv[++i]; break;
+        case 'R':
+            replay = argv[++i]; break;
+        case 'V':
+            verify = argv[++i]; break;
+        case 'z':
+            fuzz = argv[++i]; break;
+#endif
+#ifdef EMULATOR_AOT
+        case 'a':
+            aot = argv[++i]; break;
+#endif
+#ifdef EMULATOR_OS_POSIX
+        case 't':
+            if (screen_select(argv[++i]))
+                break;
+#endif
+        default:
+            usage();
+            return -1;
+        }
+    }
+    for (; i < argc; i++) {     // Whatever is left is a command line for the CCP
+        if (strlen(cmdline) + (cmdline[0] ? 1 : 0) + strlen(argv[i]) > MAIN_CMD_LEN) {
+            pal_puts("Command line too long, at most " GLB_STR(MAIN_CMD_LEN) " characters.\r\n");
+            return -1;
+        }
+        if (cmdline[0])
+            strcat(cmdline, " ");
+        strcat(cmdline, argv[i]);
+    }
+
+#ifdef EMULATOR_AOT
+    if (aot && aot_init(aot)) {
+        pal_puts("Unable to read the translations directory.\r\n");
+        return -1;
+    }
+#endif
+#ifdef EMULATOR_HAS_SESSIONS
+    if (sessions) {
+        if(!pal_init()) {
+            pal_puts("Unable to initialize the system. CPU halted.\r\n");
+            return -1;
+        }
+        return session_server_run(sessions);
+    }
+#endif
+#ifdef EMULATOR_OS_POSIX
+    if (client) {
+        i = server_fork_request(client, cmdline);
+        if (i < 0)
+            pal_puts("Unable to reach the fork server.\r\n");
+        return i;
+    }
+    if (server) {
+        if(!pal_init()) {
+            pal_puts("Unable to initialize the system. CPU halted.\r\n");
+            return -1;
+        }
+        ram_init();
+        if (cpm_init())
+            return -1;
+#ifdef EMULATOR_CCP_EMULATED
+        if (preload && ccp_preload(preload)) {
+            pal_puts("Unable to preload the program.\r\n");
+            return -1;
+        }
+#else
+        if (preload) {
+            pal_puts("Preloading requires the emulated CCP.\r\n");
+            return -1;
+        }
+#endif
+        return server_fork_run(server);
+    }
+#else
+    if (server || client || preload || stats || trace || itrace || record || replay || verify || fuzz) {
+        usage();
+        return -1;
+    }
+#endif
+
+#ifdef EMULATOR_OS_POSIX
+    if (itrace && itrace_init(itrace)) {
+        pal_puts("Unable to create the instruction trace.\r\n");
+        return -1;
+    }
+    if ((record && replay) || (itrace && verify) || (fuzz && !verify)) {
+        usage();
+        return -1;
+    }
+    if (verify && verify_init(verify)) {
+        pal_puts("Unable to verify that engine.\r\n");
+        return -1;
+    }
+    if (fuzz)
+        return verify_fuzz((uint32_t)strtoul(fuzz, NULL, 10)) ? -1 : 0;
+    if ((record && replay_init(record, REPLAY_RECORD)) || (replay && replay_init(replay, REPLAY_PLAY))) {
+        pal_puts(record ? "Unable to create the recording.\r\n" : "Unable to read the recording.\r\n");
+        return -1;
+    }
+    trace_init(trace);      // Before any other thread starts, so they leave SIGUSR2 alone
+    stats_init(stats);      // Before the console thread starts, so it leaves SIGUSR1 alone
+#endif
     pal_console_init();
     pal_puts("Coming up....\r\n");
     if(!pal_init()) {
@@ -31,9 +225,37 @@ int main(int argc, char *argv[]) {
         pal_delete_file((uint8_t*)DEBUG_LOG_PATH);
     #endif
     ram_init();
-    cpm_banner();
+    if (cmdline[0]) {
+#ifdef EMULATOR_CCP_EMULATED
+        ccp_command(cmdline);
+#else
+        pal_puts("Command lines require the emulated CCP.\r\n");
+        pal_console_reset();
+        return -1;
+#endif
+    } else {
+        cpm_banner();
+    }
     cpm_loop();
+#ifdef EMULATOR_OS_POSIX
+    i = replay_finish();
+#endif
     pal_console_reset();
+#ifdef EMULATOR_OS_POSIX
+    trace_flush();
+    itrace_flush();
+    if (stats && stats_dump()) {
+        pal_puts("Unable to write the statistics.\r\n");
+        return -1;
+    }
+    if (verify_failed)
+        return -1;
+    if (i) {
+        if (record)
+            pal_puts("Unable to write the recording.\r\n");
+        return -1;      // Or the replay did not match
+    }
+#endif
     return 0;
 }
 
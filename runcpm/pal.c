@@ -52,10 +52,29 @@ void pal_put_con(uint8_t ch)        // Puts a character
 	pal_putch(ch & 0x7f);
 }
 
+void pal_put_con_ram(uint16_t address, uint16_t len)    // Puts len chars from RAM in one go
+{
+	uint8_t buf[128];
+	uint16_t i;
+
+	while (len) {
+		for (i = 0; i < sizeof(buf) && i < len; i++)
+			buf[i] = ram_read(address++) & 0x7f;
+		pal_putbuf(buf, i);
+		len -= i;
+	}
+}
+
 void pal_puts(const char *str)  // Puts a \0 terminated string
 {
-	while (*str)
-		pal_put_con(*(str++));
+	uint8_t buf[128];
+	uint16_t i;
+
+	while (*str) {
+		for (i = 0; i < sizeof(buf) && *str; i++)
+			buf[i] = *(str++) & 0x7f;
+		pal_putbuf(buf, i);
+	}
 }
 
 void pal_put_hex8(uint8_t c)        // Puts a HH hex string
@@ -4,6 +4,10 @@
 #include <stdint.h>
 #include <stdio.h>
 
+// What pal_capture_end tells about the program that ran
+#define PAL_CAPTURE_STARVED 1	// It wanted more input than it was given
+#define PAL_CAPTURE_LOST    2	// Its output did not fit in memory, so it was stopped
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -14,6 +18,8 @@ extern uint16_t pal_digital_get(uint16_t ind);
 extern void pal_analog_set(uint16_t ind, uint16_t state);
 extern uint16_t pal_analog_get(uint16_t ind);
 extern void pal_pin_set_mode(uint16_t pin, uint16_t);
+extern uint64_t pal_clock_us(void);
+extern uint8_t pal_date_time(uint16_t *days, uint8_t *hours, uint8_t *minutes);
 extern void pal_console_init(void);
 extern void pal_console_reset(void);
 extern uint8_t pal_getch(void);
@@ -21,7 +27,12 @@ extern uint8_t pal_getche(void);
 extern void pal_clrscr(void);
 extern void pal_puts(const char *str);
 void pal_putch(uint8_t ch);
+extern void pal_putbuf(const uint8_t *buf, uint16_t len);
+extern void pal_console_flush(void);
+extern uint8_t pal_capture_begin(const uint8_t *input, uint32_t len, uint8_t output);
+extern uint8_t pal_capture_end(uint8_t **output, uint32_t *len);
 extern void pal_put_con(uint8_t ch);
+extern void pal_put_con_ram(uint16_t address, uint16_t len);
 extern void pal_put_hex8(uint8_t c);
 extern void pal_put_hex16(uint16_t c);
 extern uint8_t pal_file_exists(uint8_t *filename);
@@ -29,6 +40,7 @@ extern FILE* pal_fopen_r(uint8_t *filename);
 extern FILE* pal_fopen_w(uint8_t *filename);
 extern FILE* pal_fopen_rw(uint8_t *filename);
 extern long pal_file_size(uint8_t *filename);
+extern uint8_t pal_file_stamp(uint8_t *filename, int64_t *size, int64_t *mtime);
 extern int pal_open_file(uint8_t *filename);
 extern int pal_make_file(uint8_t *filename);
 extern int pal_select(uint8_t *disk);
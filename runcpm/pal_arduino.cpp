@@ -47,6 +47,26 @@ uint16_t pal_analog_get(uint16_t ind) {
     return analogRead(ind);
 }
 
+uint64_t pal_clock_us(void) {
+	static uint32_t last = 0, wraps = 0;
+	uint32_t now = micros();
+
+	if (now < last)
+		wraps++;
+	last = now;
+	return((uint64_t)wraps << 32 | now);
+}
+
+// There is no real time clock, the date and time are those since power on, from 1 Jan 1978
+uint8_t pal_date_time(uint16_t *days, uint8_t *hours, uint8_t *minutes) {
+	uint32_t seconds = (uint32_t)(pal_clock_us() / 1000000);
+
+	*days = seconds / 86400 + 1;
+	*hours = seconds / 3600 % 24;
+	*minutes = seconds / 60 % 60;
+	return(seconds % 60);
+}
+
 uint8_t pal_load_file(uint8_t *filename, uint16_t address) {
 	File f;
 	uint8_t result = 1;
@@ -95,6 +115,11 @@ long pal_file_size(uint8_t *filename) {
 	return (l);
 }
 
+// The SD library keeps no modification times
+uint8_t pal_file_stamp(uint8_t *filename, int64_t *size, int64_t *mtime) {
+	return(1);
+}
+
 int pal_open_file(uint8_t *filename) {
 	File f;
 	int result = 0;
@@ -424,6 +449,13 @@ void pal_putch(uint8_t ch) {
 	Serial.write(ch);
 }
 
+void pal_putbuf(const uint8_t *buf, uint16_t len) {
+	Serial.write(buf, len);
+}
+
+void pal_console_flush(void) {
+}
+
 void pal_clrscr(void) {
 	Serial.println("\e[H\e[J");
 }
@@ -5,11 +5,24 @@
 #include "globals.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef EMULATOR_OS_POSIX
+#include "stats.h"
+#include "replay.h"
+#else
+#define STATS_FILE(call)
+#define STATS_IO(kind, filename, bytes)
+#define REPLAY_FILE(filename)
+#define REPLAY_CLOCK(value) (value)
+#endif
+
 #ifdef EMULATOR_OS_DOS
 #include <conio.h>
 #include <dir.h>
@@ -54,6 +67,28 @@ uint16_t pal_analog_get(uint16_t ind) {
     return 0;
 }
 
+// Local date and time as CP/M 3 keeps it: days since 31 Dec 1977 and the time of day, returns the seconds
+uint8_t pal_date_time(uint16_t *days, uint8_t *hours, uint8_t *minutes) {
+	time_t now = time(NULL);
+	struct tm local;
+	uint64_t when;
+	int year;
+
+#ifdef EMULATOR_OS_POSIX
+	localtime_r(&now, &local);	// Sessions ask from several threads at once
+#else
+	local = *localtime(&now);
+#endif
+	*days = local.tm_yday + 1;
+	for (year = 1978; year < local.tm_year + 1900; year++)
+		*days += (year % 4 == 0 && year % 100 != 0) || year % 400 == 0 ? 366 : 365;
+	when = REPLAY_CLOCK((uint64_t)*days << 24 | local.tm_hour << 16 | local.tm_min << 8 | local.tm_sec);
+	*days = (uint16_t)(when >> 24);
+	*hours = (uint8_t)(when >> 16);
+	*minutes = (uint8_t)(when >> 8);
+	return((uint8_t)when);
+}
+
 uint8_t pal_load_file(uint8_t *filename, uint16_t address) {
 	long l;
     int i;
@@ -61,6 +96,7 @@ uint8_t pal_load_file(uint8_t *filename, uint16_t address) {
 	if(!file) {
 		return 1;
 	}
+	REPLAY_FILE(filename);
 	pal_fseek(file, 0, SEEK_END);
 	l = pal_ftell(file);
 
@@ -79,26 +115,32 @@ uint8_t pal_load_file(uint8_t *filename, uint16_t address) {
 /*===============================================================================*/
 
 uint8_t pal_file_exists(uint8_t *filename) {
+	STATS_FILE(STATS_FILE_STAT);
 	return(!access((const char*)filename, F_OK));
 }
 
 FILE* pal_fopen_r(uint8_t *filename) {
+	STATS_FILE(STATS_FILE_OPEN);
 	return(fopen((const char*)filename, "rb"));
 }
 
 FILE* pal_fopen_w(uint8_t *filename) {
+	STATS_FILE(STATS_FILE_OPEN);
 	return(fopen((const char*)filename, "wb"));
 }
 
 FILE* pal_fopen_rw(uint8_t *filename) {
+	STATS_FILE(STATS_FILE_OPEN);
 	return(fopen((const char*)filename, "r+b"));
 }
 
 FILE* pal_fopen_a(uint8_t *filename) {
+	STATS_FILE(STATS_FILE_OPEN);
 	return(fopen((const char*)filename, "a"));
 }
 
 int pal_fseek(FILE *file, long delta, int origin) {
+	STATS_FILE(STATS_FILE_SEEK);
 	return(fseek(file, delta, origin));
 }
 
@@ -107,10 +149,12 @@ long pal_ftell(FILE *file) {
 }
 
 long pal_fread(void *buffer, long size, long count, FILE *file) {
+	STATS_FILE(STATS_FILE_READ);
 	return(fread(buffer, size, count, file));
 }
 
 long pal_fwrite(const void *buffer, long size, long count, FILE *file) {
+	STATS_FILE(STATS_FILE_WRITE);
 	return(fwrite(buffer, size, count, file));
 }
 
@@ -119,19 +163,23 @@ int pal_feof(FILE *file) {
 }
 
 int pal_fclose(FILE *file) {
+	STATS_FILE(STATS_FILE_CLOSE);
 	return(fclose(file));
 }
 
 int pal_remove(uint8_t *filename) {
+	STATS_FILE(STATS_FILE_REMOVE);
 	return(remove((const char*)filename));
 }
 
 int pal_rename(uint8_t *name1, uint8_t *name2) {
+	STATS_FILE(STATS_FILE_RENAME);
 	return(rename((const char*)name1, (const char*)name2));
 }
 
 int pal_select(uint8_t *disk) {
 	struct stat st;
+	STATS_FILE(STATS_FILE_STAT);
 	return((stat((char*)disk, &st) == 0) && ((st.st_mode & S_IFDIR) != 0));
 }
 
@@ -146,17 +194,38 @@ long pal_file_size(uint8_t *filename) {
 	return(l);
 }
 
+// Size and modification time (ns where the host keeps them) of a file, returns 0 on success
+uint8_t pal_file_stamp(uint8_t *filename, int64_t *size, int64_t *mtime) {
+	struct stat st;
+
+	STATS_FILE(STATS_FILE_STAT);
+	if (stat((char*)filename, &st) != 0)
+		return(1);
+	*size = st.st_size;
+#ifdef __linux__
+	*mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+	*mtime = (int64_t)st.st_mtime * 1000000000;
+#endif
+	return(0);
+}
+
 int pal_open_file(uint8_t *filename) {
 	FILE *file = pal_fopen_r(filename);
-	if (file != NULL)
+	if (file != NULL) {
 		pal_fclose(file);
+		STATS_IO(STATS_IO_OPEN, filename, 0);
+		REPLAY_FILE(filename);
+	}
 	return(file != NULL);
 }
 
 int pal_make_file(uint8_t *filename) {
 	FILE *file = pal_fopen_a(filename);
-	if (file != NULL)
+	if (file != NULL) {
 		pal_fclose(file);
+		STATS_IO(STATS_IO_OPEN, filename, 0);
+	}
 	return(file != NULL);
 }
 
@@ -170,16 +239,19 @@ int pal_rename_file(uint8_t *filename, uint8_t *newname) {
 
 #ifdef DEBUG_LOG
 void pal_log_buffer(uint8_t *buffer) {
-	FILE *file;
 #ifdef DEBUG_LOG_TO_CONSOLE
 	puts((char *)buffer);
 #else
+	static FILE *file = NULL;	// Stays open, reopening it for every line is too slow to log anything busy
 	uint8_t s = 0;
 	while (*(buffer + s))   // Computes buffer size
 		s++;
-	file = pal_fopen_a((uint8_t*)DEBUG_LOG_PATH);
-	pal_fwrite(buffer, 1, s, file);
-	pal_fclose(file);
+	if (!file)
+		file = fopen(DEBUG_LOG_PATH, "a");
+	if (file) {
+		fwrite(buffer, 1, s, file);
+		fflush(file);
+	}
 #endif
 }
 #endif
@@ -199,6 +271,7 @@ uint8_t pal_read_seq(uint8_t *filename, long fpos) {
 			if (bytesread) {
 				for (i = 0; i < 128; i++)
 					ram_write(glb_dma_addr + i, dmabuf[i]);
+				STATS_IO(STATS_IO_READ, filename, bytesread);
 			}
 			result = bytesread ? 0x00 : 0x01;
 		} else {
@@ -228,6 +301,7 @@ uint8_t pal_write_seq(uint8_t *filename, long fpos) {
 					break;
 				}
 			}
+			STATS_IO(STATS_IO_WRITE, filename, i);
 		} else {
 			result = 0x01;
 		}
@@ -254,6 +328,7 @@ uint8_t pal_read_rand(uint8_t *filename, long fpos) {
 			if (bytesread) {
 				for (i = 0; i < 128; i++)
 					ram_write(glb_dma_addr + i, dmabuf[i]);
+				STATS_IO(STATS_IO_READ, filename, bytesread);
 			}
 			result = bytesread ? 0x00 : 0x01;
 		} else {
@@ -283,6 +358,7 @@ uint8_t pal_write_rand(uint8_t *filename, long fpos) {
 					break;
 				}
 			}
+			STATS_IO(STATS_IO_WRITE, filename, i);
 		} else {
 			result = 0x06;
 		}
@@ -316,6 +392,7 @@ uint8_t pal_truncate(char *fn, uint8_t rc) {
 #if defined(EMULATOR_OS_POSIX) || defined(EMULATOR_OS_DOS)
 uint8_t pal_truncate(char *fn, uint8_t rc) {
 	uint8_t result = 0x00;
+	STATS_FILE(STATS_FILE_TRUNCATE);
 	if (truncate(fn, rc * 128))
 		result = 0xff;
 	return(result);
@@ -343,6 +420,10 @@ void pal_make_user_dir() {
 
 #ifdef EMULATOR_OS_DOS 
 
+uint64_t pal_clock_us(void) {
+	return((uint64_t)clock() * 1000000 / CLOCKS_PER_SEC);
+}
+
 void pal_console_init(void) {
 }
 
@@ -370,6 +451,14 @@ void pal_putch(uint8_t ch) {
 	putchar(ch);
 }
 
+void pal_putbuf(const uint8_t *buf, uint16_t len) {
+	while (len--)
+		putchar(*(buf++));
+}
+
+void pal_console_flush(void) {
+}
+
 struct ffblk fnd;
 
 uint8_t pal_find_first(uint8_t isdir) {
@@ -424,6 +513,14 @@ BOOL _signal_handler(DWORD signal) {
 	return(result);
 }
 
+uint64_t pal_clock_us(void) {
+	LARGE_INTEGER now, frequency;
+
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+	return((uint64_t)(now.QuadPart / frequency.QuadPart) * 1000000 + (uint64_t)(now.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart);
+}
+
 void pal_console_init(void) {
 	HANDLE hConsoleHandle = GetStdHandle(STD_INPUT_HANDLE);
 	DWORD dwMode = ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT;
@@ -456,6 +553,14 @@ void pal_putch(uint8_t ch) {
 	_putch(ch);
 }
 
+void pal_putbuf(const uint8_t *buf, uint16_t len) {
+	while (len--)
+		_putch(*(buf++));
+}
+
+void pal_console_flush(void) {
+}
+
 
 int dir_pos;
 WIN32_FIND_DATA find_file_data;
@@ -513,12 +618,307 @@ uint8_t pal_find_first(uint8_t isdir) {
 
 #include <ncurses.h>
 #include <poll.h>
+#include <pthread.h>
 #include <termios.h>
 #include <term.h>
 
+#include "cpu.h"
+#include "screen.h"
+
+#ifdef EMULATOR_HAS_SESSIONS
+#include "session.h"
+#endif
+
+uint64_t pal_clock_us(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return((uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+}
+
 static struct termios _old_term;
 static struct termios _new_term;
 
+/*
+	Console output is gathered on a buffer and written out when it fills, when
+	the guest asks for input, when the console is reset and, so nothing lingers
+	on screen, by the console thread once EMULATOR_CON_FLUSH_MS have passed.
+*/
+static struct {
+	uint8_t active;                         // Buffering only happens between init and reset
+	uint16_t len;
+	pthread_mutex_t lock;
+	uint8_t buf[EMULATOR_CON_BUFFER];
+} _con_out = { 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+/*
+	Console input is read by the same console thread onto a single producer /
+	single consumer ring, so checking for and getting characters are plain memory
+	operations. When the ring is full the thread stops reading until the guest
+	catches up, so pasted or piped input is never dropped.
+
+	Input piped in or read from a file is a script of command lines rather
+	than keys pressed, all of it there from the start: status checks do not
+	see it, only reads take it, so a program checking for a key to pause or
+	abort on does not eat the next command. Once it is used up the machine
+	ends, as on EXIT.
+*/
+#define CON_IN_MASK (EMULATOR_CON_TYPEAHEAD - 1)
+
+static struct {
+	uint32_t head;                          // Written by the console thread only
+	uint32_t tail;                          // Written by the guest only
+	uint8_t eof;                            // Set once stdin has nothing more to give
+	uint8_t script;                         // stdin is not a terminal, status checks see none of it
+	uint8_t stalled;                        // Console thread is waiting for room on the ring
+	uint8_t waiting;                        // Guest is waiting for a character
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	uint8_t buf[EMULATOR_CON_TYPEAHEAD];
+} _con_in = { 0, 0, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/*
+	Console capture, for programs run by scripts (RunCom in luah.c): input is
+	taken from a given buffer and, if asked for, output is gathered instead of
+	shown. A program that wants more input than it was given is stopped as if
+	it had warm booted, and so is one polling for input long after it ran out,
+	or one whose output there is no more memory to keep.
+*/
+typedef struct _capture {
+	const uint8_t *in;                      // NULL when input comes from the console
+	uint32_t in_len;
+	uint32_t in_pos;
+	uint32_t polls;                         // Console status checks since the input ran out
+	uint8_t status;                         // PAL_CAPTURE_STARVED, PAL_CAPTURE_LOST
+	uint8_t capturing;
+	uint8_t *out;
+	uint32_t out_len;
+	uint32_t out_room;
+	struct _capture *outer;                 // Capture this one is nested in
+} _capture_t;
+
+static GLB_TLS _capture_t *_capture = NULL;
+
+// Starts capturing: input is taken from the len bytes at input (if not NULL) and output is kept if output is set,
+// returns 0 on success
+uint8_t pal_capture_begin(const uint8_t *input, uint32_t len, uint8_t output) {
+	_capture_t *capture = (_capture_t*)calloc(1, sizeof(_capture_t));
+
+	if (!capture)
+		return(1);
+	capture->outer = _capture;
+	_capture = capture;
+	_capture->in = input;
+	_capture->in_len = len;
+	_capture->capturing = output;
+	return(0);
+}
+
+// Ends capturing, hands over what was output (free it), returns PAL_CAPTURE_STARVED if the program wanted
+// more input than it got and PAL_CAPTURE_LOST if some of its output could not be kept, or 0
+uint8_t pal_capture_end(uint8_t **output, uint32_t *len) {
+	_capture_t *capture;
+	uint8_t status = 0;
+
+	*output = NULL;
+	*len = 0;
+	if (_capture) {
+		*output = _capture->out;
+		*len = _capture->out_len;
+		status = _capture->status;
+		capture = _capture;
+		_capture = capture->outer;
+		free(capture);
+	}
+	return(status);
+}
+
+static void _capture_output(const uint8_t *buf, uint16_t len) {
+	uint32_t room = (_capture->out_len + len) * 2;
+	uint8_t *more;
+
+	if (_capture->status & PAL_CAPTURE_LOST)
+		return;
+	if (_capture->out_len + len > _capture->out_room) {
+		if (!(more = (uint8_t*)realloc(_capture->out, room))) {
+			_capture->status |= PAL_CAPTURE_LOST;
+			cpu_status = 2;                 // Stopped, as what it does next would not be seen
+			return;
+		}
+		_capture->out = more;
+		_capture->out_room = room;
+	}
+	memcpy(_capture->out + _capture->out_len, buf, len);
+	_capture->out_len += len;
+}
+
+static uint8_t _capture_starve(void) {
+	_capture->status |= PAL_CAPTURE_STARVED;
+	cpu_status = 2;
+	return(0x1a);
+}
+
+static pthread_t _con_thread;
+static int _con_wake[2] = { -1, -1 };     // Wakes up the console thread
+static volatile uint8_t _con_quit;
+
+static void _con_write(const uint8_t *buf, size_t len) {
+	ssize_t n;
+
+	while (len) {
+		n = write(STDOUT_FILENO, buf, len);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			break;                          // Nowhere to write to, output is lost
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+// Adds to the output buffer, writing it out whenever it fills up
+static void _con_append(const uint8_t *buf, uint16_t len) {
+	uint16_t n;
+
+	while (len) {
+		n = sizeof(_con_out.buf) - _con_out.len;
+		if (n > len)
+			n = len;
+		memcpy(&_con_out.buf[_con_out.len], buf, n);
+		__atomic_store_n(&_con_out.len, _con_out.len + n, __ATOMIC_RELAXED);	// Also read without the lock, see pal_kbhit
+		if (_con_out.len == sizeof(_con_out.buf)) {
+			_con_write(_con_out.buf, _con_out.len);
+			__atomic_store_n(&_con_out.len, 0, __ATOMIC_RELAXED);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void _con_flush_locked(void) {
+	if (_con_out.active && screen_type)
+		screen_render(_con_append);
+	if (_con_out.len) {
+		_con_write(_con_out.buf, _con_out.len);
+		__atomic_store_n(&_con_out.len, 0, __ATOMIC_RELAXED);
+	}
+}
+
+void pal_console_flush(void) {
+	if (_capture && _capture->capturing)
+		return;
+#ifdef EMULATOR_HAS_SESSIONS
+	if (session_self) {
+		session_flush();
+		return;
+	}
+#endif
+	pthread_mutex_lock(&_con_out.lock);
+	_con_flush_locked();
+	pthread_mutex_unlock(&_con_out.lock);
+}
+
+void pal_putbuf(const uint8_t *buf, uint16_t len) {
+	if (_capture && _capture->capturing) {
+		_capture_output(buf, len);
+		return;
+	}
+#ifdef EMULATOR_HAS_SESSIONS
+	if (session_self) {
+		session_putbuf(buf, len);
+		return;
+	}
+#endif
+	if (replay_mode)
+		replay_output(buf, len);
+	pthread_mutex_lock(&_con_out.lock);
+	if (!_con_out.active)
+		_con_write(buf, len);
+	else if (screen_type)
+		screen_write(buf, len);         // Goes out on the next flush, as a screen update
+	else
+		_con_append(buf, len);
+	pthread_mutex_unlock(&_con_out.lock);
+}
+
+// Reads whatever stdin has onto the ring, returns 0 when the ring is full
+static uint8_t _con_read(void) {
+	uint32_t head = _con_in.head;
+	uint32_t tail = __atomic_load_n(&_con_in.tail, __ATOMIC_ACQUIRE);
+	uint32_t room = EMULATOR_CON_TYPEAHEAD - (head - tail);
+	uint32_t start = head & CON_IN_MASK;
+	ssize_t n;
+
+	if (!room)
+		return(0);
+	if (room > EMULATOR_CON_TYPEAHEAD - start)  // Only up to the end of the ring buffer
+		room = EMULATOR_CON_TYPEAHEAD - start;
+	n = read(STDIN_FILENO, &_con_in.buf[start], room);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return(1);
+	pthread_mutex_lock(&_con_in.lock);
+	if (n > 0)
+		__atomic_store_n(&_con_in.head, head + n, __ATOMIC_RELEASE);
+	else
+		__atomic_store_n(&_con_in.eof, 1, __ATOMIC_RELEASE);
+	if (_con_in.waiting)
+		pthread_cond_signal(&_con_in.ready);
+	pthread_mutex_unlock(&_con_in.lock);
+	return(1);
+}
+
+static void *_con_thread_main(void *arg) {
+	struct pollfd pfds[2];
+	uint8_t c;
+
+	pfds[0].fd = _con_wake[0];
+	pfds[0].events = POLLIN;
+	pfds[1].fd = STDIN_FILENO;
+	pfds[1].events = POLLIN;
+	while (!_con_quit) {
+		// Only look at stdin while there is room for what it has
+		pfds[1].revents = 0;
+		if (poll(pfds, _con_in.eof || _con_in.stalled ? 1 : 2, EMULATOR_CON_FLUSH_MS) > 0) {
+			if (pfds[0].revents & POLLIN) {
+				if (read(_con_wake[0], &c, 1) == 1)
+					__atomic_store_n(&_con_in.stalled, 0, __ATOMIC_RELEASE);
+			}
+			if (pfds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+				if (!_con_read())
+					__atomic_store_n(&_con_in.stalled, 1, __ATOMIC_RELEASE);
+			}
+		}
+		if (__atomic_load_n(&_con_out.len, __ATOMIC_RELAXED) || (screen_type && screen_dirty()))
+			pal_console_flush();     // Read without the lock, pal_console_flush looks again under it
+	}
+	return(NULL);
+}
+
+static void _con_wakeup(void) {
+	if (write(_con_wake[1], "", 1) != 1)
+		_con_quit = 1;                      // Should never happen, the thread will notice in a while
+}
+
+static uint8_t _con_ready(void) {
+	return(__atomic_load_n(&_con_in.head, __ATOMIC_ACQUIRE) != _con_in.tail);
+}
+
+// Whether pal_getch would not have to wait, for a character or for the end of the input
+static uint8_t _con_done_waiting(void) {
+	return(_con_ready() || __atomic_load_n(&_con_in.eof, __ATOMIC_ACQUIRE));
+}
+
+static uint8_t _con_take(void) {
+	uint8_t ch;
+
+	ch = _con_in.buf[_con_in.tail & CON_IN_MASK];
+	__atomic_store_n(&_con_in.tail, _con_in.tail + 1, __ATOMIC_RELEASE);
+	if (__atomic_load_n(&_con_in.stalled, __ATOMIC_ACQUIRE))
+		_con_wakeup();                      // There is room again
+	return(ch);
+}
+
 void pal_console_init(void) {
 	tcgetattr(0, &_old_term);
 
@@ -531,30 +931,121 @@ void pal_console_init(void) {
 
 	tcsetattr(0, TCSANOW, &_new_term); /* Apply changes immediately */
 
-	setvbuf(stdout, (char *)NULL, _IONBF, 0); /* Disable stdout buffering */
+	setvbuf(stdout, (char *)NULL, _IONBF, 0); /* Disable stdout buffering, pal_putbuf does its own */
+
+	_con_quit = 0;
+	_con_in.script = !isatty(STDIN_FILENO);
+	if (!pipe(_con_wake)) {
+		if (!pthread_create(&_con_thread, NULL, _con_thread_main, NULL)) {
+			pthread_mutex_lock(&_con_out.lock);
+			_con_out.active = 1;
+			if (screen_type)
+				screen_begin(_con_append);
+			pthread_mutex_unlock(&_con_out.lock);
+		} else {
+			close(_con_wake[0]);
+			close(_con_wake[1]);
+		}
+	}
 }
 
 void pal_console_reset(void) {
+	uint8_t active;
+
+	pthread_mutex_lock(&_con_out.lock);
+	active = _con_out.active;
+	pthread_mutex_unlock(&_con_out.lock);
+	if (active) {                           // The thread flushes under the lock, so it is not held while waiting for it
+		_con_quit = 1;
+		_con_wakeup();
+		pthread_join(_con_thread, NULL);
+		close(_con_wake[0]);
+		close(_con_wake[1]);
+	}
+	pthread_mutex_lock(&_con_out.lock);
+	if (active && screen_type)
+		screen_end(_con_append);
+	_con_flush_locked();
+	_con_out.active = 0;
+	pthread_mutex_unlock(&_con_out.lock);
 	tcsetattr(0, TCSANOW, &_old_term);
 }
 
 
 int pal_kbhit(void) {
 	struct pollfd pfds[1];
+	int hit;
+
+	if (_capture && _capture->in) {
+		if (_capture->in_pos < _capture->in_len)
+			return(1);
+		if (++_capture->polls >= EMULATOR_RUNCOM_POLLS)
+			_capture_starve();
+		return(0);
+	}
+#ifdef EMULATOR_HAS_SESSIONS
+	if (session_self)
+		return(session_kbhit());
+#endif
+	// The guest is about to look for input. Programs poll in a tight loop, so the
+	// lock is only taken when there looks to be something to write. The console
+	// thread changes both while it flushes (a screen render appends to the buffer),
+	// so they are only a hint read without the lock, and a flush it is in the
+	// middle of is finished by the flush here.
+	if (__atomic_load_n(&_con_out.len, __ATOMIC_RELAXED) || (_con_out.active && screen_type && screen_dirty()))
+		pal_console_flush();
+
+	if (_con_out.active) {
+		hit = !_con_in.script && _con_ready();
+	} else {
+		pfds[0].fd = STDIN_FILENO;
+		pfds[0].events = POLLIN | POLLPRI | POLLRDBAND | POLLRDNORM;
 
-	pfds[0].fd = STDIN_FILENO;
-	pfds[0].events = POLLIN | POLLPRI | POLLRDBAND | POLLRDNORM;
-
-	return (poll(pfds, 1, 0) == 1) && (pfds[0].revents & (POLLIN | POLLPRI | POLLRDBAND | POLLRDNORM));
+		hit = (poll(pfds, 1, 0) == 1) && (pfds[0].revents & (POLLIN | POLLPRI | POLLRDBAND | POLLRDNORM));
+	}
+	return(replay_mode ? replay_kbhit(hit) : hit);
 }
 
 uint8_t pal_getch(void) {
-	return getchar();
+	uint16_t ch;
+	int c;
+
+	if (_capture && _capture->in)
+		return(_capture->in_pos < _capture->in_len ? _capture->in[_capture->in_pos++] : _capture_starve());
+#ifdef EMULATOR_HAS_SESSIONS
+	if (session_self)
+		return(session_getch());
+#endif
+	pal_console_flush();
+
+	if (replay_mode == REPLAY_PLAY) {
+		ch = replay_getch(0);           // The recorded character, the console is not read
+	} else if (!_con_out.active) {
+		c = getchar();
+		ch = c == EOF ? REPLAY_EOF : (uint16_t)c;
+	} else {
+		if (!_con_done_waiting()) {
+			pthread_mutex_lock(&_con_in.lock);
+			_con_in.waiting = 1;
+			while (!_con_done_waiting())
+				pthread_cond_wait(&_con_in.ready, &_con_in.lock);
+			_con_in.waiting = 0;
+			pthread_mutex_unlock(&_con_in.lock);
+		}
+		ch = _con_ready() ? _con_take() : REPLAY_EOF;
+	}
+	if (replay_mode == REPLAY_RECORD)
+		replay_getch(ch);
+	if (ch == REPLAY_EOF) {                 // The input is over, so is the machine, as on EXIT
+		cpu_status = 1;
+		return('\r');
+	}
+	return((uint8_t)ch);
 }
 
 
 void pal_putch(uint8_t ch) {
-	putchar(ch);
+	pal_putbuf(&ch, 1);
 }
 
 uint8_t pal_getche(void) {
@@ -567,6 +1058,21 @@ uint8_t pal_getche(void) {
 
 void pal_clrscr(void) {
 	int result;
+	if (_capture && _capture->capturing) {
+		pal_puts("\033[H\033[2J");     // Kept as ANSI, like for sessions
+		return;
+	}
+#ifdef EMULATOR_HAS_SESSIONS
+	if (session_self) {
+		pal_puts("\033[H\033[2J");     // Session clients are expected to be ANSI terminals
+		return;
+	}
+#endif
+	if (_con_out.active && screen_type) {
+		pal_puts("\033[H\033[2J");     // The screen model takes ANSI for any terminal type
+		return;
+	}
+	pal_console_flush();
 	setupterm( NULL, STDOUT_FILENO, &result );
 	if (result <= 0) return;
 
@@ -575,8 +1081,8 @@ void pal_clrscr(void) {
 
 #include <glob.h>
 
-glob_t pglob;
-int dir_pos;
+GLB_TLS glob_t pglob;
+GLB_TLS int dir_pos;
 
 uint8_t pal_find_next(uint8_t isdir)
 {
@@ -594,12 +1100,16 @@ uint8_t pal_find_next(uint8_t isdir)
 #ifdef EMULATOR_USER_SUPPORT
 	dir[2] = glb_file_name[2];
 #endif
+	STATS_FILE(STATS_FILE_SCAN);
 	if (!glob(dir, 0, NULL, &pglob)) {
 		for (i = dir_pos; i < pglob.gl_pathc; i++) {
 			dir_pos++;
 			dirname = pglob.gl_pathv[i];
 			fcb_hostname_to_fcbname((uint8_t*)dirname, glb_fcb_name);
-			if (pal_file_match(glb_fcb_name, glb_pattern) && (stat(dirname, &st) == 0) && ((st.st_mode & S_IFREG) != 0)) {
+			if (!pal_file_match(glb_fcb_name, glb_pattern))
+				continue;
+			STATS_FILE(STATS_FILE_STAT);
+			if (stat(dirname, &st) == 0 && (st.st_mode & S_IFREG) != 0) {
 				if (isdir) {
 					fcb_hostname_to_fcb(glb_dma_addr, (uint8_t*)dirname);
 					ram_write(glb_dma_addr, 0x00);
@@ -0,0 +1,8 @@
+#include "defaults.h"
+#include "port.h"
+#include "pvdma.h"
+
+// Devices by port, the ones left out go to the BDOS and BIOS
+const port_device_t port_devices[256] = {
+	[EMULATOR_PVDMA_PORT] = { pvdma_in, pvdma_out },
+};
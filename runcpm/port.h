@@ -0,0 +1,31 @@
+#ifndef _PORT_H
+#define _PORT_H
+
+#include <stdint.h>
+
+/*
+	I/O ports bound to host devices
+
+	The BDOS and BIOS are reached through the IN and OUT cpm_patch puts on
+	their pages, whatever the port. An IN or OUT anywhere else goes to the
+	device bound to its port in port_devices (port.c), and, when there is
+	none, to the BDOS or BIOS as it always did.
+*/
+typedef uint8_t (*port_in_t)(uint8_t port);
+typedef void (*port_out_t)(uint8_t port, uint8_t value);
+
+typedef struct {
+	port_in_t in;
+	port_out_t out;
+} port_device_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+extern const port_device_t port_devices[256];
+#ifdef __cplusplus
+}
+#endif
+
+#endif
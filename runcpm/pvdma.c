@@ -0,0 +1,96 @@
+#include "defaults.h"
+#include "globals.h"
+#include "cpu.h"
+#include "ram.h"
+#include "pal.h"
+#include "pvdma.h"
+
+#ifdef EMULATOR_OS_POSIX
+#include "replay.h"
+#else
+#define REPLAY_CLOCK(value) (value)
+#endif
+
+/*
+	Paravirtual DMA engine
+
+	A single OUT (EMULATOR_PVDMA_PORT),A has the host do bulk work on guest
+	RAM, in one instruction. A is the command and the other registers are
+	used the way the Z80 block instructions use them:
+	  PVDMA_COPY     Copies BC bytes from HL to DE, upwards a byte at a time
+	                 as LDIR does, so overlapping copies come out the same.
+	                 HL and DE are left past the bytes and BC at 0.
+	  PVDMA_FILL     Sets the BC bytes at DE to L. DE is left past them and
+	                 BC at 0.
+	  PVDMA_COMPARE  Compares the BC bytes at HL with those at DE. A comes
+	                 back 0 if they are the same, 1 if the first byte that
+	                 differs is lower at HL and 0xFF if it is higher, with HL
+	                 and DE on that byte and BC counting it and those after.
+	  PVDMA_CRC      Takes the CRC-16/CCITT (polynomial 0x1021, 0xFFFF to
+	                 start) of the BC bytes at HL, going on from the one in DE,
+	                 which is left in DE. HL is left past the bytes and BC at 0.
+	  PVDMA_CLOCK    Writes the host's monotonic clock in microseconds at DE,
+	                 8 bytes little endian, like BDOS 248.
+	Addresses wrap around at 64K, BC = 0 does nothing, and other commands
+	leave everything as it was.
+
+	IN A,(EMULATOR_PVDMA_PORT) gives PVDMA_ID. With C = 12 first, it is the
+	BDOS Get version call where there is no such device, which gives 0x22,
+	so programs can tell whether it is there.
+*/
+
+static uint16_t pvdma_crc(uint16_t crc, uint8_t byte) {
+	uint8_t i;
+
+	crc ^= (uint16_t)byte << 8;
+	for (i = 0; i < 8; i++)
+		crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	return(crc);
+}
+
+uint8_t pvdma_in(uint8_t port) {
+	return(PVDMA_ID);
+}
+
+void pvdma_out(uint8_t port, uint8_t value) {
+	uint16_t hl = CPU_WORD16(cpu_regs.hl);
+	uint16_t de = CPU_WORD16(cpu_regs.de);
+	uint16_t bc = CPU_WORD16(cpu_regs.bc);
+	uint8_t a = 0, b = 0;
+
+	switch (value) {
+	case PVDMA_COPY:
+		for (; bc; bc--)
+			ram_write(de++, ram_read(hl++));
+		break;
+	case PVDMA_FILL:
+		for (a = CPU_REG_GET_LOW(cpu_regs.hl); bc; bc--)
+			ram_write(de++, a);
+		break;
+	case PVDMA_COMPARE:
+		for (; bc; bc--, hl++, de++) {
+			a = ram_read(hl);
+			b = ram_read(de);
+			if (a != b)
+				break;
+		}
+		CPU_REG_SET_HIGH(cpu_regs.af, !bc ? 0x00 : a < b ? 0x01 : 0xff);
+		break;
+	case PVDMA_CRC:
+		for (; bc; bc--)
+			de = pvdma_crc(de, ram_read(hl++));
+		break;
+	case PVDMA_CLOCK: {
+		uint64_t us = REPLAY_CLOCK(pal_clock_us());
+
+		for (a = 0; a < 8; a++, us >>= 8)
+			ram_write(de + a, (uint8_t)us);
+		break;
+	}
+	default:
+		return;
+	}
+	cpu_regs.hl = hl;
+	cpu_regs.de = de;
+	cpu_regs.bc = bc;
+}
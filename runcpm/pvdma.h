@@ -0,0 +1,24 @@
+#ifndef _PVDMA_H
+#define _PVDMA_H
+
+#include <stdint.h>
+
+#define PVDMA_ID      0x44	// What IN from the port gives
+
+#define PVDMA_COPY    0x01	// Commands, in A for the OUT
+#define PVDMA_FILL    0x02
+#define PVDMA_COMPARE 0x03
+#define PVDMA_CRC     0x04
+#define PVDMA_CLOCK   0x05
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+extern uint8_t pvdma_in(uint8_t port);
+extern void pvdma_out(uint8_t port, uint8_t value);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
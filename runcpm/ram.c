@@ -1,8 +1,11 @@
 #include "defaults.h"
+#include "globals.h"
 #include "ram.h"
 
+#include <string.h>
+
 #ifndef ARDUINO
-static uint8_t RAM[64*1024]={0};         // Definition of the emulated RAM
+static GLB_TLS uint8_t RAM[64*1024]={0};         // Definition of the emulated RAM
 
 uint8_t ram_read(uint16_t address) {
 	return(RAM[address]);
@@ -11,6 +14,11 @@ uint8_t ram_read(uint16_t address) {
 void ram_write(uint16_t address, uint8_t value) {
 	RAM[address] = value;
 }
+
+// The emulated RAM itself, for code that reads it directly (aot.c)
+uint8_t *ram_base(void) {
+	return(RAM);
+}
 #endif
 
 void ram_init() {
@@ -38,3 +46,42 @@ void ram_copy(uint16_t source, int size, uint16_t destination) {
 		ram_write(destination++, ram_read(source++));
 	}
 }
+
+// Block copies between guest memory and buf, wrapping around at the top of memory
+void ram_read_block(uint16_t address, uint8_t *buf, uint32_t len) {
+#ifndef ARDUINO
+	uint32_t n;
+
+	while (len) {
+		n = 0x10000 - address;
+		if (n > len)
+			n = len;
+		memcpy(buf, &RAM[address], n);
+		buf += n;
+		len -= n;
+		address += n;
+	}
+#else
+	while (len--)
+		*buf++ = ram_read(address++);
+#endif
+}
+
+void ram_write_block(uint16_t address, const uint8_t *buf, uint32_t len) {
+#ifndef ARDUINO
+	uint32_t n;
+
+	while (len) {
+		n = 0x10000 - address;
+		if (n > len)
+			n = len;
+		memcpy(&RAM[address], buf, n);
+		buf += n;
+		len -= n;
+		address += n;
+	}
+#else
+	while (len--)
+		ram_write(address++, *buf++);
+#endif
+}
@@ -10,6 +10,9 @@ extern uint8_t ram_read(uint16_t address);
 extern void ram_write16(uint16_t address, uint16_t value);
 extern uint16_t ram_read16(uint16_t address);
 extern void ram_fill(uint16_t address, int size, uint8_t value);
+extern void ram_read_block(uint16_t address, uint8_t *buf, uint32_t len);
+extern void ram_write_block(uint16_t address, const uint8_t *buf, uint32_t len);
+extern uint8_t *ram_base(void);
 #ifdef __cplusplus
 }
 #endif
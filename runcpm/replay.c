@@ -0,0 +1,248 @@
+#include "defaults.h"
+
+#ifdef EMULATOR_OS_POSIX
+
+#include "globals.h"
+#include "cpu.h"
+#include "pal.h"
+#include "trace.h"
+#include "itrace.h"
+#include "replay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+	Deterministic record and replay
+
+	What a guest does only depends on its inputs, and the inputs that vary
+	from run to run are the console: which characters come in, and whether one
+	is ready yet each time the guest polls for it, and the host clocks the
+	guest can read (BDOS 105 and 248, PVDMA_CLOCK). With -r every one of them is
+	logged along with the instruction count it was observed at, and with -R a
+	log is fed back in their place, so an interactive or polling program runs
+	exactly the same instructions every time, however fast the host is and
+	whatever is typed meanwhile. That makes benchmarks of interactive workloads
+	repeatable, and a change to the emulator can be checked as bit exact
+	against a recording: the instruction count and a hash of all the console
+	output are compared when the replay ends.
+
+	Host files are not stored in the log, only their size and hash when the
+	guest opens them, so a replay stops as soon as it finds one that is not
+	the same as recorded. It also stops at the first input the guest asks for
+	in a different way or at a different instruction than recorded.
+
+	Only the console machine records and replays, sessions are left alone.
+*/
+
+typedef struct {
+	char kind;
+	uint64_t icount;
+	uint64_t a;		// K call number, C character, F size, E bytes, T clock
+	uint64_t hash;		// F and E
+	char name[64];		// F
+} replay_event_t;
+
+uint8_t replay_mode = REPLAY_OFF;
+
+static FILE *replay_log;
+static replay_event_t *replay_events;
+static uint32_t replay_count = 0;
+static uint32_t replay_next = 0;
+static uint64_t replay_kbhits = 0;	// pal_kbhit calls so far
+static uint64_t replay_bytes = 0;	// Console output so far
+static uint64_t replay_hash = 0xcbf29ce484222325ULL;
+
+static uint64_t replay_fnv(uint64_t hash, const uint8_t *buf, size_t len) {
+	while (len--) {
+		hash ^= *buf++;
+		hash *= 0x100000001b3ULL;
+	}
+	return(hash);
+}
+
+// Stops RunCPM where the replay no longer follows the recording
+static void replay_diverge(const char *what) {
+	char text[128];
+
+	replay_mode = REPLAY_OFF;
+	snprintf(text, sizeof(text), "\r\nReplay diverged at instruction %llu: %s.\r\n", (unsigned long long)cpu_icount, what);
+	pal_puts(text);
+	pal_console_reset();
+	trace_flush();
+	itrace_flush();
+	exit(1);
+}
+
+// The next recorded event, which has to be of this kind
+static replay_event_t *replay_expect(char kind, const char *what) {
+	replay_event_t *event;
+
+	if (replay_next == replay_count)
+		replay_diverge("the recording ends here");
+	event = &replay_events[replay_next];
+	if (event->kind != kind)
+		replay_diverge(what);
+	if (event->icount != cpu_icount)
+		replay_diverge("input taken at a different instruction");
+	replay_next++;
+	return(event);
+}
+
+static uint8_t replay_load(void) {
+	char line[160];
+	replay_event_t event, *more;
+	uint32_t room = 0;
+	unsigned long long icount, a, hash;
+
+	while (fgets(line, sizeof(line), replay_log)) {
+		memset(&event, 0, sizeof(event));
+		event.kind = line[0];
+		switch (line[0]) {
+		case 'K':
+		case 'C':
+		case 'T':
+			if (sscanf(line + 1, "%llu %llu", line[0] == 'K' ? &a : &icount, line[0] == 'K' ? &icount : &a) != 2)
+				return(1);
+			break;
+		case 'F':
+			if (sscanf(line + 1, "%llu %llu %llx %63s", &icount, &a, &hash, event.name) != 4)
+				return(1);
+			event.hash = hash;
+			break;
+		case 'E':
+			if (sscanf(line + 1, "%llu %llu %llx", &icount, &a, &hash) != 3)
+				return(1);
+			event.hash = hash;
+			break;
+		default:
+			return(1);
+		}
+		event.icount = icount;
+		event.a = a;
+		if (replay_count == room) {
+			room = room ? room * 2 : 1024;
+			if (!(more = (replay_event_t*)realloc(replay_events, room * sizeof(replay_event_t))))
+				return(1);
+			replay_events = more;
+		}
+		replay_events[replay_count++] = event;
+	}
+	return(0);
+}
+
+// Starts recording to or replaying from path, returns 0 on success
+uint8_t replay_init(const char *path, uint8_t mode) {
+	char line[32];
+
+	replay_log = fopen(path, mode == REPLAY_RECORD ? "w" : "r");
+	if (!replay_log)
+		return(1);
+	if (mode == REPLAY_RECORD) {
+		if (fprintf(replay_log, "%s\n", REPLAY_MAGIC) < 0)
+			return(1);
+	} else {
+		if (!fgets(line, sizeof(line), replay_log) || strncmp(line, REPLAY_MAGIC "\n", sizeof(line)) || replay_load())
+			return(1);
+		fclose(replay_log);
+		replay_log = NULL;
+	}
+	replay_mode = mode;
+	return(0);
+}
+
+// Takes what pal_kbhit found, returns what the guest sees
+int replay_kbhit(int hit) {
+	uint64_t call = replay_kbhits++;
+
+	if (replay_mode == REPLAY_RECORD) {
+		if (hit) {
+			fprintf(replay_log, "K %llu %llu\n", (unsigned long long)call, (unsigned long long)cpu_icount);
+			fflush(replay_log);
+		}
+		return(hit);
+	}
+	if (replay_next == replay_count || replay_events[replay_next].kind != 'K' || replay_events[replay_next].a != call)
+		return(0);
+	replay_expect('K', "");
+	return(1);
+}
+
+// Takes the character pal_getch read (REPLAY_EOF at the end of the input), returns the one the guest sees
+uint16_t replay_getch(uint16_t ch) {
+	if (replay_mode == REPLAY_RECORD) {
+		fprintf(replay_log, "C %llu %u\n", (unsigned long long)cpu_icount, ch);
+		fflush(replay_log);
+		return(ch);
+	}
+	return((uint16_t)replay_expect('C', "console input read where none was recorded")->a);
+}
+
+// Takes what a host clock read, returns what the guest sees
+uint64_t replay_clock(uint64_t value) {
+	if (replay_mode == REPLAY_RECORD) {
+		fprintf(replay_log, "T %llu %llu\n", (unsigned long long)cpu_icount, (unsigned long long)value);
+		fflush(replay_log);
+		return(value);
+	}
+	return(replay_expect('T', "host clock read where none was recorded")->a);
+}
+
+void replay_output(const uint8_t *buf, uint16_t len) {
+	replay_bytes += len;
+	replay_hash = replay_fnv(replay_hash, buf, len);
+}
+
+// Notes the contents of a host file as the guest opens it
+void replay_file(const uint8_t *filename) {
+	uint8_t buf[4096];
+	uint64_t hash = 0xcbf29ce484222325ULL, size = 0;
+	size_t got;
+	replay_event_t *event;
+	FILE *file = fopen((const char*)filename, "rb");
+
+	if (file) {
+		while ((got = fread(buf, 1, sizeof(buf), file))) {
+			hash = replay_fnv(hash, buf, got);
+			size += got;
+		}
+		fclose(file);
+	}
+	if (replay_mode == REPLAY_RECORD) {
+		fprintf(replay_log, "F %llu %llu %016llx %s\n", (unsigned long long)cpu_icount, (unsigned long long)size,
+			(unsigned long long)hash, (const char*)filename);
+		fflush(replay_log);
+		return;
+	}
+	event = replay_expect('F', "file opened where none was recorded");
+	if (event->a != size || event->hash != hash || strcmp(event->name, (const char*)filename))
+		replay_diverge("a host file is not the same as recorded");
+}
+
+// Ends the recording or checks the replay ended the same, returns 0 when it did
+uint8_t replay_finish(void) {
+	replay_event_t *event;
+	uint8_t mode = replay_mode;
+
+	replay_mode = REPLAY_OFF;	// What is written from now on is not part of the run
+	if (mode == REPLAY_RECORD) {
+		fprintf(replay_log, "E %llu %llu %016llx\n", (unsigned long long)cpu_icount, (unsigned long long)replay_bytes,
+			(unsigned long long)replay_hash);
+		return(fclose(replay_log) ? 1 : 0);
+	}
+	if (mode != REPLAY_PLAY)
+		return(0);
+	if (replay_next == replay_count || (event = &replay_events[replay_next])->kind != 'E') {
+		pal_puts("Replay ended before the recording did.\r\n");
+		return(1);
+	}
+	if (event->icount != cpu_icount || event->a != replay_bytes || event->hash != replay_hash) {
+		pal_puts("Replay ended with different console output or instruction count.\r\n");
+		return(1);
+	}
+	pal_puts("Replay matched the recording.\r\n");
+	return(0);
+}
+
+#endif
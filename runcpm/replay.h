@@ -0,0 +1,48 @@
+#ifndef _REPLAY_H
+#define _REPLAY_H
+
+#include <stdint.h>
+
+/*
+	Replay log format
+
+	Text, REPLAY_MAGIC on the first line, then one event per line, in the
+	order the guest observed them. Counts and characters are decimal, hashes
+	are 64 bit FNV-1a in hexadecimal.
+	  K call icount             pal_kbhit call number call (from 0) found a
+	                            character ready, the calls not logged found none
+	  C icount char             pal_getch returned char, or found the input over
+	                            when char is REPLAY_EOF
+	  F icount size hash name   The guest opened host file name, with these contents
+	  T icount value            The guest read a host clock, which gave value
+	  E icount bytes hash       RunCPM ended, having written bytes to the console
+	icount is the number of instructions executed when the event happened.
+*/
+#define REPLAY_MAGIC "RunCPM replay 1"
+
+#define REPLAY_OFF    0
+#define REPLAY_RECORD 1
+#define REPLAY_PLAY   2
+
+#define REPLAY_EOF 0x100	// The character pal_getch reads once the console input is over
+
+#define REPLAY_FILE(filename) do { if (replay_mode) replay_file(filename); } while (0)
+#define REPLAY_CLOCK(value) (replay_mode ? replay_clock(value) : (value))
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+extern uint8_t replay_mode;
+extern uint8_t replay_init(const char *path, uint8_t mode);
+extern int replay_kbhit(int hit);
+extern uint16_t replay_getch(uint16_t ch);
+extern void replay_output(const uint8_t *buf, uint16_t len);
+extern void replay_file(const uint8_t *filename);
+extern uint64_t replay_clock(uint64_t value);
+extern uint8_t replay_finish(void);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,575 @@
+#include "defaults.h"
+
+#ifdef EMULATOR_OS_POSIX
+
+#include "screen.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+	Terminal screen model
+
+	When selected, everything the guest writes to the console is parsed into a
+	character grid instead of being passed on to the host terminal. Rendering
+	compares the grid against a shadow copy of what the host terminal is showing
+	and sends only the ANSI sequences needed to bring it up to date, so a program
+	repainting a whole screen to change a few characters costs a few bytes.
+	Whole screen scrolls are sent as line feeds inside a scroll region the size of
+	the grid, so line oriented output stays cheap too.
+
+	The caller does the locking and decides when to render, which is the console
+	flush policy (input requested or EMULATOR_CON_FLUSH_MS have passed).
+*/
+
+#define ROWS EMULATOR_SCREEN_ROWS
+#define COLS EMULATOR_SCREEN_COLS
+
+#define ATTR_BOLD      0x01
+#define ATTR_UNDERLINE 0x02
+#define ATTR_BLINK     0x04
+#define ATTR_REVERSE   0x08
+#define ATTR_UNKNOWN   0xff                 // Forces the attributes to be sent
+
+#define BLANK ((screen_cell_t){ ' ', 0 })
+
+#define ESC 0x1b
+
+typedef struct {
+	uint8_t ch;
+	uint8_t attr;
+} screen_cell_t;
+
+enum { ST_NORMAL, ST_ESC, ST_ROW, ST_COL, ST_CSI, ST_SKIP };
+
+uint8_t screen_type = SCREEN_OFF;
+
+static screen_cell_t screen_grid[ROWS][COLS];    // What the guest wants to show
+static screen_cell_t screen_shadow[ROWS][COLS];  // What the host terminal is showing
+
+static struct {
+	int8_t row, col;
+	uint8_t attr;
+	uint8_t wrap;                           // Cursor is past the last column, wraps on the next character
+	uint8_t state;
+	uint8_t row_pos;                        // Row of a pending cursor address
+	uint8_t nparams;
+	uint16_t params[8];
+	uint8_t dirty;
+	uint8_t bell;
+	uint8_t cleared;                        // Whole screen was cleared since the last render
+	uint16_t scrolled;                      // Whole screen scrolls since the last render
+} scr;
+
+static struct {
+	int8_t row, col;                        // -1 when unknown, col is COLS while a wrap is pending
+	uint8_t attr;
+} host;
+
+static const struct {
+	const char *name;
+	uint8_t type;
+} screen_names[] = {
+	{ "adm3a", SCREEN_ADM3A },
+	{ "kaypro", SCREEN_ADM3A },
+	{ "vt52", SCREEN_VT52 },
+	{ "ansi", SCREEN_ANSI },
+	{ "vt100", SCREEN_ANSI },
+};
+
+// Selects the terminal the guest is expected to drive, returns 0 if the name is unknown
+uint8_t screen_select(const char *name) {
+	uint8_t i;
+
+	for (i = 0; i < sizeof(screen_names) / sizeof(screen_names[0]); i++) {
+		if (!strcmp(name, screen_names[i].name)) {
+			screen_type = screen_names[i].type;
+			screen_reset();
+			return(1);
+		}
+	}
+	return(0);
+}
+
+static void screen_fill(screen_cell_t *from, screen_cell_t *to) {
+	while (from < to)
+		*from++ = BLANK;
+}
+
+void screen_reset(void) {
+	screen_fill(&screen_grid[0][0], screen_grid[0] + ROWS * COLS);
+	memset(&scr, 0, sizeof(scr));
+	scr.cleared = 1;
+	scr.dirty = 1;
+}
+
+/* Grid operations */
+
+static void screen_scroll_up(void) {
+	memmove(&screen_grid[0][0], &screen_grid[1][0], (ROWS - 1) * sizeof(screen_grid[0]));
+	screen_fill(&screen_grid[ROWS - 1][0], screen_grid[0] + ROWS * COLS);
+	scr.scrolled++;
+}
+
+static void screen_clear(void) {
+	screen_fill(&screen_grid[0][0], screen_grid[0] + ROWS * COLS);
+	scr.cleared = 1;
+	scr.scrolled = 0;
+}
+
+// Inserts (count > 0) or deletes (count < 0) lines at the cursor row
+static void screen_lines(int count) {
+	int n = ROWS - scr.row;
+
+	if (count > n)
+		count = n;
+	if (count < -n)
+		count = -n;
+	if (count > 0) {
+		memmove(&screen_grid[scr.row + count][0], &screen_grid[scr.row][0], (n - count) * sizeof(screen_grid[0]));
+		screen_fill(&screen_grid[scr.row][0], &screen_grid[scr.row + count][0]);
+	} else if (count < 0) {
+		count = -count;
+		memmove(&screen_grid[scr.row][0], &screen_grid[scr.row + count][0], (n - count) * sizeof(screen_grid[0]));
+		screen_fill(&screen_grid[ROWS - count][0], screen_grid[0] + ROWS * COLS);
+	}
+	scr.col = 0;
+}
+
+// Inserts (count > 0) or deletes (count < 0) characters at the cursor
+static void screen_chars(int count) {
+	screen_cell_t *line = screen_grid[scr.row];
+	int n = COLS - scr.col;
+
+	if (count > n)
+		count = n;
+	if (count < -n)
+		count = -n;
+	if (count > 0) {
+		memmove(&line[scr.col + count], &line[scr.col], (n - count) * sizeof(screen_cell_t));
+		screen_fill(&line[scr.col], &line[scr.col + count]);
+	} else if (count < 0) {
+		count = -count;
+		memmove(&line[scr.col], &line[scr.col + count], (n - count) * sizeof(screen_cell_t));
+		screen_fill(&line[COLS - count], &line[COLS]);
+	}
+}
+
+static void screen_move(int row, int col) {
+	scr.row = row < 0 ? 0 : row >= ROWS ? ROWS - 1 : row;
+	scr.col = col < 0 ? 0 : col >= COLS ? COLS - 1 : col;
+	scr.wrap = 0;
+}
+
+static void screen_line_feed(void) {
+	if (scr.row == ROWS - 1)
+		screen_scroll_up();
+	else
+		scr.row++;
+}
+
+static void screen_put(uint8_t ch) {
+	if (scr.wrap) {
+		scr.col = 0;
+		screen_line_feed();
+		scr.wrap = 0;
+	}
+	screen_grid[scr.row][scr.col].ch = ch;
+	screen_grid[scr.row][scr.col].attr = scr.attr;
+	if (scr.col == COLS - 1)
+		scr.wrap = 1;
+	else
+		scr.col++;
+}
+
+/* Parsers */
+
+static void screen_control(uint8_t ch) {
+	switch (ch) {
+	case 0x07:                          // Bell
+		scr.bell = 1; break;
+	case 0x08:                          // Backspace
+		screen_move(scr.row, scr.col - 1); break;
+	case 0x09:                          // Tab
+		screen_move(scr.row, (scr.col | 7) + 1); break;
+	case 0x0a:                          // Line feed
+		scr.wrap = 0;
+		screen_line_feed(); break;
+	case 0x0d:                          // Carriage return
+		screen_move(scr.row, 0); break;
+	case ESC:
+		scr.state = ST_ESC; break;
+	default:
+		if (screen_type != SCREEN_ADM3A)
+			break;
+		switch (ch) {                   // ADM-3A control characters
+		case 0x0b:                      // Cursor up
+			screen_move(scr.row - 1, scr.col); break;
+		case 0x0c:                      // Cursor right
+			screen_move(scr.row, scr.col + 1); break;
+		case 0x1a:                      // Clear screen
+			screen_clear();
+			screen_move(0, 0); break;
+		case 0x1e:                      // Home
+			screen_move(0, 0); break;
+		}
+	}
+}
+
+static void screen_escape(uint8_t ch) {
+	scr.state = ST_NORMAL;
+	if (ch == '[') {                    // Every terminal type takes ANSI sequences
+		scr.nparams = 0;
+		memset(scr.params, 0, sizeof(scr.params));
+		scr.state = ST_CSI;
+		return;
+	}
+	if (screen_type == SCREEN_ADM3A) {
+		switch (ch) {
+		case '=':                       // Cursor address, row and column follow
+			scr.state = ST_ROW; break;
+		case 'T': case 't':             // Clear to end of line
+			screen_fill(&screen_grid[scr.row][scr.col], &screen_grid[scr.row][COLS]); break;
+		case 'Y': case 'y':             // Clear to end of screen
+			screen_fill(&screen_grid[scr.row][scr.col], screen_grid[0] + ROWS * COLS); break;
+		case '*': case ':':             // Clear screen
+			screen_clear();
+			screen_move(0, 0); break;
+		case 'E':                       // Insert line
+			screen_lines(1); break;
+		case 'R':                       // Delete line
+			screen_lines(-1); break;
+		case 'B': case 'C':             // Kaypro attribute on/off, attribute follows
+			scr.row_pos = ch;
+			scr.state = ST_SKIP; break;
+		}
+	} else if (screen_type == SCREEN_VT52) {
+		switch (ch) {
+		case 'A':
+			screen_move(scr.row - 1, scr.col); break;
+		case 'B':
+			screen_move(scr.row + 1, scr.col); break;
+		case 'C':
+			screen_move(scr.row, scr.col + 1); break;
+		case 'D':
+			screen_move(scr.row, scr.col - 1); break;
+		case 'H':
+			screen_move(0, 0); break;
+		case 'E':                       // Clear screen (Z19/Atari)
+			screen_clear();
+			screen_move(0, 0); break;
+		case 'I':                       // Reverse line feed
+			if (scr.row)
+				screen_move(scr.row - 1, scr.col);
+			else
+				screen_lines(1);
+			break;
+		case 'J':
+			screen_fill(&screen_grid[scr.row][scr.col], screen_grid[0] + ROWS * COLS); break;
+		case 'K':
+			screen_fill(&screen_grid[scr.row][scr.col], &screen_grid[scr.row][COLS]); break;
+		case 'L':
+			screen_lines(1); break;
+		case 'M':
+			screen_lines(-1); break;
+		case 'Y':
+			scr.state = ST_ROW; break;
+		case 'p':
+			scr.attr |= ATTR_REVERSE; break;
+		case 'q':
+			scr.attr &= ~ATTR_REVERSE; break;
+		}
+	}
+}
+
+static void screen_kaypro_attr(uint8_t on, uint8_t ch) {
+	static const uint8_t attrs[] = { ATTR_REVERSE, ATTR_BOLD, ATTR_BLINK, ATTR_UNDERLINE };
+
+	if (ch >= '0' && ch <= '3') {
+		if (on)
+			scr.attr |= attrs[ch - '0'];
+		else
+			scr.attr &= ~attrs[ch - '0'];
+	}
+}
+
+static void screen_sgr(void) {
+	uint8_t i;
+
+	if (!scr.nparams)
+		scr.attr = 0;
+	for (i = 0; i < scr.nparams; i++) {
+		switch (scr.params[i]) {
+		case 0:  scr.attr = 0;                  break;
+		case 1:  scr.attr |= ATTR_BOLD;         break;
+		case 4:  scr.attr |= ATTR_UNDERLINE;    break;
+		case 5:  scr.attr |= ATTR_BLINK;        break;
+		case 7:  scr.attr |= ATTR_REVERSE;      break;
+		case 22: scr.attr &= ~ATTR_BOLD;        break;
+		case 24: scr.attr &= ~ATTR_UNDERLINE;   break;
+		case 25: scr.attr &= ~ATTR_BLINK;       break;
+		case 27: scr.attr &= ~ATTR_REVERSE;     break;
+		}
+	}
+}
+
+static void screen_csi(uint8_t ch) {
+	uint16_t p0 = scr.params[0];
+	uint16_t n = p0 ? p0 : 1;
+
+	if (ch >= '0' && ch <= '9') {
+		if (!scr.nparams)
+			scr.nparams = 1;
+		if (scr.nparams <= 8)
+			scr.params[scr.nparams - 1] = scr.params[scr.nparams - 1] * 10 + ch - '0';
+		return;
+	}
+	if (ch == ';') {
+		if (!scr.nparams)
+			scr.nparams = 1;
+		scr.nparams++;
+		return;
+	}
+	if (ch < 0x40)                      // Private markers and intermediates
+		return;
+	scr.state = ST_NORMAL;
+	if (scr.nparams > 8)
+		scr.nparams = 8;
+	switch (ch) {
+	case 'A':
+		screen_move(scr.row - n, scr.col); break;
+	case 'B':
+		screen_move(scr.row + n, scr.col); break;
+	case 'C':
+		screen_move(scr.row, scr.col + n); break;
+	case 'D':
+		screen_move(scr.row, scr.col - n); break;
+	case 'G':
+		screen_move(scr.row, n - 1); break;
+	case 'd':
+		screen_move(n - 1, scr.col); break;
+	case 'H': case 'f':
+		screen_move(n - 1, (scr.params[1] ? scr.params[1] : 1) - 1); break;
+	case 'J':
+		if (p0 == 0)
+			screen_fill(&screen_grid[scr.row][scr.col], screen_grid[0] + ROWS * COLS);
+		else if (p0 == 1)
+			screen_fill(&screen_grid[0][0], &screen_grid[scr.row][scr.col + 1]);
+		else
+			screen_clear();
+		break;
+	case 'K':
+		if (p0 == 0)
+			screen_fill(&screen_grid[scr.row][scr.col], &screen_grid[scr.row][COLS]);
+		else if (p0 == 1)
+			screen_fill(&screen_grid[scr.row][0], &screen_grid[scr.row][scr.col + 1]);
+		else
+			screen_fill(&screen_grid[scr.row][0], &screen_grid[scr.row][COLS]);
+		break;
+	case 'L':
+		screen_lines(n); break;
+	case 'M':
+		screen_lines(-n); break;
+	case '@':
+		screen_chars(n); break;
+	case 'P':
+		screen_chars(-n); break;
+	case 'm':
+		screen_sgr(); break;
+	}
+}
+
+void screen_write(const uint8_t *buf, uint16_t len) {
+	uint8_t ch;
+
+	if (len)
+		scr.dirty = 1;
+	while (len--) {
+		ch = *buf++ & 0x7f;
+		switch (scr.state) {
+		case ST_NORMAL:
+			if (ch < 0x20)
+				screen_control(ch);
+			else if (ch != 0x7f)
+				screen_put(ch);
+			break;
+		case ST_ESC:
+			screen_escape(ch); break;
+		case ST_ROW:
+			scr.row_pos = ch;
+			scr.state = ST_COL; break;
+		case ST_COL:
+			screen_move(scr.row_pos - ' ', ch - ' ');
+			scr.state = ST_NORMAL; break;
+		case ST_CSI:
+			screen_csi(ch); break;
+		case ST_SKIP:
+			screen_kaypro_attr(scr.row_pos == 'B', ch);
+			scr.state = ST_NORMAL; break;
+		}
+	}
+}
+
+// Read without the console lock, as a hint that a flush has something to render
+uint8_t screen_dirty(void) {
+	return(__atomic_load_n(&scr.dirty, __ATOMIC_RELAXED));
+}
+
+/* Rendering */
+
+static struct {
+	uint8_t buf[256];
+	uint16_t len;
+	screen_out_t out;
+} emit;
+
+static void screen_emit(const char *str, uint16_t len) {
+	if (emit.len + len > sizeof(emit.buf)) {
+		emit.out(emit.buf, emit.len);
+		emit.len = 0;
+	}
+	memcpy(&emit.buf[emit.len], str, len);
+	emit.len += len;
+}
+
+static void screen_emitf(const char *fmt, int a, int b) {
+	char str[24];
+
+	screen_emit(str, snprintf(str, sizeof(str), fmt, a, b));
+}
+
+static void screen_goto(int row, int col) {
+	if (host.row != row || host.col != col) {
+		if (host.row == row && !col)
+			screen_emit("\r", 1);
+		else if (host.row >= 0 && host.row + 1 == row && !col)
+			screen_emit("\r\n", 2);
+		else
+			screen_emitf("\033[%d;%dH", row + 1, col + 1);
+		host.row = row;
+		host.col = col;
+	}
+}
+
+static void screen_attr(uint8_t attr) {
+	if (host.attr != attr) {
+		screen_emit("\033[0", 3);
+		if (attr & ATTR_BOLD)
+			screen_emit(";1", 2);
+		if (attr & ATTR_UNDERLINE)
+			screen_emit(";4", 2);
+		if (attr & ATTR_BLINK)
+			screen_emit(";5", 2);
+		if (attr & ATTR_REVERSE)
+			screen_emit(";7", 2);
+		screen_emit("m", 1);
+		host.attr = attr;
+	}
+}
+
+static int screen_same(screen_cell_t a, screen_cell_t b) {
+	return(a.ch == b.ch && a.attr == b.attr);
+}
+
+// Column after the last cell that is not blank
+static int screen_line_end(screen_cell_t *line) {
+	int end = COLS;
+
+	while (end && screen_same(line[end - 1], BLANK))
+		end--;
+	return(end);
+}
+
+static void screen_render_line(int row) {
+	screen_cell_t *line = screen_grid[row];
+	screen_cell_t *shadow = screen_shadow[row];
+	int end = screen_line_end(line);
+	int col, skip;
+
+	// A blank tail is cleared in one go if that beats writing spaces over it
+	if (screen_line_end(shadow) > end + 3) {
+		screen_goto(row, end);
+		screen_attr(0);
+		screen_emit("\033[K", 3);
+		screen_fill(&shadow[end], &shadow[COLS]);
+	}
+	for (col = 0; col < COLS; col++) {
+		if (screen_same(line[col], shadow[col]))
+			continue;
+		// Rewriting unchanged cells is cheaper than a cursor address (up to 8 bytes)
+		if (host.row == row && host.col < col && col - host.col <= 8) {
+			for (skip = host.col; skip < col && line[skip].attr == host.attr; skip++)
+				;
+			if (skip == col) {
+				for (skip = host.col; skip < col; skip++)
+					screen_emit((char *)&line[skip].ch, 1);
+				host.col = col;
+			}
+		}
+		screen_goto(row, col);
+		screen_attr(line[col].attr);
+		screen_emit((char *)&line[col].ch, 1);
+		shadow[col] = line[col];
+		host.col++;
+	}
+}
+
+void screen_render(screen_out_t out) {
+	int row;
+
+	if (!scr.dirty)
+		return;
+	emit.out = out;
+	emit.len = 0;
+	if (scr.bell)
+		screen_emit("\a", 1);
+	if (scr.cleared) {
+		screen_attr(0);
+		screen_emit("\033[H\033[2J", 7);
+		host.row = host.col = 0;
+		screen_fill(&screen_shadow[0][0], screen_shadow[0] + ROWS * COLS);
+	} else if (scr.scrolled >= ROWS) {
+		screen_attr(0);
+		screen_emit("\033[2J", 4);
+		screen_fill(&screen_shadow[0][0], screen_shadow[0] + ROWS * COLS);
+	} else if (scr.scrolled) {          // The host terminal scrolls its own copy
+		screen_goto(ROWS - 1, 0);
+		screen_attr(0);
+		for (row = 0; row < scr.scrolled; row++)
+			screen_emit("\n", 1);
+		memmove(&screen_shadow[0][0], &screen_shadow[scr.scrolled][0], (ROWS - scr.scrolled) * sizeof(screen_shadow[0]));
+		screen_fill(&screen_shadow[ROWS - scr.scrolled][0], screen_shadow[0] + ROWS * COLS);
+	}
+	for (row = 0; row < ROWS; row++) {
+		if (memcmp(screen_grid[row], screen_shadow[row], sizeof(screen_grid[0])))
+			screen_render_line(row);
+	}
+	screen_goto(scr.row, scr.col);
+	screen_attr(scr.attr);
+	if (emit.len)
+		out(emit.buf, emit.len);
+	scr.dirty = scr.bell = scr.cleared = 0;
+	scr.scrolled = 0;
+}
+
+// Takes over the host terminal, limiting scrolling to the size of the grid
+void screen_begin(screen_out_t out) {
+	char str[32];
+
+	out((uint8_t *)str, snprintf(str, sizeof(str), "\033[0m\033[1;%dr\033[H\033[2J", ROWS));
+	host.row = host.col = 0;
+	host.attr = 0;
+	screen_fill(&screen_shadow[0][0], screen_shadow[0] + ROWS * COLS);
+	scr.cleared = 0;
+	scr.dirty = 1;
+}
+
+// Hands the host terminal back, leaving the cursor below the grid
+void screen_end(screen_out_t out) {
+	char str[32];
+
+	screen_render(out);
+	out((uint8_t *)str, snprintf(str, sizeof(str), "\033[0m\033[r\033[%d;1H\r\n", ROWS));
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef _SCREEN_H
+#define _SCREEN_H
+
+#include <stdint.h>
+
+#define SCREEN_OFF   0
+#define SCREEN_ADM3A 1	// ADM-3A, with the usual Kaypro/TeleVideo additions
+#define SCREEN_VT52  2
+#define SCREEN_ANSI  3	// Control characters and ANSI/VT100 escape sequences only
+
+typedef void (*screen_out_t)(const uint8_t *buf, uint16_t len);
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+extern uint8_t screen_type;
+extern uint8_t screen_select(const char *name);
+extern void screen_reset(void);
+extern void screen_write(const uint8_t *buf, uint16_t len);
+extern uint8_t screen_dirty(void);
+extern void screen_render(screen_out_t out);
+extern void screen_begin(screen_out_t out);
+extern void screen_end(screen_out_t out);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,209 @@
+#include "defaults.h"
+
+#ifdef EMULATOR_OS_POSIX
+
+#include "globals.h"
+#include "cpu.h"
+#include "cpm.h"
+#include "pal.h"
+#include "server.h"
+
+#ifdef EMULATOR_CCP_EMULATED
+#include "ccp.h"
+#endif
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+	Fork server
+
+	The parent brings the machine up once (CCP loaded, page zero patched and
+	optionally a program preloaded onto the TPA) and then waits for requests on
+	a Unix socket. A request is a single message carrying the client stdin and
+	stdout descriptors plus a "root\0cmdline\0" payload, where root is the folder
+	holding the A, B, ... drive folders. Every request gets its own child, which
+	inherits the warm machine copy-on-write and sends back a status byte once done.
+*/
+
+static int server_address(const char *path, struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path))
+		return(0);
+	strcpy(addr->sun_path, path);
+	return(1);
+}
+
+static int server_send(int sock, int *fds, int nfds, const char *buf, size_t len) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(2 * sizeof(int))];
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+	return(sendmsg(sock, &msg, 0) == (ssize_t)len);
+}
+
+static ssize_t server_receive(int sock, int *fds, int nfds, char *buf, size_t len) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	ssize_t result;
+	int i, n = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	for (i = 0; i < nfds; i++)
+		fds[i] = -1;
+	result = recvmsg(sock, &msg, 0);
+	for (cmsg = CMSG_FIRSTHDR(&msg); result > 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), (n < nfds ? n : nfds) * sizeof(int));
+			for (i = nfds; i < n; i++)     // Extra descriptors are not welcome
+				close(((int *)CMSG_DATA(cmsg))[i]);
+		}
+	}
+	return(result);
+}
+
+// Runs a single request on the forked child and never returns
+static void server_child(int conn, int *fds, char *request) {
+	char *root = request;
+	char *cmdline = request + strlen(root) + 1;
+	uint8_t status = 0;
+
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
+	dup2(fds[0], STDIN_FILENO);
+	dup2(fds[1], STDOUT_FILENO);
+	close(fds[0]);
+	close(fds[1]);
+
+	if (*root && chdir(root)) {
+		pal_puts("Unable to select the drives folder.\r\n");
+		status = 1;
+	} else {
+#ifdef EMULATOR_CCP_EMULATED
+		if (*cmdline)
+			ccp_command(cmdline);
+#else
+		if (*cmdline) {
+			pal_puts("Command lines require the emulated CCP.\r\n");
+			status = 2;
+		}
+#endif
+		if (!status) {
+			pal_console_init();
+			cpm_loop();
+			pal_console_reset();
+		}
+	}
+	if (write(conn, &status, 1) != 1)
+		status = 3;
+	_exit(status);
+}
+
+// Serves requests on the Unix socket at path, the machine must be already initialized
+int server_fork_run(const char *path) {
+	struct sockaddr_un addr;
+	char request[SERVER_MAX_REQUEST + 2];
+	int fds[2];
+	int sock, conn;
+	ssize_t len;
+	pid_t pid;
+
+	if (!server_address(path, &addr)) {
+		pal_puts("Socket path is too long.\r\n");
+		return(1);
+	}
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path);
+	if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, 64)) {
+		pal_puts("Unable to listen on the server socket.\r\n");
+		return(1);
+	}
+	signal(SIGCHLD, SIG_IGN);   // Children are reaped automatically
+	signal(SIGPIPE, SIG_IGN);
+
+	while (1) {
+		conn = accept(sock, NULL, NULL);
+		if (conn < 0)
+			continue;
+		len = server_receive(conn, fds, 2, request, SERVER_MAX_REQUEST);
+		if (len > 0 && fds[0] >= 0 && fds[1] >= 0) {
+			request[len] = 0;       // Makes sure root and cmdline are terminated
+			request[len + 1] = 0;
+			fflush(stdout);
+			pid = fork();
+			if (pid == 0) {
+				close(sock);
+				server_child(conn, fds, request);
+			}
+			if (pid < 0)
+				pal_puts("Unable to fork a request.\r\n");
+		}
+		if (fds[0] >= 0)
+			close(fds[0]);
+		if (fds[1] >= 0)
+			close(fds[1]);
+		close(conn);
+	}
+	return(0);
+}
+
+// Sends the command line to the server at path, using the current folder as the drives root
+int server_fork_request(const char *path, const char *cmdline) {
+	struct sockaddr_un addr;
+	char request[SERVER_MAX_REQUEST];
+	int fds[2] = { STDIN_FILENO, STDOUT_FILENO };
+	size_t len;
+	uint8_t status;
+	int sock;
+
+	if (!server_address(path, &addr) || !getcwd(request, sizeof(request) - 1))
+		return(-1);
+	len = strlen(request) + 1;
+	if (len + strlen(cmdline) + 1 > sizeof(request))
+		return(-1);
+	strcpy(request + len, cmdline);
+	len += strlen(cmdline) + 1;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		if (sock >= 0)
+			close(sock);
+		return(-1);
+	}
+	if (!server_send(sock, fds, 2, request, len) || read(sock, &status, 1) != 1)
+		status = 0xff;
+	close(sock);
+	return(status == 0xff ? -1 : status);
+}
+
+#endif
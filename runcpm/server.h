@@ -0,0 +1,18 @@
+#ifndef _SERVER_H
+#define _SERVER_H
+
+#include <stdint.h>
+
+#define SERVER_MAX_REQUEST 1024	// Maximum size of a request (root folder + command line)
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+extern int server_fork_run(const char *path);
+extern int server_fork_request(const char *path, const char *cmdline);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,455 @@
+#include "defaults.h"
+
+#if defined(EMULATOR_OS_POSIX) && defined(EMULATOR_HAS_SESSIONS)
+
+#include "globals.h"
+#include "cpu.h"
+#include "cpm.h"
+#include "ram.h"
+#include "pal.h"
+#include "session.h"
+#ifdef EMULATOR_HAS_LUA
+#include "luah.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+	Session server
+
+	Hosts many interactive CP/M machines on a single process. Clients connect to
+	a Unix socket or a local TCP port and get a machine of their own, with the
+	CCP running on a thread of its own (the machine state is thread local, see
+	GLB_TLS). All the drive folders are shared.
+
+	The connections are served by a single epoll loop on the main thread, which
+	reads client input onto the session typeahead ring and writes out session
+	output the session thread could not write itself. Console output is buffered
+	and flushed with the same policy as the local console: when the guest asks
+	for input, when the buffer fills up or once EMULATOR_CON_FLUSH_MS have passed,
+	which is timed by the loop. A session waiting for input sleeps on its
+	condition variable, so idle sessions take no CPU at all.
+
+	Once the client is gone, console input ends every line and stops the
+	machine as the EXIT command does, so the CCP, the program and any RunCom
+	return, close their files and end their captures on the way out, and the
+	session is wound up at the end of session_main.
+
+	Every session runs on a thread of its own, not time sliced on a pool of
+	threads: the CCP and the BDOS calls run on the C stack, so a session cannot
+	be put aside in the middle of one.
+*/
+
+struct session {
+	int fd;
+	uint8_t closed;                         // Client is gone, nothing more to read or write
+	uint8_t done;                           // Session thread is finished, the loop frees the session
+	uint8_t stalled;                        // Input ring is full, client input is not read
+	uint8_t blocked;                        // Client is not taking output, the loop writes it when it can
+	uint8_t waiting;                        // Session thread waits for input or output room
+	uint32_t head, tail;                    // Input ring positions
+	uint16_t len;                           // Output buffer length
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct session *next;
+	uint8_t in[EMULATOR_CON_TYPEAHEAD];
+	uint8_t out[EMULATOR_CON_BUFFER];
+};
+
+#define SESSION_IN_MASK (EMULATOR_CON_TYPEAHEAD - 1)
+
+GLB_TLS session_t *session_self;
+
+static int session_sock = -1;
+static int session_epoll = -1;
+static int session_wake = -1;             // Wakes the loop when a flush gets due
+static uint8_t session_due;               // Some session has output waiting for the flush timer
+static session_t *session_list;
+static int session_count;
+
+/* Event loop side */
+
+static void session_arm(session_t *s) {
+	struct epoll_event ev;
+
+	if (s->fd < 0)
+		return;
+	ev.events = (s->stalled ? 0 : EPOLLIN) | (s->blocked ? EPOLLOUT : 0) | EPOLLRDHUP;
+	ev.data.ptr = s;
+	epoll_ctl(session_epoll, EPOLL_CTL_MOD, s->fd, &ev);
+}
+
+static void session_close_locked(session_t *s) {
+	if (s->fd >= 0) {
+		epoll_ctl(session_epoll, EPOLL_CTL_DEL, s->fd, NULL);
+		close(s->fd);
+		s->fd = -1;
+	}
+	s->closed = 1;
+	s->len = 0;                             // Nobody left to see it
+	if (s->waiting)
+		pthread_cond_signal(&s->cond);
+}
+
+// Writes out as much buffered output as the client takes without blocking
+static void session_write_locked(session_t *s) {
+	ssize_t n;
+	uint8_t blocked = s->blocked;
+
+	while (s->len && s->fd >= 0) {
+		n = send(s->fd, s->out, s->len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				session_close_locked(s);
+			break;
+		}
+		s->len -= n;
+		memmove(s->out, &s->out[n], s->len);
+	}
+	s->blocked = s->len != 0;
+	if (s->blocked != blocked)
+		session_arm(s);
+	if (!s->blocked && s->waiting)
+		pthread_cond_signal(&s->cond);
+}
+
+static void session_read_locked(session_t *s) {
+	uint32_t room, start;
+	ssize_t n;
+
+	while (s->fd >= 0) {
+		room = EMULATOR_CON_TYPEAHEAD - (s->head - s->tail);
+		if (!room) {
+			s->stalled = 1;                 // Picked up again once the guest catches up
+			session_arm(s);
+			break;
+		}
+		start = s->head & SESSION_IN_MASK;
+		if (room > EMULATOR_CON_TYPEAHEAD - start)
+			room = EMULATOR_CON_TYPEAHEAD - start;
+		n = recv(s->fd, &s->in[start], room, 0);
+		if (n > 0) {
+			s->head += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			session_close_locked(s);
+		break;
+	}
+	if (s->waiting && s->head != s->tail)
+		pthread_cond_signal(&s->cond);
+}
+
+static void session_event(session_t *s, uint32_t events) {
+	pthread_mutex_lock(&s->lock);
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		session_read_locked(s);
+	if (events & EPOLLOUT)
+		session_write_locked(s);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void session_flush_all(void) {
+	session_t *s;
+
+	__atomic_store_n(&session_due, 0, __ATOMIC_SEQ_CST);
+	for (s = session_list; s; s = s->next) {
+		pthread_mutex_lock(&s->lock);
+		if (!s->blocked)
+			session_write_locked(s);
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+static void session_reap(void) {
+	session_t **p = &session_list;
+	session_t *s;
+	uint8_t done;
+
+	while ((s = *p)) {
+		pthread_mutex_lock(&s->lock);
+		done = s->done;
+		pthread_mutex_unlock(&s->lock);
+		if (done) {
+			*p = s->next;
+			pthread_mutex_destroy(&s->lock);
+			pthread_cond_destroy(&s->cond);
+			free(s);
+			session_count--;
+		} else {
+			p = &s->next;
+		}
+	}
+}
+
+static void *session_main(void *arg);
+
+static void session_accept(int sock) {
+	static const char busy[] = "Too many sessions.\r\n";
+	struct epoll_event ev;
+	pthread_attr_t attr;
+	pthread_t thread;
+	session_t *s;
+	int fd, one = 1;
+
+	while ((fd = accept(sock, NULL, NULL)) >= 0) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));  // Fails harmlessly on Unix sockets
+		if (session_count >= SESSION_MAX || !(s = calloc(1, sizeof(session_t)))) {
+			send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL);
+			close(fd);
+			continue;
+		}
+		s->fd = fd;
+		pthread_mutex_init(&s->lock, NULL);
+		pthread_cond_init(&s->cond, NULL);
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = s;
+		epoll_ctl(session_epoll, EPOLL_CTL_ADD, fd, &ev);
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		pthread_attr_setstacksize(&attr, SESSION_STACK);
+		if (pthread_create(&thread, &attr, session_main, s)) {
+			session_close_locked(s);
+			s->done = 1;
+		}
+		pthread_attr_destroy(&attr);
+		s->next = session_list;
+		session_list = s;
+		session_count++;
+	}
+}
+
+// Listens on address, which is either a Unix socket path or a [host]:port TCP address (host defaults to localhost)
+static int session_listen(const char *address) {
+	struct sockaddr_un addr;
+	struct addrinfo hints, *res;
+	char host[256];
+	const char *port = strrchr(address, ':');
+	int sock, one = 1;
+
+	if (port && !strchr(address, '/')) {
+		if (port - address >= (int)sizeof(host))
+			return(-1);
+		memcpy(host, address, port - address);
+		host[port - address] = 0;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(host[0] ? host : "localhost", port + 1, &hints, &res))
+			return(-1);
+		sock = socket(res->ai_family, SOCK_STREAM, 0);
+		if (sock >= 0)
+			setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (sock >= 0 && bind(sock, res->ai_addr, res->ai_addrlen)) {
+			close(sock);
+			sock = -1;
+		}
+		freeaddrinfo(res);
+	} else {
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(address) >= sizeof(addr.sun_path))
+			return(-1);
+		strcpy(addr.sun_path, address);
+		unlink(address);
+		sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sock >= 0 && bind(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+			close(sock);
+			sock = -1;
+		}
+	}
+	if (sock >= 0 && listen(sock, 128)) {
+		close(sock);
+		sock = -1;
+	}
+	if (sock >= 0)
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	return(sock);
+}
+
+static int64_t session_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+// Runs the session server on address, never returns unless it fails to start
+int session_server_run(const char *address) {
+	struct epoll_event ev, events[64];
+	int64_t deadline = 0, now;
+	uint64_t count;
+	int n, i;
+
+	session_sock = session_listen(address);
+	session_epoll = epoll_create1(0);
+	session_wake = eventfd(0, EFD_NONBLOCK);
+	if (session_sock < 0 || session_epoll < 0 || session_wake < 0) {
+		pal_puts("Unable to listen on the session address.\r\n");
+		return(1);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	ev.events = EPOLLIN;
+	ev.data.ptr = &session_sock;
+	epoll_ctl(session_epoll, EPOLL_CTL_ADD, session_sock, &ev);
+	ev.data.ptr = &session_wake;
+	epoll_ctl(session_epoll, EPOLL_CTL_ADD, session_wake, &ev);
+
+	while (1) {
+		now = session_ms();
+		n = epoll_wait(session_epoll, events, 64, !deadline ? -1 : deadline > now ? (int)(deadline - now) : 0);
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &session_sock) {
+				session_accept(session_sock);
+			} else if (events[i].data.ptr == &session_wake) {
+				if (read(session_wake, &count, sizeof(count)) == sizeof(count) && !deadline)
+					deadline = session_ms() + EMULATOR_CON_FLUSH_MS;
+			} else {
+				session_event(events[i].data.ptr, events[i].events);
+			}
+		}
+		if (deadline && session_ms() >= deadline) {
+			session_flush_all();
+			deadline = 0;
+		}
+		session_reap();
+	}
+	return(0);
+}
+
+/* Session thread side */
+
+static void session_poke(void) {
+	uint64_t one = 1;
+	ssize_t n = write(session_wake, &one, sizeof(one));   // Only fails if the loop is already due to wake up
+
+	(void)n;
+}
+
+// Winds the session up once its machine has stopped, writing out what is left for the client
+static void session_end(void) {
+	session_t *s = session_self;
+	struct timeval tv = { 1, 0 };
+
+#ifdef EMULATOR_HAS_LUA
+	luah_close();	// The session's Lua state is its own
+#endif
+	pthread_mutex_lock(&s->lock);
+	if (s->fd >= 0 && s->len) {
+		epoll_ctl(session_epoll, EPOLL_CTL_DEL, s->fd, NULL);
+		fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) & ~O_NONBLOCK);
+		setsockopt(s->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		session_write_locked(s);
+	}
+	session_close_locked(s);
+	s->done = 1;
+	pthread_mutex_unlock(&s->lock);
+	session_poke();
+}
+
+static void *session_main(void *arg) {
+	session_self = arg;
+
+	ram_init();
+	cpm_banner();
+	cpm_loop();
+	session_end();
+	return(NULL);
+}
+
+void session_putbuf(const uint8_t *buf, uint16_t len) {
+	session_t *s = session_self;
+	uint16_t n;
+
+	pthread_mutex_lock(&s->lock);
+	while (len && !s->closed) {
+		n = sizeof(s->out) - s->len;
+		if (!n) {
+			if (!s->blocked)
+				session_write_locked(s);
+			if (s->blocked) {               // The loop signals once the client took some
+				s->waiting = 1;
+				pthread_cond_wait(&s->cond, &s->lock);
+				s->waiting = 0;
+			}
+			continue;
+		}
+		if (n > len)
+			n = len;
+		if (!s->len && !__atomic_exchange_n(&session_due, 1, __ATOMIC_SEQ_CST))
+			session_poke();                 // Starts the flush timer
+		memcpy(&s->out[s->len], buf, n);
+		s->len += n;
+		buf += n;
+		len -= n;
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+void session_flush(void) {
+	session_t *s = session_self;
+
+	pthread_mutex_lock(&s->lock);
+	if (!s->blocked)
+		session_write_locked(s);
+	pthread_mutex_unlock(&s->lock);
+}
+
+int session_kbhit(void) {
+	session_t *s = session_self;
+	int result;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->len && !s->blocked)              // Programs poll in a tight loop, only write when there is something
+		session_write_locked(s);
+	result = s->head != s->tail || s->closed;
+	pthread_mutex_unlock(&s->lock);
+	return(result);
+}
+
+uint8_t session_getch(void) {
+	session_t *s = session_self;
+	uint8_t ch;
+
+	session_flush();
+	pthread_mutex_lock(&s->lock);
+	while (s->head == s->tail && !s->closed) {
+		s->waiting = 1;
+		pthread_cond_wait(&s->cond, &s->lock);
+		s->waiting = 0;
+	}
+	if (s->head == s->tail) {               // Client went away: the machine stops as on EXIT, session_main ends the session
+		pthread_mutex_unlock(&s->lock);
+		cpu_status = 1;
+		return('\r');
+	}
+	ch = s->in[s->tail++ & SESSION_IN_MASK];
+	if (s->stalled) {
+		s->stalled = 0;
+		session_arm(s);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return(ch);
+}
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef _SESSION_H
+#define _SESSION_H
+
+#include <stdint.h>
+
+#include "globals.h"
+
+#define SESSION_STACK   (512 * 1024)	// Stack size of every session thread
+#define SESSION_MAX     1000	// Maximum number of concurrent sessions
+
+typedef struct session session_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+extern GLB_TLS session_t *session_self;	// Session run by the calling thread, NULL on the console
+extern int session_server_run(const char *address);
+extern void session_putbuf(const uint8_t *buf, uint16_t len);
+extern void session_flush(void);
+extern int session_kbhit(void);
+extern uint8_t session_getch(void);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
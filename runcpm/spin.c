@@ -0,0 +1,137 @@
+#include "defaults.h"
+
+#ifdef EMULATOR_SPIN
+
+#include "globals.h"
+#include "cpu.h"
+#include "ram.h"
+#include "trap.h"
+#include "spin.h"
+
+/*
+	Delay loops fast-forwarded
+
+	Software delays tuned for a 2-4 MHz Z80 spin here at host speed for no
+	work done. cpu.c calls spin_skip on every backward branch taken to at
+	most 3 bytes before it, and when the loop is one of these countdowns,
+	which only change their counter, A and the flags:
+	  DJNZ $
+	  DEC r; JR NZ or JP NZ back to the DEC (r one of B, C, D, E, H, L, A)
+	  DEC rr; LD A,r; OR r; JR NZ or JP NZ back to the DEC (rr one of
+	    BC, DE, HL, the LD and OR on its two halves)
+	its counter is taken down by the rounds it would have done, leaving the
+	last one to run. The rounds skipped still count as executed, so the
+	instruction count, and with it a replay (-r, -R), is the same as if they
+	had run.
+
+	Only the counter is set. A and the flags are left from the round just
+	done, and set again by the round after the skip before anything reads
+	them, which is why at least one round is always left to the interpreter,
+	inside the budget. Nested delays skip their inner loop every time round
+	the outer one.
+
+	A loop with a trap on it is left alone, and tracing (-i) runs one
+	instruction at a time, so never skips. How often each loop was skipped,
+	and the instructions saved, go in the run statistics (-j).
+*/
+
+#define SPIN_DJNZ 0
+#define SPIN_DEC  1
+#define SPIN_DEC16 2
+
+static const char *spin_names[] = { "DJNZ $", "DEC r; JR NZ", "DEC rr; LD A,r; OR r; JR NZ" };
+
+#define SPIN_LOOPS (sizeof(spin_names) / sizeof(spin_names[0]))
+
+static uint64_t spin_loops[SPIN_LOOPS];
+static uint64_t spin_instructions[SPIN_LOOPS];
+
+// The register pair holding 8 bit register r (in opcode order, 6 is (HL))
+static int32_t *spin_pair(uint8_t r) {
+	switch (r >> 1) {
+		case 0: return(&cpu_regs.bc);
+		case 1: return(&cpu_regs.de);
+		case 2: return(&cpu_regs.hl);
+	}
+	return(&cpu_regs.af);
+}
+
+/*
+	Called by cpu.c with the branch just taken at cpu_regs.pcx back to
+	cpu_regs.pc, returns how many instructions of budget it did
+*/
+uint32_t spin_skip(uint32_t budget) {
+	uint16_t head = cpu_regs.pc;
+	uint16_t branch = cpu_regs.pcx;
+	uint16_t address;
+	uint8_t op, load, test, loop, len;
+	uint32_t rounds, skip;
+	int32_t *reg;
+
+	op = ram_read(branch);
+	if (op == 0x10) {								// DJNZ
+		if (branch != head)
+			return(0);
+		loop = SPIN_DJNZ;
+		len = 1;
+		reg = &cpu_regs.bc;
+		rounds = CPU_REG_GET_HIGH(cpu_regs.bc);
+	} else {
+		if (op != 0x20 && op != 0xc2)				// JR NZ, JP NZ
+			return(0);
+		op = ram_read(head);
+		if (branch - head == 1 && (op & 0xc7) == 0x05 && op != 0x35) {	// DEC r
+			loop = SPIN_DEC;
+			len = 2;
+			reg = spin_pair((op >> 3) & 7);
+			rounds = (op & 0x08) && op != 0x3d ? CPU_REG_GET_LOW(*reg) : CPU_REG_GET_HIGH(*reg);
+		} else if (branch - head == 3 && (op & 0xcf) == 0x0b && op != 0x3b) {	// DEC rr
+			load = ram_read(head + 1);
+			test = ram_read(head + 2);
+			if ((load & 0xf8) != 0x78 || (test & 0xf8) != 0xb0 || (load & 7) >> 1 != op >> 4 || (test & 7) != ((load & 7) ^ 1))
+				return(0);
+			loop = SPIN_DEC16;
+			len = 4;
+			reg = spin_pair((op >> 4) << 1);
+			rounds = *reg & 0xffff;
+		} else {
+			return(0);
+		}
+	}
+	if (rounds < 2 || budget < 2 * len)
+		return(0);
+	for (address = head; address != (uint16_t)(branch + 1); address++) {
+		if (TRAP_HIT(address))
+			return(0);
+	}
+
+	skip = budget / len - 1;	// The round after the skip is run by the interpreter
+	if (skip > rounds - 1)
+		skip = rounds - 1;
+	switch (loop) {
+		case SPIN_DJNZ:
+			*reg -= skip << 8;
+			break;
+		case SPIN_DEC:
+			*reg -= (op & 0x08) && op != 0x3d ? skip : skip << 8;
+			break;
+		case SPIN_DEC16:
+			*reg -= skip;
+			break;
+	}
+	GLB_COUNT(spin_loops[loop], 1);
+	GLB_COUNT(spin_instructions[loop], skip * len);
+	return(skip * len);
+}
+
+// Tells the name of loop i, how often it was skipped and the instructions that saved, returns 0 past the last one
+uint8_t spin_count(uint16_t i, const char **name, uint64_t *loops, uint64_t *instructions) {
+	if (i >= SPIN_LOOPS)
+		return(0);
+	*name = spin_names[i];
+	*loops = spin_loops[i];
+	*instructions = spin_instructions[i];
+	return(1);
+}
+
+#endif
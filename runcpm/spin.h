@@ -0,0 +1,16 @@
+#ifndef _SPIN_H
+#define _SPIN_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+extern uint32_t spin_skip(uint32_t budget);
+extern uint8_t spin_count(uint16_t i, const char **name, uint64_t *loops, uint64_t *instructions);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,355 @@
+#include "defaults.h"
+
+#ifdef EMULATOR_OS_POSIX
+
+#include "globals.h"
+#include "cpu.h"
+#include "stats.h"
+#include "accel.h"
+#include "spin.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define STATS_CYCLES() __rdtsc()
+#endif
+
+/*
+	Run statistics
+
+	Counts what a run cost the host, for comparing builds against each other and
+	for telling whether a job is bound by the CPU emulation, by host file calls or
+	by waiting on the console. Instructions are the guest instructions executed
+	(cpu_icount), time is taken both from the wall clock and from the process CPU
+	usage, and host cycles come from the time stamp counter where there is one.
+	Instructions per second are over CPU time, which is much steadier than wall
+	time on a busy machine.
+
+	Host file calls are counted by the pal as it makes them, one per C library
+	call. As stdio buffers, the read and write system calls actually made are
+	taken from the kernel (/proc/self/io) instead, where it keeps them.
+
+	Once enabled, every BDOS and BIOS call is counted by function along with the
+	host time it took, as a total and as a histogram with a bucket per power of
+	two nanoseconds (the "histogram_ns" keys are the bucket lower bounds). Record
+	I/O is also counted per host file, for the first EMULATOR_STATS_FILES files
+	seen, with the rest added up under "(other)".
+
+	The statistics are written out as JSON by stats_dump, at exit when asked for,
+	and whenever the process gets SIGUSR1. The signal is taken by a thread of its
+	own, so a dump can be had from a job busy in the CPU emulation as well. It
+	reads the counters while they are being updated, so it can be a few calls off.
+	The call and file counters are kept for the whole process, and added to
+	atomically in a build with sessions (GLB_COUNT).
+*/
+
+#define STATS_BUCKETS 32	// 1ns up to 2s and over
+#define STATS_BIOS_CALLS 32
+#define STATS_NAME 32
+
+typedef struct {
+	uint64_t calls;
+	uint64_t ns;
+	uint64_t histogram[STATS_BUCKETS];
+} stats_call_t;
+
+typedef struct {
+	char name[STATS_NAME];
+	uint64_t opens, reads, writes, bytes_read, bytes_written;
+} stats_io_t;
+
+uint64_t stats_file_calls[STATS_FILE_CALLS];
+uint8_t stats_enabled = 0;
+
+static const char *stats_file_names[STATS_FILE_CALLS] = {
+	"file_opens", "file_closes", "file_seeks", "file_reads", "file_writes",
+	"file_removes", "file_renames", "file_stats", "file_truncates", "dir_scans"
+};
+
+static const char *stats_path;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_call_t stats_bdos[256];
+static stats_call_t stats_bios[STATS_BIOS_CALLS];
+static stats_io_t stats_files[EMULATOR_STATS_FILES + 1];	// The last one adds up the files past the table
+
+static struct {
+	struct timespec wall;
+	double cpu;
+	uint64_t icount;
+	uint64_t file_calls[STATS_FILE_CALLS];
+	int64_t syscr, syscw;
+#ifdef STATS_CYCLES
+	uint64_t cycles;
+#endif
+} stats_begin;
+
+uint64_t stats_clock(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+}
+
+// Counts a BDOS call or a BIOS call (by BIOS function number) started at start
+void stats_call(uint8_t kind, uint8_t function, uint64_t start) {
+	uint64_t ns = stats_clock() - start;
+	stats_call_t *call = kind == STATS_BDOS ? &stats_bdos[function] : &stats_bios[function % STATS_BIOS_CALLS];
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+	GLB_COUNT(call->calls, 1);
+	GLB_COUNT(call->ns, ns);
+	GLB_COUNT(call->histogram[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1], 1);
+}
+
+// Counts an open, or bytes read or written, on a host file
+void stats_io(uint8_t kind, const uint8_t *filename, uint16_t bytes) {
+	uint32_t hash = 2166136261u;
+	const uint8_t *c;
+	stats_io_t *io = &stats_files[EMULATOR_STATS_FILES];
+	int i, slot;
+
+	for (c = filename; *c; c++)
+		hash = (hash ^ *c) * 16777619u;
+	pthread_mutex_lock(&stats_lock);	// Sessions may take the same free slot at once
+	for (i = 0; i < EMULATOR_STATS_FILES; i++) {
+		slot = (hash + i) & (EMULATOR_STATS_FILES - 1);
+		if (!stats_files[slot].name[0]) {
+			strncpy(stats_files[slot].name, (const char*)filename, STATS_NAME - 1);
+			io = &stats_files[slot];
+			break;
+		}
+		if (!strncmp(stats_files[slot].name, (const char*)filename, STATS_NAME - 1)) {
+			io = &stats_files[slot];
+			break;
+		}
+	}
+	switch (kind) {
+	case STATS_IO_OPEN:
+		io->opens++; break;
+	case STATS_IO_READ:
+		io->reads++; io->bytes_read += bytes; break;
+	case STATS_IO_WRITE:
+		io->writes++; io->bytes_written += bytes; break;
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static double stats_cpu_seconds(void) {
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6);
+}
+
+// Read and write system calls made so far, -1 where the kernel does not tell
+static void stats_syscalls(int64_t *syscr, int64_t *syscw) {
+	char line[64];
+	long long n;
+	FILE *file = fopen("/proc/self/io", "r");
+
+	*syscr = *syscw = -1;
+	if (!file)
+		return;
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "syscr: %lld", &n) == 1)
+			*syscr = n;
+		else if (sscanf(line, "syscw: %lld", &n) == 1)
+			*syscw = n;
+	}
+	fclose(file);
+}
+
+static void stats_count(FILE *file, const char *name, int64_t count) {
+	if (count < 0)
+		fprintf(file, "\t\"%s\": null,\n", name);
+	else
+		fprintf(file, "\t\"%s\": %lld,\n", name, (long long)count);
+}
+
+static double stats_seconds(stats_call_t *calls, int n) {
+	uint64_t ns = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		ns += calls[i].ns;
+	return(ns / 1e9);
+}
+
+static void stats_calls(FILE *file, const char *name, stats_call_t *calls, int n) {
+	const char *sep = "";
+	int i, b;
+
+	fprintf(file, "\t\"%s\": [", name);
+	for (i = 0; i < n; i++) {
+		if (!calls[i].calls)
+			continue;
+		fprintf(file, "%s\n\t\t{\"function\": %d, \"calls\": %llu, \"seconds\": %.6f, \"histogram_ns\": {",
+			sep, i, (unsigned long long)calls[i].calls, calls[i].ns / 1e9);
+		sep = "";
+		for (b = 0; b < STATS_BUCKETS; b++) {
+			if (calls[i].histogram[b]) {
+				fprintf(file, "%s\"%llu\": %llu", sep, 1ULL << b, (unsigned long long)calls[i].histogram[b]);
+				sep = ", ";
+			}
+		}
+		fprintf(file, "}}");
+		sep = ",";
+	}
+	fprintf(file, "\n\t],\n");
+}
+
+static void stats_ios(FILE *file) {
+	const char *sep = "";
+	stats_io_t *io;
+	int i;
+
+	fprintf(file, "\t\"files\": [");
+	for (i = 0; i <= EMULATOR_STATS_FILES; i++) {
+		io = &stats_files[i];
+		if (!io->opens && !io->reads && !io->writes)
+			continue;
+		fprintf(file, "%s\n\t\t{\"name\": \"%s\", \"opens\": %llu, \"records_read\": %llu, \"records_written\": %llu, "
+			"\"bytes_read\": %llu, \"bytes_written\": %llu}", sep, i < EMULATOR_STATS_FILES ? io->name : "(other)",
+			(unsigned long long)io->opens, (unsigned long long)io->reads, (unsigned long long)io->writes,
+			(unsigned long long)io->bytes_read, (unsigned long long)io->bytes_written);
+		sep = ",";
+	}
+	fprintf(file, "\n\t]\n");
+}
+
+#ifdef EMULATOR_ACCEL
+static void stats_accel(FILE *file) {
+	const char *sep = "";
+	const char *name;
+	uint64_t installs, calls;
+	uint16_t i;
+
+	fprintf(file, "\t\"accelerated\": [");
+	for (i = 0; accel_count(i, &name, &installs, &calls); i++) {
+		if (!installs)
+			continue;
+		fprintf(file, "%s\n\t\t{\"routine\": \"%s\", \"installs\": %llu, \"calls\": %llu}", sep, name,
+			(unsigned long long)installs, (unsigned long long)calls);
+		sep = ",";
+	}
+	fprintf(file, "\n\t],\n");
+}
+#endif
+
+#ifdef EMULATOR_SPIN
+static void stats_spin(FILE *file) {
+	const char *sep = "";
+	const char *name;
+	uint64_t loops, instructions;
+	uint16_t i;
+
+	fprintf(file, "\t\"fast_forwarded\": [");
+	for (i = 0; spin_count(i, &name, &loops, &instructions); i++) {
+		if (!loops)
+			continue;
+		fprintf(file, "%s\n\t\t{\"loop\": \"%s\", \"loops\": %llu, \"instructions\": %llu}", sep, name,
+			(unsigned long long)loops, (unsigned long long)instructions);
+		sep = ",";
+	}
+	fprintf(file, "\n\t],\n");
+}
+#endif
+
+static void *stats_signal_main(void *arg) {
+	sigset_t *set = (sigset_t*)arg;
+	int sig;
+
+	while (!sigwait(set, &sig))
+		stats_dump();
+	return(NULL);
+}
+
+// Starts counting, path is where the statistics go (NULL for EMULATOR_STATS_PATH)
+// Must be called before any other thread is started, so they all leave SIGUSR1 alone
+void stats_init(const char *path) {
+	static sigset_t set;
+	pthread_t thread;
+
+	stats_path = path ? path : EMULATOR_STATS_PATH;
+	clock_gettime(CLOCK_MONOTONIC, &stats_begin.wall);
+	stats_begin.cpu = stats_cpu_seconds();
+	stats_begin.icount = cpu_icount;
+	memcpy(stats_begin.file_calls, stats_file_calls, sizeof(stats_file_calls));
+	stats_syscalls(&stats_begin.syscr, &stats_begin.syscw);
+#ifdef STATS_CYCLES
+	stats_begin.cycles = STATS_CYCLES();
+#endif
+	stats_enabled = 1;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	if (!pthread_sigmask(SIG_BLOCK, &set, NULL) && !pthread_create(&thread, NULL, stats_signal_main, &set))
+		pthread_detach(thread);
+}
+
+// Writes what the run cost so far, returns 0 on success
+uint8_t stats_dump(void) {
+	struct timespec now;
+	uint64_t icount = cpu_icount - stats_begin.icount;
+	double wall, cpu;
+	int64_t syscr, syscw;
+	char temp[FILENAME_MAX];
+	FILE *file;
+	int i;
+
+#ifdef STATS_CYCLES
+	uint64_t cycles = STATS_CYCLES() - stats_begin.cycles;
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wall = (now.tv_sec - stats_begin.wall.tv_sec) + (now.tv_nsec - stats_begin.wall.tv_nsec) / 1e9;
+	cpu = stats_cpu_seconds() - stats_begin.cpu;
+	stats_syscalls(&syscr, &syscw);
+
+	pthread_mutex_lock(&stats_lock);
+	snprintf(temp, sizeof(temp), "%s.tmp", stats_path);	// Whoever reads the file never sees half of it
+	file = fopen(temp, "w");
+	if (!file) {
+		pthread_mutex_unlock(&stats_lock);
+		return(1);
+	}
+	fprintf(file, "{\n");
+	fprintf(file, "\t\"instructions\": %llu,\n", (unsigned long long)icount);
+	fprintf(file, "\t\"wall_seconds\": %.6f,\n", wall);
+	fprintf(file, "\t\"cpu_seconds\": %.6f,\n", cpu);
+	fprintf(file, "\t\"instructions_per_second\": %.0f,\n", cpu > 0 ? icount / cpu : 0);
+	fprintf(file, "\t\"bdos_seconds\": %.6f,\n", stats_seconds(stats_bdos, 256));
+	fprintf(file, "\t\"bios_seconds\": %.6f,\n", stats_seconds(stats_bios, STATS_BIOS_CALLS));
+	fprintf(file, "\t\"console_input_seconds\": %.6f,\n", (stats_bdos[1].ns + stats_bdos[10].ns + stats_bios[3].ns) / 1e9);
+	for (i = 0; i < STATS_FILE_CALLS; i++)
+		stats_count(file, stats_file_names[i], stats_file_calls[i] - stats_begin.file_calls[i]);
+	stats_count(file, "read_syscalls", syscr < 0 || stats_begin.syscr < 0 ? -1 : syscr - stats_begin.syscr);
+	stats_count(file, "write_syscalls", syscw < 0 || stats_begin.syscw < 0 ? -1 : syscw - stats_begin.syscw);
+#ifdef STATS_CYCLES
+	fprintf(file, "\t\"host_cycles\": %llu,\n", (unsigned long long)cycles);
+	fprintf(file, "\t\"cycles_per_instruction\": %.3f,\n", icount ? (double)cycles / icount : 0);
+#else
+	fprintf(file, "\t\"host_cycles\": null,\n");
+	fprintf(file, "\t\"cycles_per_instruction\": null,\n");
+#endif
+	stats_calls(file, "bdos", stats_bdos, 256);
+	stats_calls(file, "bios", stats_bios, STATS_BIOS_CALLS);
+#ifdef EMULATOR_ACCEL
+	stats_accel(file);
+#endif
+#ifdef EMULATOR_SPIN
+	stats_spin(file);
+#endif
+	stats_ios(file);
+	fprintf(file, "}\n");
+	i = fclose(file) || rename(temp, stats_path);
+	pthread_mutex_unlock(&stats_lock);
+	return(i ? 1 : 0);
+}
+
+#endif
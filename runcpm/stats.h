@@ -0,0 +1,44 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+
+#include "globals.h"
+
+// Host file calls made by the pal, by kind
+enum {
+	STATS_FILE_OPEN, STATS_FILE_CLOSE, STATS_FILE_SEEK, STATS_FILE_READ, STATS_FILE_WRITE,
+	STATS_FILE_REMOVE, STATS_FILE_RENAME, STATS_FILE_STAT, STATS_FILE_TRUNCATE, STATS_FILE_SCAN,
+	STATS_FILE_CALLS
+};
+
+#define STATS_FILE(call) GLB_COUNT(stats_file_calls[call], 1)
+
+#define STATS_BDOS 0
+#define STATS_BIOS 1
+
+#define STATS_IO_OPEN  0
+#define STATS_IO_READ  1
+#define STATS_IO_WRITE 2
+
+// Timing of a BDOS or BIOS call, only taken while the statistics are enabled
+#define STATS_CALL_BEGIN(start) do { if (stats_enabled) start = stats_clock(); } while (0)
+#define STATS_CALL_END(kind, function, start) do { if (stats_enabled) stats_call(kind, function, start); } while (0)
+#define STATS_IO(kind, filename, bytes) do { if (stats_enabled) stats_io(kind, filename, bytes); } while (0)
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+extern uint64_t stats_file_calls[STATS_FILE_CALLS];
+extern uint8_t stats_enabled;
+extern uint64_t stats_clock(void);
+extern void stats_call(uint8_t kind, uint8_t function, uint64_t start);
+extern void stats_io(uint8_t kind, const uint8_t *filename, uint16_t bytes);
+extern void stats_init(const char *path);
+extern uint8_t stats_dump(void);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,204 @@
+#include "defaults.h"
+
+#ifdef EMULATOR_OS_POSIX
+
+#include "globals.h"
+#include "cpu.h"
+#include "ram.h"
+#include "trace.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+	BDOS and BIOS call tracing
+
+	Unlike DEBUG_LOG, which has to be compiled in and formats every call as text
+	straight into a file, tracing is switched on and off while RunCPM runs: from
+	the start with -x, by sending the process SIGUSR2, or by the guest with BDOS
+	call 249. Each call is kept as a small binary record (trace_record_t) with
+	its time, registers, FCB name and result, put into a ring buffer that a
+	writer thread empties into the trace file in batches. The emulation never
+	waits for the file: when the writer falls behind and the ring is full, calls
+	are counted as dropped and the count is written to the trace in their place.
+
+	The ring has a single producer, the emulation thread, and a single consumer,
+	the writer, so it needs no lock, only the head and tail indexes published to
+	each other in the right order. Tracing is only available to the console
+	machine; the session server runs its machines in threads of their own.
+
+	tools/trace2json.c turns the trace into Chrome trace event JSON, for
+	chrome://tracing or Perfetto.
+*/
+
+#define TRACE_MASK (EMULATOR_TRACE_RECORDS - 1)
+
+uint8_t trace_enabled = 0;
+
+static const char *trace_path;
+static uint8_t trace_available = 0;
+static FILE *trace_file;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;	// Held while writing to the trace file
+static trace_record_t trace_ring[EMULATOR_TRACE_RECORDS];
+static uint32_t trace_head = 0;		// Written by the emulation only
+static uint32_t trace_tail = 0;		// Written by the writer only
+static uint32_t trace_dropped = 0;	// Written by the emulation only
+static uint32_t trace_dropped_written = 0;
+
+// BDOS functions taking an FCB at DE, by bit
+static const uint64_t trace_fcb_calls =
+	1ULL << 15 | 1ULL << 16 | 1ULL << 17 | 1ULL << 19 | 1ULL << 20 | 1ULL << 21 | 1ULL << 22 | 1ULL << 23 |
+	1ULL << 30 | 1ULL << 33 | 1ULL << 34 | 1ULL << 35 | 1ULL << 36 | 1ULL << 40;
+
+static uint64_t trace_clock(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+}
+
+void trace_begin(trace_record_t *record, uint8_t kind, uint8_t function) {
+	int i;
+
+	record->ns = trace_clock();
+	record->ret = ram_read16(cpu_regs.sp);
+	record->kind = kind;
+	record->function = function;
+	record->af = cpu_regs.af;
+	record->bc = cpu_regs.bc;
+	record->de = cpu_regs.de;
+	record->hl = cpu_regs.hl;
+	if (kind == TRACE_BDOS && function < 64 && (trace_fcb_calls >> function & 1)) {
+		record->kind |= TRACE_FCB;
+		for (i = 0; i < 12; i++)
+			record->fcb[i] = ram_read(cpu_regs.de + i) & (i ? 0x7f : 0xff);	// Without the attribute bits
+	}
+}
+
+void trace_end(trace_record_t *record) {
+	uint32_t head = trace_head;
+
+	record->duration = trace_clock() - record->ns;
+	record->af_out = cpu_regs.af;
+	record->hl_out = cpu_regs.hl;
+	if (head - __atomic_load_n(&trace_tail, __ATOMIC_ACQUIRE) > TRACE_MASK) {
+		trace_dropped++;
+		return;
+	}
+	trace_ring[head & TRACE_MASK] = *record;
+	__atomic_store_n(&trace_head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Writes out whatever is in the ring, returns the number of records written
+static uint32_t trace_drain(void) {
+	uint32_t head, tail, first, dropped;
+	trace_record_t lost;
+
+	pthread_mutex_lock(&trace_lock);
+	head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+	tail = trace_tail;
+	if (head != tail) {
+		first = EMULATOR_TRACE_RECORDS - (tail & TRACE_MASK);
+		if (first > head - tail)
+			first = head - tail;
+		fwrite(&trace_ring[tail & TRACE_MASK], sizeof(trace_record_t), first, trace_file);
+		fwrite(trace_ring, sizeof(trace_record_t), head - tail - first, trace_file);
+		__atomic_store_n(&trace_tail, head, __ATOMIC_RELEASE);
+	}
+	dropped = __atomic_load_n(&trace_dropped, __ATOMIC_RELAXED);
+	if (dropped != trace_dropped_written) {
+		memset(&lost, 0, sizeof(lost));
+		lost.ns = trace_clock();
+		lost.kind = TRACE_DROPPED;
+		lost.duration = dropped - trace_dropped_written;
+		fwrite(&lost, sizeof(lost), 1, trace_file);
+		trace_dropped_written = dropped;
+	}
+	if (head == tail)
+		fflush(trace_file);
+	pthread_mutex_unlock(&trace_lock);
+	return(head - tail);
+}
+
+static void *trace_writer_main(void *arg) {
+	struct timespec pause = { 0, EMULATOR_TRACE_DRAIN_MS * 1000000L };
+
+	for (;;) {
+		if (!trace_drain())
+			nanosleep(&pause, NULL);
+	}
+	return(NULL);
+}
+
+static void *trace_signal_main(void *arg) {
+	sigset_t *set = (sigset_t*)arg;
+	int sig;
+
+	while (!sigwait(set, &sig))
+		trace_set(!trace_enabled);
+	return(NULL);
+}
+
+// Starts a thread with every signal blocked, so signals only reach the threads waiting for them
+static void trace_thread(void *(*main)(void*), void *arg) {
+	sigset_t all, old;
+	pthread_t thread;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	if (!pthread_create(&thread, NULL, main, arg))
+		pthread_detach(thread);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// Makes tracing available, path is where the trace goes (NULL for EMULATOR_TRACE_PATH, tracing off)
+// Must be called before any other thread is started, so they all leave SIGUSR2 alone
+void trace_init(const char *path) {
+	static sigset_t set;
+
+	trace_path = path ? path : EMULATOR_TRACE_PATH;
+	trace_available = 1;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR2);
+	if (!pthread_sigmask(SIG_BLOCK, &set, NULL))
+		trace_thread(trace_signal_main, &set);
+	if (path)
+		trace_set(1);
+}
+
+// Switches tracing on or off, returns whether it was on, or 0xFF when it can not be switched on
+uint8_t trace_set(uint8_t enable) {
+	uint8_t was = trace_enabled;
+
+	if (!trace_available)
+		return(0xFF);
+	pthread_mutex_lock(&trace_lock);
+	if (enable && !trace_file) {	// The file is created the first time, and kept open from then on
+		trace_file = fopen(trace_path, "wb");
+		if (!trace_file || fwrite(TRACE_MAGIC, 1, 8, trace_file) != 8) {
+			if (trace_file)
+				fclose(trace_file);
+			trace_file = NULL;
+			pthread_mutex_unlock(&trace_lock);
+			return(0xFF);
+		}
+		trace_thread(trace_writer_main, NULL);
+	}
+	trace_enabled = enable ? 1 : 0;
+	pthread_mutex_unlock(&trace_lock);
+	return(was);
+}
+
+// Writes out everything traced so far, for when RunCPM ends
+void trace_flush(void) {
+	if (!trace_file)
+		return;
+	trace_enabled = 0;
+	while (trace_drain())
+		;
+}
+
+#endif
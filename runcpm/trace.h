@@ -0,0 +1,46 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+/*
+	Trace file format: TRACE_MAGIC followed by trace_record_t records, in the
+	byte order of the host that wrote them. tools/trace2json.c reads it.
+*/
+#define TRACE_MAGIC "RCPMTRC2"
+
+#define TRACE_BDOS    0
+#define TRACE_BIOS    1
+#define TRACE_DROPPED 2	// Calls lost because the buffer was full, the count is in duration
+#define TRACE_FCB     0x80	// Set in kind when fcb holds the drive and name from the FCB at DE
+
+typedef struct {
+	uint64_t ns;		// Host monotonic clock at the call
+	uint64_t duration;	// Nanoseconds spent in the call
+	uint16_t ret;		// Address the call returns to
+	uint8_t kind;
+	uint8_t function;	// BDOS function, or BIOS function number (offset / 3)
+	uint16_t af, bc, de, hl;	// Registers on entry
+	uint16_t af_out, hl_out;	// Registers on return
+	uint8_t fcb[12];
+} trace_record_t;
+
+// Tracing of a BDOS or BIOS call, record must be zeroed beforehand
+#define TRACE_CALL_BEGIN(record, kind, function) do { if (trace_enabled) trace_begin(&record, kind, function); } while (0)
+#define TRACE_CALL_END(record) do { if (record.ns) trace_end(&record); } while (0)
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+extern uint8_t trace_enabled;
+extern void trace_begin(trace_record_t *record, uint8_t kind, uint8_t function);
+extern void trace_end(trace_record_t *record);
+extern void trace_init(const char *path);
+extern uint8_t trace_set(uint8_t enable);
+extern void trace_flush(void);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,123 @@
+#include "defaults.h"
+#include "globals.h"
+#include "cpu.h"
+#include "ram.h"
+#include "trap.h"
+
+#ifdef EMULATOR_OS_POSIX
+#include "verify.h"
+#endif
+
+#include <string.h>
+
+/*
+	Traps on guest addresses
+
+	A trap hands a guest routine (a multiply or a floating point helper in a
+	compiler's runtime, a block move) to a host handler, a C function or a Lua
+	one set with SetTrap (luah.c), which does the work natively. cpu_exec
+	tests every PC against a bitmap of the 64K addresses, and only after
+	trap_count, so it pays next to nothing while no trap is set. A trap
+	taken counts as one instruction, and finds its handler with one lookup
+	in trap_slot (a search of the table on Arduino, short of RAM).
+
+	Handlers act on the world outside the guest (files, Lua state), so one
+	must run once per trap taken: an engine verified (-V) stops where it
+	gets to a trap, like it does at a port, and the reference takes it.
+
+	Traps belong to the program they were set for: they are all cleared when
+	a program run by the emulated CCP (or RunCom) ends, and on every warm
+	boot, so the next program never runs into handlers meant for another.
+*/
+
+typedef struct {
+	uint16_t address;
+	trap_handler_t handler;
+	void *data;
+} trap_t;
+
+GLB_TLS uint16_t trap_count = 0;
+GLB_TLS uint8_t trap_map[8192];
+
+static GLB_TLS trap_t trap_table[EMULATOR_TRAPS];
+#ifndef EMULATOR_OS_ARDUINO
+static GLB_TLS uint8_t trap_slot[65536];	// 1 + where in trap_table the trap at each address is, 0 for none
+#endif
+
+static trap_t *trap_find(uint16_t address) {
+#ifdef EMULATOR_OS_ARDUINO
+	uint16_t i;
+
+	for (i = 0; i < trap_count; i++) {
+		if (trap_table[i].address == address)
+			return(&trap_table[i]);
+	}
+	return(NULL);
+#else
+	return(trap_slot[address] ? &trap_table[trap_slot[address] - 1] : NULL);
+#endif
+}
+
+// Sets (or replaces) the trap at address, returns 1 if the table is full
+uint8_t trap_set(uint16_t address, trap_handler_t handler, void *data) {
+	trap_t *t = trap_find(address);
+
+	if (!t) {
+		if (trap_count == EMULATOR_TRAPS)
+			return(1);
+		t = &trap_table[trap_count++];
+		t->address = address;
+		trap_map[address >> 3] |= 1 << (address & 7);
+#ifndef EMULATOR_OS_ARDUINO
+		trap_slot[address] = trap_count;
+#endif
+	}
+	t->handler = handler;
+	t->data = data;
+	return(0);
+}
+
+void trap_clear(uint16_t address) {
+	trap_t *t = trap_find(address);
+
+	if (t) {
+		*t = trap_table[--trap_count];	// The last one takes its place
+		trap_map[address >> 3] &= ~(1 << (address & 7));
+#ifndef EMULATOR_OS_ARDUINO
+		trap_slot[t->address] = (uint8_t)(t - trap_table) + 1;
+		trap_slot[address] = 0;
+#endif
+	}
+}
+
+void trap_clear_all(void) {
+	if (trap_count) {
+#ifndef EMULATOR_OS_ARDUINO
+		while (trap_count)
+			trap_slot[trap_table[--trap_count].address] = 0;
+#endif
+		trap_count = 0;
+		memset(trap_map, 0, sizeof(trap_map));
+	}
+}
+
+// Runs the trap at address, returns 1 if it did the routine and its RET, 0 to run the guest code
+uint8_t trap_run(uint16_t address) {
+	trap_t *t = trap_find(address);
+	uint8_t result;
+
+	if (!t)
+		return(0);
+#ifdef EMULATOR_OS_POSIX
+	if (verify_shadow) {
+		verify_port();	// Only the reference engine gets to run the handler
+		return(0);
+	}
+#endif
+	result = t->handler(address, t->data);
+	if (result != TRAP_RET)
+		return(0);
+	cpu_regs.pc = ram_read16(CPU_WORD16(cpu_regs.sp));
+	cpu_regs.sp = CPU_WORD16(cpu_regs.sp + 2);
+	return(1);
+}
@@ -0,0 +1,39 @@
+#ifndef _TRAP_H
+#define _TRAP_H
+
+#include <stdint.h>
+
+#include "globals.h"
+
+/*
+	A trap handler runs in place of the guest routine at its address, on
+	cpu_regs and RAM, and returns TRAP_RET to have the routine's RET done for
+	it, or TRAP_PASS to have the guest code at the address run after all.
+*/
+typedef uint8_t (*trap_handler_t)(uint16_t address, void *data);
+
+#define TRAP_RET  0
+#define TRAP_PASS 1
+
+// Whether a trap is set at address, one test of trap_count while there are none, laid out as the unlikely case
+#ifdef __GNUC__
+#define TRAP_HIT(address) __builtin_expect(trap_count && (trap_map[((address) & 0xffff) >> 3] & (1 << ((address) & 7))), 0)
+#else
+#define TRAP_HIT(address) (trap_count && (trap_map[((address) & 0xffff) >> 3] & (1 << ((address) & 7))))
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+extern GLB_TLS uint16_t trap_count;
+extern GLB_TLS uint8_t trap_map[8192];
+extern uint8_t trap_set(uint16_t address, trap_handler_t handler, void *data);
+extern void trap_clear(uint16_t address);
+extern void trap_clear_all(void);
+extern uint8_t trap_run(uint16_t address);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,401 @@
+#include "defaults.h"
+
+#ifdef EMULATOR_OS_POSIX
+
+#include "globals.h"
+#include "cpu.h"
+#include "ram.h"
+#include "pal.h"
+#include "verify.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+	Lockstep verification of CPU engines
+
+	Faster ways of running guest code (threaded dispatch, lazy flags, block
+	caches, translation) are easy to get subtly wrong, in a flag or an edge case
+	that only some program ever hits. With -V engine every block of instructions
+	is run twice from the same cpu_regs and RAM: first by that engine, whose
+	register and memory results are put aside and undone, then by the reference
+	switch core in cpu.c, whose results stay. The two are compared, all the
+	registers including F, the memory each one wrote, the instructions run and
+	how the run ended, and RunCPM stops at the first difference with a report of
+	it. A block that differs is stepped through again one instruction at a time,
+	to point at the instruction to blame when there is one.
+
+	Only the reference reaches the BDOS and BIOS: an engine that gets to a port
+	access is stopped, and its block verified up to the instruction before.
+
+	With -z the same comparison is made on random programs in random memory
+	with random registers instead of a CP/M run, until the first difference.
+	Verification is only available to the console machine.
+*/
+
+#define VERIFY_PORT   0x10	// verify_span result: the next instruction calls the BDOS or BIOS
+#define VERIFY_DIFFS  16	// Memory differences reported
+
+typedef struct {
+	uint16_t address;
+	uint8_t old;
+} verify_write_t;
+
+typedef struct {
+	cpu_regs_t regs;
+	int32_t status;
+	uint64_t icount;
+} verify_state_t;
+
+static const struct {
+	const char *name;
+	size_t offset;
+} verify_regs[] = {
+	{ "AF", offsetof(cpu_regs_t, af) }, { "BC", offsetof(cpu_regs_t, bc) }, { "DE", offsetof(cpu_regs_t, de) },
+	{ "HL", offsetof(cpu_regs_t, hl) }, { "IX", offsetof(cpu_regs_t, ix) }, { "IY", offsetof(cpu_regs_t, iy) },
+	{ "SP", offsetof(cpu_regs_t, sp) }, { "PC", offsetof(cpu_regs_t, pc) }, { "AF'", offsetof(cpu_regs_t, af1) },
+	{ "BC'", offsetof(cpu_regs_t, bc1) }, { "DE'", offsetof(cpu_regs_t, de1) }, { "HL'", offsetof(cpu_regs_t, hl1) },
+	{ "IFF", offsetof(cpu_regs_t, iff) }, { "IR", offsetof(cpu_regs_t, ir) }
+};
+
+#define VERIFY_REGS (sizeof(verify_regs) / sizeof(verify_regs[0]))
+#define VERIFY_REG(regs, i) CPU_WORD16(*(const int32_t*)((const char*)(regs) + verify_regs[i].offset))
+
+uint8_t verify_enabled = 0;
+uint8_t verify_logging = 0;	// Set while writes go to verify_log
+uint8_t verify_shadow = 0;	// Set while the engine under verification runs
+uint8_t verify_failed = 0;
+
+static const cpu_engine_t *verify_engine;
+static uint32_t verify_block = 1;
+static verify_write_t *verify_log;
+static verify_write_t *verify_engine_log;
+static verify_write_t *verify_reference_log;
+static uint32_t verify_writes;
+static uint32_t verify_room;
+static uint8_t verify_overflow;
+static uint8_t verify_port_hit;
+
+static uint32_t verify_stamp = 0;
+static uint32_t verify_marks[65536];	// Addresses in verify_values, when equal to verify_stamp
+static uint8_t verify_values[65536];	// Memory as the engine left it, where either engine wrote
+static struct {
+	uint16_t address;
+	uint8_t value;		// As the engine left it
+} verify_diffs[VERIFY_DIFFS];
+static uint32_t verify_diff_count;
+
+static uint64_t verify_random_state;
+
+void verify_write(uint32_t address) {
+	if (verify_writes == verify_room) {
+		verify_overflow = 1;
+		return;
+	}
+	verify_log[verify_writes].address = address & 0xffff;
+	verify_log[verify_writes].old = ram_read(address & 0xffff);
+	verify_writes++;
+}
+
+// The engine under verification got to a port access, it stops before the BDOS or BIOS is called
+void verify_port(void) {
+	verify_port_hit = 1;
+	cpu_status = CPU_STATUS_INPUT;
+}
+
+static void verify_save(verify_state_t *state) {
+	state->regs = cpu_regs;
+	state->status = cpu_status;
+	state->icount = cpu_icount;
+}
+
+static void verify_restore(const verify_state_t *state) {
+	cpu_regs = state->regs;
+	cpu_status = state->status;
+	cpu_icount = state->icount;
+}
+
+static void verify_undo(const verify_write_t *log, uint32_t writes) {
+	while (writes--)
+		ram_write(log[writes].address, log[writes].old);
+}
+
+static uint8_t verify_reference(uint32_t budget) {
+	uint8_t result;
+
+	verify_log = verify_reference_log;
+	verify_writes = 0;
+	verify_logging = 1;
+	result = cpu_engines[0].run(budget);
+	verify_logging = 0;
+	return(result);
+}
+
+// Compares memory where either engine wrote, the engine's view is in verify_values
+static void verify_memory(uint32_t engine_writes) {
+	const verify_write_t *log;
+	uint32_t writes, i;
+	uint16_t address;
+
+	verify_diff_count = 0;
+	for (log = verify_engine_log, writes = engine_writes; log; log = log == verify_engine_log ? verify_reference_log : NULL) {
+		if (log == verify_reference_log)
+			writes = verify_writes;
+		for (i = 0; i < writes; i++) {
+			address = log[i].address;
+			if (verify_marks[address] != verify_stamp) {	// Only the reference wrote here, the engine left what was there
+				verify_marks[address] = verify_stamp;
+				verify_values[address] = log[i].old;
+			}
+			if (verify_values[address] != ram_read(address)) {
+				if (verify_diff_count < VERIFY_DIFFS) {
+					verify_diffs[verify_diff_count].address = address;
+					verify_diffs[verify_diff_count].value = verify_values[address];
+				}
+				verify_diff_count++;
+				verify_values[address] = ram_read(address);	// Reported once
+			}
+		}
+	}
+}
+
+// Compares the registers, as the 16 bits each one holds
+static uint8_t verify_regs_differ(const cpu_regs_t *a, const cpu_regs_t *b) {
+	uint32_t i;
+
+	for (i = 0; i < VERIFY_REGS; i++)
+		if (VERIFY_REG(a, i) != VERIFY_REG(b, i))
+			return(1);
+	return(0);
+}
+
+static void verify_flags(char *text, uint8_t f) {
+	const char *names = "SZ5H3PNC";
+	int i;
+
+	for (i = 0; i < 8; i++)
+		text[i] = f & (0x80 >> i) ? names[i] : '.';
+	text[8] = 0;
+}
+
+static void verify_report(const verify_state_t *start, const verify_state_t *engine, uint8_t engine_result, uint8_t result, uint32_t budget) {
+	static const char *results[4] = { "budget used", "console input wait", "HALT", "status set" };
+	char text[160], flags[2][9];
+	uint32_t i;
+	uint16_t pc = CPU_WORD16(start->regs.pc);
+
+	if (budget == 1)
+		snprintf(text, sizeof(text), "\r\nVerify: %s differs from the reference at instruction %llu, PC %04X (%02X %02X %02X %02X)\r\n",
+			verify_engine->name, (unsigned long long)start->icount, pc,
+			ram_read(pc), ram_read(pc + 1), ram_read(pc + 2), ram_read(pc + 3));
+	else
+		snprintf(text, sizeof(text), "\r\nVerify: %s differs from the reference in the %u instructions from instruction %llu, PC %04X\r\n",
+			verify_engine->name, budget, (unsigned long long)start->icount, pc);
+	pal_puts(text);
+	pal_puts("  Before:");
+	for (i = 0; i < VERIFY_REGS; i++) {
+		snprintf(text, sizeof(text), " %s=%04X", verify_regs[i].name, VERIFY_REG(&start->regs, i));
+		pal_puts(text);
+	}
+	pal_puts("\r\n");
+	if (engine->icount != cpu_icount || engine_result != result) {
+		snprintf(text, sizeof(text), "  Ran      reference %llu (%s)  %s %llu (%s)\r\n",
+			(unsigned long long)(cpu_icount - start->icount), results[result & 3], verify_engine->name,
+			(unsigned long long)(engine->icount - start->icount), results[engine_result & 3]);
+		pal_puts(text);
+	}
+	for (i = 0; i < VERIFY_REGS; i++) {
+		if (VERIFY_REG(&engine->regs, i) == VERIFY_REG(&cpu_regs, i))
+			continue;
+		snprintf(text, sizeof(text), "  %-4s     reference %04X  %s %04X", verify_regs[i].name,
+			VERIFY_REG(&cpu_regs, i), verify_engine->name, VERIFY_REG(&engine->regs, i));
+		pal_puts(text);
+		if (!i) {
+			verify_flags(flags[0], cpu_regs.af & 0xff);
+			verify_flags(flags[1], engine->regs.af & 0xff);
+			snprintf(text, sizeof(text), "  flags %s  %s", flags[0], flags[1]);
+			pal_puts(text);
+		}
+		pal_puts("\r\n");
+	}
+	if (engine->status != cpu_status) {
+		snprintf(text, sizeof(text), "  Status   reference %d  %s %d\r\n", cpu_status, verify_engine->name, engine->status);
+		pal_puts(text);
+	}
+	for (i = 0; i < verify_diff_count && i < VERIFY_DIFFS; i++) {
+		snprintf(text, sizeof(text), "  (%04X)   reference %02X  %s %02X\r\n", verify_diffs[i].address,
+			ram_read(verify_diffs[i].address), verify_engine->name, verify_diffs[i].value);
+		pal_puts(text);
+	}
+	if (verify_diff_count > VERIFY_DIFFS) {
+		snprintf(text, sizeof(text), "  ... and %u more bytes of memory\r\n", verify_diff_count - VERIFY_DIFFS);
+		pal_puts(text);
+	}
+}
+
+static uint8_t verify_fail(void) {
+	verify_failed = 1;
+	cpu_status = 1;
+	return(CPU_RUN_STATUS);
+}
+
+// Runs up to budget instructions on both engines and compares them, returns what the reference returned,
+// VERIFY_PORT when the next instruction calls the BDOS or BIOS or CPU_RUN_STATUS when they differ
+static uint8_t verify_span(uint32_t budget) {
+	verify_state_t start, engine;
+	char text[128];
+	uint8_t engine_result, result;
+	uint32_t engine_writes, i, ran;
+
+	verify_save(&start);
+	verify_log = verify_engine_log;
+	verify_writes = 0;
+	verify_overflow = 0;
+	verify_port_hit = 0;
+	verify_logging = verify_shadow = 1;
+	engine_result = verify_engine->run(budget);
+	verify_logging = verify_shadow = 0;
+	verify_save(&engine);
+	engine_writes = verify_writes;
+	ran = (uint32_t)(engine.icount - start.icount);
+
+	if (!++verify_stamp) {
+		memset(verify_marks, 0, sizeof(verify_marks));
+		verify_stamp = 1;
+	}
+	for (i = 0; i < engine_writes; i++) {
+		verify_marks[verify_engine_log[i].address] = verify_stamp;
+		verify_values[verify_engine_log[i].address] = ram_read(verify_engine_log[i].address);
+	}
+	verify_undo(verify_engine_log, engine_writes);
+	verify_restore(&start);
+
+	if (verify_overflow) {
+		snprintf(text, sizeof(text), "\r\nVerify: %s wrote memory more than %u instructions can, from instruction %llu\r\n",
+			verify_engine->name, budget, (unsigned long long)start.icount);
+		pal_puts(text);
+		return(verify_fail());
+	}
+	if (verify_port_hit) {
+		if (ran > 1)
+			return(verify_span(ran - 1));	// Up to the instruction before
+		return(VERIFY_PORT);
+	}
+
+	result = verify_reference(ran);
+	verify_memory(engine_writes);
+	if ((engine_result == CPU_RUN_BUDGET && ran != budget) || engine_result != result || engine.icount != cpu_icount ||
+	    engine.status != cpu_status || verify_diff_count || verify_regs_differ(&engine.regs, &cpu_regs)) {
+		if (engine_result == CPU_RUN_BUDGET && ran != budget) {
+			snprintf(text, sizeof(text), "\r\nVerify: %s ran %u of %u instructions and returned as if it had run them all\r\n",
+				verify_engine->name, ran, budget);
+			pal_puts(text);
+		}
+		verify_report(&start, &engine, engine_result, result, ran);
+		if (ran > 1) {
+			pal_puts("  Stepping through the block one instruction at a time:\r\n");
+			verify_undo(verify_reference_log, verify_writes);
+			verify_restore(&start);
+			for (i = 0; i < ran; i++) {
+				result = verify_span(1);
+				if (verify_failed)
+					return(result);
+				if (result != CPU_RUN_BUDGET)
+					break;
+			}
+			pal_puts("  every instruction matches by itself, they only differ as a block.\r\n");
+		}
+		return(verify_fail());
+	}
+	return(result);
+}
+
+// Verifies the next block of the guest, returns a CPU_RUN_ result like cpu_run_for
+uint8_t verify_run(void) {
+	uint8_t result = verify_span(verify_block);
+
+	if (result == VERIFY_PORT)
+		result = cpu_engines[0].run(1);	// The BDOS or BIOS call, made once, by the reference
+	return(result);
+}
+
+// Selects the engine to verify, as name or name:block, block being how many instructions are compared at a time
+uint8_t verify_init(const char *engine) {
+	const char *colon = strchr(engine, ':');
+	size_t length = colon ? (size_t)(colon - engine) : strlen(engine);
+	unsigned long block = colon ? strtoul(colon + 1, NULL, 10) : 1;
+	const cpu_engine_t *e;
+
+	for (e = cpu_engines; e->name; e++)
+		if (strlen(e->name) == length && !strncmp(e->name, engine, length))
+			break;
+	if (!e->name || !block || block > EMULATOR_VERIFY_BLOCK_MAX) {
+		pal_puts("Engines:");
+		for (e = cpu_engines; e->name; e++) {
+			pal_puts(" ");
+			pal_puts(e->name);
+		}
+		pal_puts("\r\n");
+		return(1);
+	}
+	verify_engine = e;
+	verify_block = (uint32_t)block;
+	verify_room = verify_block * 4 + 16;	// An instruction writes 2 bytes at most
+	verify_engine_log = (verify_write_t*)malloc(verify_room * sizeof(verify_write_t));
+	verify_reference_log = (verify_write_t*)malloc(verify_room * sizeof(verify_write_t));
+	if (!verify_engine_log || !verify_reference_log)
+		return(1);
+	verify_enabled = 1;
+	return(0);
+}
+
+static uint32_t verify_random(void) {
+	verify_random_state ^= verify_random_state << 13;
+	verify_random_state ^= verify_random_state >> 7;
+	verify_random_state ^= verify_random_state << 17;
+	return((uint32_t)(verify_random_state >> 16));
+}
+
+// Runs random programs on both engines until one differs, returns 1 when one did
+uint8_t verify_fuzz(uint32_t seed) {
+	char text[128];
+	uint64_t first, instructions = 0;
+	uint32_t program, i, left, r;
+	uint8_t result;
+
+	verify_random_state = (seed + 1) * 0x9e3779b97f4a7c15ULL;
+	for (program = 0; program < EMULATOR_VERIFY_PROGRAMS; program++) {
+		for (i = 0; i < VERIFY_REGS; i++)
+			*(int32_t*)((char*)&cpu_regs + verify_regs[i].offset) = verify_random() & 0xffff;
+		for (i = 0; i < (program ? 256 : 65536); i += 4) {	// All of memory at first, then where each program starts
+			r = verify_random();
+			ram_write(cpu_regs.pc + i, r);
+			ram_write(cpu_regs.pc + i + 1, r >> 8);
+			ram_write(cpu_regs.pc + i + 2, r >> 16);
+			ram_write(cpu_regs.pc + i + 3, r >> 24);
+		}
+		cpu_regs.iff &= 3;
+		cpu_regs.pcx = cpu_regs.pc;
+		cpu_status = 0;
+		first = cpu_icount;
+		while ((left = EMULATOR_VERIFY_STEPS - (uint32_t)(cpu_icount - first))) {
+			result = verify_span(left < verify_block ? left : verify_block);
+			if (verify_failed) {
+				snprintf(text, sizeof(text), "Found by random program %u of seed %u.\r\n", program, seed);
+				pal_puts(text);
+				return(1);
+			}
+			if (result != CPU_RUN_BUDGET)	// A HALT or a BDOS or BIOS call ends the program
+				break;
+		}
+		instructions += cpu_icount - first;
+	}
+	snprintf(text, sizeof(text), "%u random programs of seed %u, %llu instructions, %s matches the reference.\r\n",
+		program, seed, (unsigned long long)instructions, verify_engine->name);
+	pal_puts(text);
+	return(0);
+}
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef _VERIFY_H
+#define _VERIFY_H
+
+#include <stdint.h>
+
+// Writes to guest memory are logged while an engine runs under verification,
+// so they can be compared and undone
+#define VERIFY_WRITE(address) do { if (verify_logging) verify_write(address); } while (0)
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+extern uint8_t verify_enabled;
+extern uint8_t verify_logging;
+extern uint8_t verify_shadow;
+extern uint8_t verify_failed;
+extern void verify_write(uint32_t address);
+extern void verify_port(void);
+extern uint8_t verify_init(const char *engine);
+extern uint8_t verify_run(void);
+extern uint8_t verify_fuzz(uint32_t seed);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,539 @@
+/*
+	com2c - Translates CP/M programs ahead of time for RunCPM -a
+
+	Usage: com2c [-s source] [-o dir] [-c] program.com...
+
+	Finds the code reachable from 0100h in each program, following jumps,
+	calls and returns, and writes it out as C, one function with a label
+	per block of straight line code, which it compiles into
+	dir/<hash>-<core>.so for RunCPM -a dir to run natively (see
+	runcpm/aot.h). hash is that of the image and core the cksum of the
+	cpu.c it was made from, so a RunCPM built from another cpu.c does not
+	pick it up. Every instruction is translated from its body in the
+	reference core, runcpm/cpu.c, with its operands filled in, so the
+	translation computes what the reference does. Calls and jumps out of the program (the BDOS, the BIOS, RST) and
+	code never found, such as what is reached through a table of addresses,
+	are left to the interpreter, and so are the IN, OUT and HALT, DD, ED and
+	FD prefixed instructions.
+
+	  -s source  RunCPM source directory, for cpu.c and the headers the
+	             translation is compiled with (the one com2c was built in)
+	  -o dir     Where the translations go (the current directory)
+	  -c         Only write dir/<hash>-<core>.c, do not compile it
+
+	The compiler is $CC, cc if not set.
+
+	Build with: make com2c (in runcpm/)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../runcpm/aot.h"
+
+#ifndef COM2C_SOURCE
+#define COM2C_SOURCE "."
+#endif
+
+#define ORIGIN 0x0100
+#define TOP    0xff00	// Past the largest program there is room for below the BDOS
+#define LINE_MAX 1024
+
+// What com2c knows of an address of the program
+#define AT_CODE    1	// An instruction starts here
+#define AT_LEADER  2	// A block starts here
+#define AT_QUEUED  4
+
+static char *bodies[256];	// cpu.c's body of each unprefixed instruction, NULL for those translated here or left out
+static uint8_t image[65536];
+static uint8_t marks[65536];
+static uint8_t fallins[65536];	// Instructions that go on to the one here
+static uint16_t queue[65536];
+static uint32_t end;
+
+// Conditions of the JP, CALL and RET cc instructions, as cpu.c tests them
+static const char *conditions[8] = {
+	"!TST_FLAG(Z)", "TST_FLAG(Z)", "!TST_FLAG(C)", "TST_FLAG(C)",
+	"!TST_FLAG(P)", "TST_FLAG(P)", "!TST_FLAG(S)", "TST_FLAG(S)"
+};
+
+// The CB prefixed instructions, as cpu.c does them for each value of op
+static const char *cb_reads[8] = {
+	"CPU_REG_GET_HIGH(cpu_regs.bc)", "CPU_REG_GET_LOW(cpu_regs.bc)", "CPU_REG_GET_HIGH(cpu_regs.de)", "CPU_REG_GET_LOW(cpu_regs.de)",
+	"CPU_REG_GET_HIGH(cpu_regs.hl)", "CPU_REG_GET_LOW(cpu_regs.hl)", "GET_BYTE(adr)", "CPU_REG_GET_HIGH(cpu_regs.af)"
+};
+static const char *cb_writes[8] = {
+	"CPU_REG_SET_HIGH(cpu_regs.bc, temp)", "CPU_REG_SET_LOW(cpu_regs.bc, temp)", "CPU_REG_SET_HIGH(cpu_regs.de, temp)", "CPU_REG_SET_LOW(cpu_regs.de, temp)",
+	"CPU_REG_SET_HIGH(cpu_regs.hl, temp)", "CPU_REG_SET_LOW(cpu_regs.hl, temp)", "PUT_BYTE(adr, temp)", "CPU_REG_SET_HIGH(cpu_regs.af, temp)"
+};
+static const char *cb_shifts[8] = {
+	"temp = (acu << 1) | (acu >> 7); cbits = temp & 1;",	// RLC
+	"temp = (acu >> 1) | (acu << 7); cbits = temp & 0x80;",	// RRC
+	"temp = (acu << 1) | TST_FLAG(C); cbits = acu & 0x80;",	// RL
+	"temp = (acu >> 1) | (TST_FLAG(C) << 7); cbits = acu & 1;",	// RR
+	"temp = acu << 1; cbits = acu & 0x80;",	// SLA
+	"temp = (acu >> 1) | (acu & 0x80); cbits = acu & 1;",	// SRA
+	"temp = (acu << 1) | 1; cbits = acu & 0x80;",	// SLIA
+	"temp = acu >> 1; cbits = acu & 1;"	// SRL
+};
+
+// Whether the opcode is one com2c translates itself, the jumps, calls, returns and CB
+static int is_flow(uint8_t op) {
+	return(op == 0x10 || op == 0x18 || (op & 0xe7) == 0x20 || op == 0xcb || op == 0xc9 || op == 0xcd || op == 0xc3 || op == 0xe9 ||
+	    (op & 0xc7) == 0xc0 || (op & 0xc7) == 0xc2 || (op & 0xc7) == 0xc4 || (op & 0xc7) == 0xc7);
+}
+
+// Whether the opcode is always left to the interpreter, OUT, IN (the BDOS and BIOS, cpu_in and cpu_out) and HALT
+static int is_left(uint8_t op) {
+	return(op == 0xd3 || op == 0xdb || op == 0x76);
+}
+
+// cksum(1) of the text, the CRC the Makefile names the build of cpu.c by (AOT_CORE)
+static uint32_t cksum(const uint8_t *text, size_t size) {
+	uint32_t crc = 0, byte;
+	size_t len = size;
+	int i;
+
+	while (size || len) {
+		if (size) {
+			byte = *text++;
+			size--;
+		} else {
+			byte = len & 0xff;
+			len >>= 8;
+		}
+		crc ^= byte << 24;
+		for (i = 0; i < 8; i++)
+			crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+	}
+	return(~crc);
+}
+
+/*
+	Takes the body of every unprefixed instruction from the main switch of
+	cpu_exec, the cases as deep as its first one. Bodies that do more than
+	run through to their break, the jumps and those that use PC otherwise
+	than to fetch their operands, are left out, the interpreter runs them.
+	Also sets core, the cksum of cpu.c.
+*/
+static int load_bodies(const char *source, uint32_t *core) {
+	char path[LINE_MAX], line[LINE_MAX], *text, *s;
+	FILE *file;
+	int in_switch = 0, op = -1, breaks = 0;
+	size_t size = 0, n, depth = 0, indent;
+
+	snprintf(path, sizeof(path), "%s/cpu.c", source);
+	file = fopen(path, "rb");
+	if (!file)
+		return(1);
+	text = NULL;
+	while ((n = fread(line, 1, sizeof(line), file))) {
+		text = (char*)realloc(text, size + n);
+		if (!text)
+			return(1);
+		memcpy(text + size, line, n);
+		size += n;
+	}
+	*core = cksum((const uint8_t*)text, size);
+	free(text);
+	text = NULL;
+	rewind(file);
+	size = 0;
+	while (fgets(line, sizeof(line), file)) {
+		if (!in_switch) {
+			in_switch = strstr(line, "switch (RAM_PP(cpu_regs.pc)) {") != NULL;
+			continue;
+		}
+		indent = strspn(line, " \t");
+		s = line + indent;
+		if (!depth && !strncmp(s, "case 0x", 7))
+			depth = indent;
+		if (depth && ((indent == depth && (!strncmp(s, "case 0x", 7) || !strncmp(s, "default:", 8))) || (indent < depth && *s == '}'))) {
+			if (op >= 0 && text && breaks == 1 && !is_flow((uint8_t)op) && !is_left((uint8_t)op))
+				bodies[op] = text;
+			else
+				free(text);
+			text = NULL;
+			size = 0;
+			breaks = 0;
+			op = -1;
+			if (*s != 'c')
+				break;
+			op = (int)strtol(s + 5, NULL, 16);
+			continue;
+		}
+		s[strcspn(s, "\r\n")] = 0;
+		if (!*s || !strcmp(s, "cpu_regs.pc += 2;"))	// After the operand fetch, the translation has no PC to move on
+			continue;
+		if (!strcmp(s, "break;")) {
+			breaks++;
+			continue;
+		}
+		if (strchr(s, '#') || strstr(s, "//") || strstr(s, "goto ") || strstr(s, "return") || breaks)
+			breaks = 2;
+		n = strlen(s);
+		text = (char*)realloc(text, size + n + 2);
+		if (!text)
+			return(1);
+		memcpy(text + size, s, n);
+		size += n;
+		text[size++] = ' ';
+		text[size] = 0;
+	}
+	fclose(file);
+	for (op = 0; op < 256; op++) {	// Only the operand fetch may use PC
+		if (!bodies[op])
+			continue;
+		for (s = bodies[op]; (s = strstr(s, "cpu_regs.pc")); s++) {
+			if (strncmp(s - 7, "RAM_PP(cpu_regs.pc)", 19) && strncmp(s - 9, "GET_WORD(cpu_regs.pc)", 21)) {
+				free(bodies[op]);
+				bodies[op] = NULL;
+				break;
+			}
+		}
+	}
+	return(bodies[0x00] == NULL && bodies[0x3c] == NULL);	// Nothing found, not cpu.c as com2c knows it
+}
+
+// Length of the instruction at address
+static uint32_t length(uint32_t address) {
+	uint8_t op = image[address & 0xffff], next = image[(address + 1) & 0xffff];
+
+	switch (op) {
+	case 0xcb:
+		return(2);
+	case 0xed:
+		return((next & 0xc7) == 0x43 ? 4 : 2);
+	case 0xdd:
+	case 0xfd:
+		if (next == 0xcb || next == 0x21 || next == 0x22 || next == 0x2a || next == 0x36)
+			return(4);
+		if (next == 0x34 || next == 0x35 || (next >= 0x40 && next < 0xc0 && next != 0x76 &&
+		    ((next & 7) == 6 || (next & 0xf8) == 0x70)))
+			return(3);
+		return(2);
+	}
+	if ((op & 0xc7) == 0x06 || op == 0x10 || op == 0x18 || (op & 0xe7) == 0x20 || (op & 0xc7) == 0xc6 || op == 0xd3 || op == 0xdb)
+		return(2);
+	if ((op & 0xcf) == 0x01 || (op & 0xe7) == 0x22 || (op & 0xc7) == 0xc2 || op == 0xc3 || (op & 0xc7) == 0xc4 || op == 0xcd)
+		return(3);
+	return(1);
+}
+
+// Whether the program goes on to the next instruction after the one at address
+static int falls_through(uint32_t address) {
+	uint8_t op = image[address], next = image[(address + 1) & 0xffff];
+
+	if (op == 0x18 || op == 0xc3 || op == 0xc9 || op == 0xe9 || op == 0x76)
+		return(0);
+	if (op == 0xed && (next & 0xc7) == 0x45)	// RETN, RETI
+		return(0);
+	if ((op == 0xdd || op == 0xfd) && next == 0xe9)
+		return(0);
+	return(1);
+}
+
+// Where the instruction at address jumps or calls to, -1 if nowhere known
+static int32_t target(uint32_t address) {
+	uint8_t op = image[address];
+
+	if (op == 0x10 || op == 0x18 || (op & 0xe7) == 0x20)
+		return((int32_t)address + 2 + (int8_t)image[address + 1]);
+	if (op == 0xc3 || op == 0xcd || (op & 0xc7) == 0xc2 || (op & 0xc7) == 0xc4)
+		return(image[address + 1] | (image[address + 2] << 8));
+	return(-1);
+}
+
+// Whether the instruction at address is translated
+static int translated(uint32_t address) {
+	uint8_t op = image[address];
+
+	return(address + length(address) <= end && (bodies[op] || is_flow(op)));
+}
+
+static int in_program(int32_t address) {
+	return(address >= ORIGIN && (uint32_t)address < end);
+}
+
+// Finds the instructions reachable from ORIGIN and the blocks they make up
+static void discover(void) {
+	uint32_t head = 0, tail = 0, address, next;
+	int32_t to;
+
+	queue[tail++] = ORIGIN;
+	marks[ORIGIN] |= AT_LEADER | AT_QUEUED;
+	while (head < tail) {
+		address = queue[head++];
+		marks[address] |= AT_CODE;
+		next = address + length(address);
+		to = target(address);
+		if (in_program(to)) {
+			marks[to] |= AT_LEADER;
+			if (!(marks[to] & AT_QUEUED)) {
+				marks[to] |= AT_QUEUED;
+				queue[tail++] = (uint16_t)to;
+			}
+		}
+		if (!falls_through(address) || next >= end)
+			continue;
+		fallins[next]++;
+		if (to >= 0 || !translated(address) || (image[address] & 0xc7) == 0xc0 || (image[address] & 0xc7) == 0xc7)
+			marks[next] |= AT_LEADER;	// Where a call returns to, a condition fails or the interpreter stops after one instruction
+		if (!(marks[next] & AT_QUEUED)) {
+			marks[next] |= AT_QUEUED;
+			queue[tail++] = (uint16_t)next;
+		}
+	}
+	for (address = ORIGIN; address < end; address++) {
+		if ((marks[address] & AT_CODE) && fallins[address] > 1)
+			marks[address] |= AT_LEADER;	// Reached from more than one instruction, those overlap
+	}
+}
+
+// Instructions translated in the block at address
+static uint32_t block_count(uint32_t address) {
+	uint32_t count = 0;
+
+	while (translated(address)) {
+		count++;
+		if (is_flow(image[address]) && image[address] != 0xcb)
+			break;
+		address += length(address);
+		if (address >= end || !(marks[address] & AT_CODE) || (marks[address] & AT_LEADER))
+			break;
+	}
+	return(count);
+}
+
+// Goes to the block at address or leaves for the interpreter there
+static void emit_jump(FILE *out, int32_t address) {
+	if (in_program(address) && (marks[address] & AT_LEADER) && block_count(address))
+		fprintf(out, "goto B_%04x;", address);
+	else
+		fprintf(out, "AOT_LEAVE(0x%04x, 0);", (uint32_t)address);
+}
+
+// The body of a translated instruction, with its operands
+static void emit_body(FILE *out, uint32_t address) {
+	uint8_t op = image[address], cb;
+	const char *s;
+
+	if (op == 0xcb) {
+		cb = image[address + 1];
+		fprintf(out, "adr = cpu_regs.hl; acu = %s; ", cb_reads[cb & 7]);
+		switch (cb & 0xc0) {
+		case 0x00:
+			fprintf(out, "%s cpu_regs.af = (cpu_regs.af & ~0xff) | rotateShiftTable[temp & 0xff] | !!cbits; ", cb_shifts[(cb >> 3) & 7]);
+			break;
+		case 0x40:
+			fprintf(out, "if (acu & (1 << %d)) cpu_regs.af = (cpu_regs.af & ~0xfe) | 0x10 | (%d << 7); else cpu_regs.af = (cpu_regs.af & ~0xfe) | 0x54; ",
+			    (cb >> 3) & 7, (cb & 0x38) == 0x38);
+			if ((cb & 7) != 6)
+				fprintf(out, "cpu_regs.af |= (acu & 0x28); ");
+			fprintf(out, "temp = acu; ");
+			break;
+		case 0x80:
+			fprintf(out, "temp = acu & ~(1 << %d); ", (cb >> 3) & 7);
+			break;
+		case 0xc0:
+			fprintf(out, "temp = acu | (1 << %d); ", (cb >> 3) & 7);
+			break;
+		}
+		fprintf(out, "%s;", cb_writes[cb & 7]);
+		return;
+	}
+	for (s = bodies[op]; *s; ) {
+		if (!strncmp(s, "RAM_PP(cpu_regs.pc)", 19)) {
+			fprintf(out, "0x%02x", image[address + 1]);
+			s += 19;
+		} else if (!strncmp(s, "GET_WORD(cpu_regs.pc)", 21)) {
+			fprintf(out, "0x%04x", image[address + 1] | (image[address + 2] << 8));
+			s += 21;
+		} else {
+			fputc(*s++, out);
+		}
+	}
+}
+
+// Whether the instruction at address may write to memory
+static int writes(uint32_t address) {
+	uint8_t op = image[address];
+
+	if (op == 0xcb)
+		return((image[address + 1] & 7) == 6);
+	return(bodies[op] && (strstr(bodies[op], "PUT_") || strstr(bodies[op], "PUSH")));
+}
+
+// The code that ends a block with a jump, call or return, or goes on to the next
+static void emit_flow(FILE *out, uint32_t address) {
+	uint8_t op = image[address];
+	uint32_t next = address + length(address);
+	int32_t to = target(address);
+
+	if (op == 0xc3 || op == 0x18) {
+		emit_jump(out, to);
+	} else if (op == 0x10) {
+		fprintf(out, "if ((cpu_regs.bc -= 0x100) & 0xff00) ");
+		emit_jump(out, to);
+		fprintf(out, "\n\t");
+		emit_jump(out, next);
+	} else if ((op & 0xe7) == 0x20 || (op & 0xc7) == 0xc2) {
+		fprintf(out, "if (%s) ", conditions[(op & 0xe7) == 0x20 ? (op >> 3) & 3 : (op >> 3) & 7]);
+		emit_jump(out, to);
+		fprintf(out, "\n\t");
+		emit_jump(out, next);
+	} else if (op == 0xcd || (op & 0xc7) == 0xc4) {
+		if (op != 0xcd)
+			fprintf(out, "if (%s) ", conditions[(op >> 3) & 7]);
+		fprintf(out, "{ PUSH(0x%04x); ", address + 3);
+		emit_jump(out, to);
+		fprintf(out, " }");
+		if (op != 0xcd) {
+			fprintf(out, "\n\t");
+			emit_jump(out, next);
+		}
+	} else if (op == 0xc9 || (op & 0xc7) == 0xc0) {
+		if (op != 0xc9)
+			fprintf(out, "if (%s) ", conditions[(op >> 3) & 7]);
+		fprintf(out, "{ POP(cpu_regs.pc); goto dispatch; }");
+		if (op != 0xc9) {
+			fprintf(out, "\n\t");
+			emit_jump(out, next);
+		}
+	} else if ((op & 0xc7) == 0xc7) {
+		fprintf(out, "PUSH(0x%04x); ", address + 1);
+		emit_jump(out, op & 0x38);
+	} else if (op == 0xe9) {
+		fprintf(out, "cpu_regs.pc = cpu_regs.hl; goto dispatch;");
+	}
+	fprintf(out, "\n");
+}
+
+static void emit_block(FILE *out, uint32_t start) {
+	uint32_t address = start, size, count = block_count(start), i;
+	uint8_t op;
+	int written;
+
+	for (size = 0, i = 0; i < count; i++)
+		size += length(start + size);
+	fprintf(out, "B_%04x:\n\tAOT_BLOCK(0x%04x, %u, %u)\n", start, start, size, count);
+	for (i = 1; i <= count; i++) {
+		op = image[address];
+		if (is_flow(op) && op != 0xcb) {
+			fprintf(out, "\t");
+			emit_flow(out, address);
+			return;
+		}
+		fprintf(out, "\t{ ");
+		emit_body(out, address);
+		fprintf(out, " }\n");
+		written = writes(address);
+		address += length(address);
+		if (i < count && written)
+			fprintf(out, "\tif (stale) AOT_LEAVE(0x%04x, %u)\n", address, count - i);
+	}
+	fprintf(out, "\t");
+	emit_jump(out, address);	// The next block, or an instruction for the interpreter
+	fprintf(out, "\n");
+}
+
+static int translate(const char *name, const char *source, const char *dir, uint32_t core, int compile) {
+	char base[LINE_MAX], path[LINE_MAX + 2], command[4 * LINE_MAX];
+	const char *cc = getenv("CC");
+	FILE *file;
+	size_t got;
+	uint64_t hash;
+	uint32_t address, blocks = 0, instructions = 0, count;
+
+	memset(image, 0, sizeof(image));
+	memset(marks, 0, sizeof(marks));
+	memset(fallins, 0, sizeof(fallins));
+	file = fopen(name, "rb");
+	if (!file) {
+		fprintf(stderr, "com2c: cannot read %s\n", name);
+		return(1);
+	}
+	got = fread(image + ORIGIN, 1, TOP - ORIGIN, file);
+	fclose(file);
+	end = ORIGIN + (uint32_t)((got + 127) & ~127);	// Loaded a record at a time, the last one padded like the BDOS does
+	memset(image + ORIGIN + got, 0x1a, end - ORIGIN - got);
+	hash = aot_hash(image + ORIGIN, end - ORIGIN);
+	discover();
+
+	snprintf(base, sizeof(base), "%s/%016llx-%08x", dir, (unsigned long long)hash, core);	// Named after the image and the cpu.c it was made from
+	snprintf(path, sizeof(path), "%s.c", base);
+	file = fopen(path, "w");
+	if (!file) {
+		fprintf(stderr, "com2c: cannot write %s\n", path);
+		return(1);
+	}
+	fprintf(file, "/* %s translated by com2c, image hash %016llx */\n\n", name, (unsigned long long)hash);
+	fprintf(file, "#define AOT_MODULE\n#include \"defaults.h\"\n#include \"aot.h\"\n\n#define AOT_ORIGIN 0x%04x\n\n", ORIGIN);
+	fprintf(file, "static const uint8_t aot_image[%u] = {", end - ORIGIN);
+	for (address = ORIGIN; address < end; address++)
+		fprintf(file, "%s0x%02x,", (address - ORIGIN) % 16 ? " " : "\n\t", image[address]);
+	fprintf(file, "\n};\n\nconst uint32_t aot_abi = AOT_ABI;\n\n");
+	fprintf(file, "uint32_t aot_exec(aot_env_t *E, uint32_t budget) {\n");
+	fprintf(file, "\tcpu_regs_t *R = E->regs;\n\tconst uint8_t *M = E->ram;\n");
+	fprintf(file, "\tuint32_t start = budget, lo = 0, len = 0, stale = 0;\n");
+	fprintf(file, "\tuint32_t temp = 0, acu = 0, sum, cbits, op, adr;\n\n");
+	fprintf(file, "dispatch:\n\tswitch (cpu_regs.pc) {\n");
+	for (address = ORIGIN; address < end; address++) {
+		if ((marks[address] & AT_LEADER) && block_count(address))
+			fprintf(file, "\tcase 0x%04x: goto B_%04x;\n", address, address);
+	}
+	fprintf(file, "\t}\n\tgoto out;\n\n");
+	for (address = ORIGIN; address < end; address++) {
+		if ((marks[address] & AT_LEADER) && (count = block_count(address))) {
+			emit_block(file, address);
+			blocks++;
+			instructions += count;
+		}
+	}
+	fprintf(file, "\nout:\n\treturn(start - budget);\n}\n");
+	if (fclose(file)) {
+		fprintf(stderr, "com2c: cannot write %s\n", path);
+		return(1);
+	}
+	printf("%s: %u instructions in %u blocks, %016llx-%08x\n", name, instructions, blocks, (unsigned long long)hash, core);
+	if (!compile)
+		return(0);
+	snprintf(command, sizeof(command), "%s -O2 -shared -fPIC -Wall -Wno-unused -Werror=implicit-function-declaration -I \"%s\" \"%s\" -o \"%s.so\"",
+	    cc ? cc : "cc", source, path, base);
+	if (system(command)) {
+		fprintf(stderr, "com2c: cannot compile %s\n", path);
+		return(1);
+	}
+	remove(path);
+	return(0);
+}
+
+int main(int argc, char *argv[]) {
+	const char *source = COM2C_SOURCE, *dir = ".";
+	int i, compile = 1, failed = 0;
+	uint32_t core;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-s") && i + 1 < argc)
+			source = argv[++i];
+		else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+			dir = argv[++i];
+		else if (!strcmp(argv[i], "-c"))
+			compile = 0;
+		else
+			break;
+	}
+	if (i == argc) {
+		fprintf(stderr, "Usage: com2c [-s source] [-o dir] [-c] program.com...\n");
+		return(1);
+	}
+	if (load_bodies(source, &core)) {
+		fprintf(stderr, "com2c: cannot read the instructions from %s/cpu.c\n", source);
+		return(1);
+	}
+	for (; i < argc; i++)
+		failed |= translate(argv[i], source, dir, core, compile);
+	return(failed);
+}
@@ -0,0 +1,289 @@
+/*
+	echolat - Measures keystroke echo latency of RunCPM under a script
+
+	Usage: echolat [-l load] [-i interval] [-t timeout] runner script...
+
+	Runs runner (with no arguments, in the current folder) on a pseudo
+	terminal for each script and plays the script to it, like a user at a
+	terminal would type. Every key typed is timed from the moment it is
+	written to the terminal to the moment the first byte of output comes back
+	from RunCPM, and one JSON line per script gives the percentiles of those
+	latencies in microseconds.
+
+	  -l load      Number of busy processes to run alongside, one per CPU to
+	               saturate the machine (0)
+	  -i interval  Milliseconds from one key typed to the next, as a fast
+	               typist would (100)
+	  -t timeout   Milliseconds to wait for the echo of a key, keys with none
+	               are counted apart (1000)
+
+	Scripts hold one command per line, text being the rest of the line with
+	\r, \n, \t, \e, \\ and \xHH escapes:
+	  send text    Writes text to the terminal all at once, untimed
+	  type text    Types text a key at a time, timing each one
+	  expect text  Waits (up to 30 seconds) for text in the output
+	  sleep ms     Waits for ms milliseconds, reading the output
+	Lines starting with # are comments.
+
+	Build with: make echolat (in runcpm/), run with: make latency
+*/
+
+#define _GNU_SOURCE	// memmem
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+
+#define EXPECT_MS 30000		// How long expect waits
+#define WINDOW    4096		// Output kept for expect to search
+
+static int terminal = -1;
+static char window[WINDOW + 1];	// Output since the last expect matched
+static size_t window_len = 0;
+static double *latencies = NULL;
+static size_t count = 0, room = 0, no_echo = 0;
+
+static double now_us(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return(now.tv_sec * 1e6 + now.tv_nsec / 1e3);
+}
+
+// Reads whatever output arrives within ms milliseconds (0 to only take what is there), returns the bytes read
+static ssize_t drain(int ms) {
+	struct pollfd pfd = { terminal, POLLIN, 0 };
+	char buf[1024];
+	ssize_t got;
+
+	if (poll(&pfd, 1, ms) <= 0)
+		return(0);
+	got = read(terminal, buf, sizeof(buf));
+	if (got <= 0)
+		return(-1);
+	if (window_len + got > WINDOW) {	// Keeps the latest output
+		size_t drop = window_len + got - WINDOW;
+
+		if (drop > window_len)
+			drop = window_len;
+		memmove(window, window + drop, window_len - drop);
+		window_len -= drop;
+	}
+	memcpy(window + window_len, buf, got > WINDOW ? WINDOW : got);
+	window_len += got > WINDOW ? WINDOW : got;
+	window[window_len] = 0;
+	return(got);
+}
+
+// Reads output until ms milliseconds from start have passed
+static int drain_until(double start, int ms) {
+	double left;
+
+	while ((left = start + ms * 1e3 - now_us()) > 0)
+		if (drain((int)(left / 1e3) + 1) < 0)
+			return(-1);
+	return(0);
+}
+
+static size_t unescape(const char *in, char *out) {
+	char *start = out;
+
+	while (*in && *in != '\n') {
+		if (*in != '\\' || !in[1]) {
+			*out++ = *in++;
+			continue;
+		}
+		in++;
+		switch (*in++) {
+		case 'r': *out++ = '\r'; break;
+		case 'n': *out++ = '\n'; break;
+		case 't': *out++ = '\t'; break;
+		case 'e': *out++ = 27; break;
+		case 'x': {
+			char hex[3] = { 0, 0, 0 };
+
+			strncpy(hex, in, 2);
+			*out++ = (char)strtol(hex, NULL, 16);
+			in += strlen(hex);
+			break;
+		}
+		default:  *out++ = in[-1];
+		}
+	}
+	*out = 0;
+	return(out - start);
+}
+
+static int expect(const char *text, size_t len) {
+	double start = now_us();
+	char *found;
+
+	while (!(found = memmem(window, window_len, text, len))) {
+		if (now_us() - start > EXPECT_MS * 1e3 || drain(100) < 0)
+			return(-1);
+	}
+	found += len;
+	window_len -= found - window;
+	memmove(window, found, window_len + 1);
+	return(0);
+}
+
+static int type(const char *text, size_t len, int interval, int timeout) {
+	double sent, first;
+	ssize_t got;
+
+	while (len--) {
+		while (drain(0) > 0)	// Whatever the last key caused is not this key's echo
+			;
+		sent = now_us();
+		if (write(terminal, text++, 1) != 1)
+			return(-1);
+		do
+			got = drain((int)((sent + timeout * 1e3 - now_us()) / 1e3) + 1);
+		while (!got && now_us() - sent < timeout * 1e3);
+		if (got < 0)
+			return(-1);
+		if (!got) {
+			no_echo++;
+			continue;
+		}
+		first = now_us();
+		if (count == room && !(latencies = realloc(latencies, (room = room ? room * 2 : 256) * sizeof(double))))
+			return(-1);
+		latencies[count++] = first - sent;
+		if (drain_until(sent, interval) < 0)
+			return(-1);
+	}
+	return(0);
+}
+
+static int compare(const void *a, const void *b) {
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return(x < y ? -1 : x > y);
+}
+
+static double percentile(double p) {
+	size_t i = (size_t)(p * (count - 1) + 0.5);
+
+	return(latencies[i < count ? i : count - 1]);
+}
+
+// Plays a script to a new runner, returns 0 when it got to the end
+static int play(const char *runner, const char *path, int interval, int timeout) {
+	char line[1024], text[1024];
+	size_t len;
+	pid_t pid;
+	FILE *script = fopen(path, "r");
+	int status, result = 0, number = 0;
+
+	if (!script) {
+		fprintf(stderr, "%s: unable to read.\n", path);
+		return(-1);
+	}
+	pid = forkpty(&terminal, NULL, NULL, NULL);
+	if (pid < 0) {
+		perror("forkpty");
+		return(-1);
+	}
+	if (!pid) {
+		execl(runner, runner, (char*)NULL);
+		perror(runner);
+		_exit(127);
+	}
+	window_len = 0;
+	while (!result && fgets(line, sizeof(line), script)) {
+		number++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		len = unescape(strchr(line, ' ') ? strchr(line, ' ') + 1 : "", text);
+		if (!strncmp(line, "send ", 5))
+			result = write(terminal, text, len) == (ssize_t)len ? 0 : -1;
+		else if (!strncmp(line, "type ", 5))
+			result = type(text, len, interval, timeout);
+		else if (!strncmp(line, "expect ", 7))
+			result = expect(text, len);
+		else if (!strncmp(line, "sleep ", 6))
+			result = drain_until(now_us(), atoi(text));
+		else
+			result = -2;
+		if (result)
+			fprintf(stderr, "%s:%d: %s\n", path, number, result == -2 ? "unknown command" : "failed, output so far:");
+		if (result == -1)
+			fprintf(stderr, "%s\n", window);
+	}
+	fclose(script);
+	drain_until(now_us(), 500);	// Lets it exit
+	kill(pid, SIGTERM);
+	waitpid(pid, &status, 0);
+	close(terminal);
+	return(result);
+}
+
+int main(int argc, char *argv[]) {
+	int load = 0, interval = 100, timeout = 1000, i, opt, failed = 0;
+	pid_t *busy;
+	double sum;
+	const char *name;
+	size_t k;
+
+	while ((opt = getopt(argc, argv, "l:i:t:")) != -1) {
+		switch (opt) {
+		case 'l': load = atoi(optarg); break;
+		case 'i': interval = atoi(optarg); break;
+		case 't': timeout = atoi(optarg); break;
+		default:
+			fprintf(stderr, "Usage: %s [-l load] [-i interval] [-t timeout] runner script...\n", argv[0]);
+			return(2);
+		}
+	}
+	if (optind + 2 > argc) {
+		fprintf(stderr, "Usage: %s [-l load] [-i interval] [-t timeout] runner script...\n", argv[0]);
+		return(2);
+	}
+	busy = calloc(load + 1, sizeof(pid_t));
+	for (i = 0; i < load; i++) {
+		if (!(busy[i] = fork()))
+			for (;;)
+				;
+	}
+
+	for (i = optind + 1; i < argc; i++) {
+		count = no_echo = 0;
+		if (play(argv[optind], argv[i], interval, timeout)) {
+			failed = 1;
+			continue;
+		}
+		name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+		if (!count) {
+			printf("{\"name\": \"%.*s\", \"load\": %d, \"keys\": 0, \"no_echo\": %zu}\n",
+				(int)strcspn(name, "."), name, load, no_echo);
+			continue;
+		}
+		qsort(latencies, count, sizeof(double), compare);
+		for (k = 0, sum = 0; k < count; k++)
+			sum += latencies[k];
+		printf("{\"name\": \"%.*s\", \"load\": %d, \"keys\": %zu, \"no_echo\": %zu, \"mean_us\": %.0f, "
+			"\"p50_us\": %.0f, \"p90_us\": %.0f, \"p99_us\": %.0f, \"max_us\": %.0f}\n",
+			(int)strcspn(name, "."), name, load, count, no_echo, sum / count,
+			percentile(0.5), percentile(0.9), percentile(0.99), latencies[count - 1]);
+		fflush(stdout);
+	}
+
+	for (i = 0; i < load; i++)
+		kill(busy[i], SIGKILL);
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+	return(failed);
+}
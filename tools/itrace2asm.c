@@ -0,0 +1,246 @@
+/*
+	itrace2asm - Decodes a RunCPM instruction trace into disassembly
+
+	Usage: itrace2asm [-s symbols]... [-f first] [-n count] [trace]
+
+	Reads the trace RunCPM wrote with -i (runcpm.itrace by default) and prints
+	one line per instruction executed: its number, address, the nearest symbol,
+	its bytes and mnemonic, and the registers that had changed when it started.
+	Calls to the BDOS at 0005h are followed by the name of the function.
+
+	  -s symbols  Symbol file, lines of hexadecimal addresses and names such as
+	              the .SYM files written by Z80ASM, M80/L80 or ZMAC, can be
+	              given more than once
+	  -f first    Number of the first instruction to print
+	  -n count    Number of instructions to print
+
+	Build with: make itrace2asm (in runcpm/)
+*/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG	// For the mnemonic tables
+#include <stdint.h>
+#include "../runcpm/cpu_tables.h"
+#include "../runcpm/itrace.h"
+
+static char *symbols[65536];	// Name at each address
+static uint16_t nearest[65536];	// Address of the symbol at or below each address
+static uint8_t have_symbols = 0;
+
+static const char *register_names[7] = { "AF", "BC", "DE", "HL", "SP", "IX", "IY" };
+
+static int load_symbols(const char *path) {
+	char line[256], *token, *last = NULL;
+	unsigned long value;
+	char *end;
+	FILE *file = fopen(path, "r");
+
+	if (!file)
+		return(1);
+	while (fgets(line, sizeof(line), file)) {
+		last = NULL;
+		for (token = strtok(line, " \t\r\n\x1a"); token; token = strtok(NULL, " \t\r\n\x1a")) {
+			value = strtoul(token, &end, 16);
+			if (!*end && end - token >= 4 && end - token <= 5 && value < 65536) {
+				last = token;	// An address, the name comes next
+				continue;
+			}
+			if (last && (isalpha((unsigned char)*token) || *token == '_' || *token == '?' || *token == '.')) {
+				value = strtoul(last, NULL, 16);
+				if (!symbols[value])
+					symbols[value] = strdup(token);
+				have_symbols = 1;
+			}
+			last = NULL;
+		}
+	}
+	fclose(file);
+	return(0);
+}
+
+// Prints an address, as a symbol when there is one there
+static void put_address(char **out, uint16_t address) {
+	if (symbols[address])
+		*out += sprintf(*out, "%s", symbols[address]);
+	else
+		*out += sprintf(*out, "%04Xh", address);
+}
+
+// Disassembles the instruction in code at pc into text, returns its length
+static int disassemble(uint16_t pc, const uint8_t *code, char *text) {
+	const char *txt;
+	char index = 0;
+	int pos = 1;
+	int8_t d;
+
+	switch (code[0]) {
+	case 0xCB: txt = _mnemonics_cb[code[1]]; pos = 2; break;
+	case 0xED: txt = _mnemonics_ed[code[1]]; pos = 2; break;
+	case 0xDD:
+	case 0xFD:
+		index = code[0] == 0xDD ? 'X' : 'Y';
+		if (code[1] == 0xCB) {
+			txt = _mnemonics_xcb[code[3]];	// DD CB d op, the displacement comes before the opcode
+			pos = 2;
+		} else {
+			txt = _mnemonics_xx[code[1]];
+			pos = 2;
+		}
+		break;
+	default: txt = _mnemonics[code[0]];
+	}
+	while (*txt) {
+		switch (*txt) {
+		case '*':
+		case '^':
+			text += sprintf(text, "%02Xh", code[pos++]);
+			txt += 2;
+			break;
+		case '#':
+			put_address(&text, code[pos] | code[pos + 1] << 8);
+			pos += 2;
+			txt += 2;
+			break;
+		case '@':
+			d = (int8_t)code[pos++];
+			if (txt[-1] == '%')	// (IX+d)
+				text += sprintf(text, "%c%02Xh", d < 0 ? '-' : '+', d < 0 ? -d : d);
+			else
+				put_address(&text, pc + pos + d);
+			txt += 2;
+			break;
+		case '%':
+			*text++ = index;
+			txt++;
+			break;
+		default:
+			*text++ = *txt++;
+		}
+	}
+	*text = 0;
+	if (index && code[1] == 0xCB)
+		pos = 4;
+	return(pos);
+}
+
+static uint16_t get16(const uint8_t **p) {
+	uint16_t v = (*p)[0] | (*p)[1] << 8;
+
+	*p += 2;
+	return(v);
+}
+
+int main(int argc, char *argv[]) {
+	static uint8_t code[65536 + 3];	// Bytes at every address as traced, room past the end for a last instruction
+	uint8_t *chunk = NULL;
+	const char *path = "runcpm.itrace";
+	unsigned long long first = 0, count = ~0ULL, number = 0;
+	uint16_t regs[7] = { 0 }, pc = 0, address;
+	uint32_t size, room = 0, bytes;
+	const uint8_t *p, *end;
+	uint8_t tag, ext, changed;
+	char magic[8], text[64], where[48], hex[12], *r, line[160];
+	FILE *in;
+	int i, n;
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] != '-' || i + 1 == argc) {
+			path = argv[i];
+			continue;
+		}
+		switch (argv[i][1]) {
+		case 's':
+			if (load_symbols(argv[++i])) {
+				fprintf(stderr, "%s: unable to read.\n", argv[i]);
+				return(1);
+			}
+			break;
+		case 'f':
+			first = strtoull(argv[++i], NULL, 0); break;
+		case 'n':
+			count = strtoull(argv[++i], NULL, 0); break;
+		default:
+			fprintf(stderr, "Usage: %s [-s symbols]... [-f first] [-n count] [trace]\n", argv[0]);
+			return(2);
+		}
+	}
+	if (have_symbols) {
+		for (i = 0, address = 0; i < 65536; i++) {
+			if (symbols[i])
+				address = i;
+			nearest[i] = address;
+		}
+	}
+	in = fopen(path, "rb");
+	if (!in || fread(magic, 1, 8, in) != 8 || memcmp(magic, ITRACE_MAGIC, 8)) {
+		fprintf(stderr, "%s: not a RunCPM instruction trace.\n", path);
+		return(1);
+	}
+
+	while (count && fread(&size, sizeof(size), 1, in) == 1) {
+		if (size > room && !(chunk = (uint8_t*)realloc(chunk, room = size))) {
+			fprintf(stderr, "Out of memory.\n");
+			return(1);
+		}
+		if (fread(chunk, 1, size, in) != size) {
+			fprintf(stderr, "%s: truncated.\n", path);
+			return(1);
+		}
+		for (p = chunk, end = chunk + size; p < end && count; number++) {
+			tag = *p++;
+			if (tag == ITRACE_SYNC) {
+				pc = get16(&p);
+				memcpy(&code[pc], p, 4);
+				p += 4;
+				for (i = 0; i < 7; i++)
+					regs[i] = get16(&p);
+				for (i = 0, number = 0; i < 8; i++)
+					number |= (unsigned long long)*p++ << (i * 8);
+				changed = 0x7f;
+			} else {
+				ext = tag & ITRACE_EXT ? *p++ : 0;
+				pc = tag & ITRACE_JUMP ? get16(&p) : pc + (tag & ITRACE_DELTA) + 1;
+				if (ext & ITRACE_CODE) {
+					memcpy(&code[pc], p, 4);
+					p += 4;
+				}
+				changed = (tag >> 4) | (ext >> 1) << 4;
+				for (i = 0, bytes = changed; bytes; i++, bytes >>= 1)
+					if (bytes & 1)
+						regs[i] = get16(&p);
+			}
+			if (number < first)
+				continue;
+			count--;
+
+			if (pc > 0xfffc)	// Wraps around to the start of memory
+				memcpy(&code[65536], code, 3);
+			n = disassemble(pc, &code[pc], text);
+			for (i = 0, r = hex; i < n; i++)
+				r += sprintf(r, "%02X", code[pc + i]);
+			where[0] = 0;
+			if (code[pc] == 0xCD && code[pc + 1] == 0x05 && code[pc + 2] == 0x00 && (regs[1] & 0xff) < 41)
+				snprintf(text + strlen(text), sizeof(text) - strlen(text), " ; %s", _cpm_calls[regs[1] & 0xff]);
+			if (have_symbols && symbols[nearest[pc]] && pc - nearest[pc] < 0x1000) {
+				if (nearest[pc] == pc)
+					snprintf(where, sizeof(where), "%s:", symbols[pc]);
+				else
+					snprintf(where, sizeof(where), "%s+%X", symbols[nearest[pc]], pc - nearest[pc]);
+			}
+			r = line + sprintf(line, "%10llu %04X %-16s %-8s %-24s", number, pc, where, hex, text);
+			for (i = 0; i < 7; i++)
+				if (changed & 1 << i)
+					r += sprintf(r, " %s=%04X", register_names[i], regs[i]);
+			while (r > line && r[-1] == ' ')
+				r--;
+			*r = 0;
+			puts(line);
+		}
+	}
+	fclose(in);
+	return(0);
+}
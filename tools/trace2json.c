@@ -0,0 +1,112 @@
+/*
+	trace2json - Turns a RunCPM call trace into Chrome trace event JSON
+
+	Usage: trace2json [trace [json]]
+
+	Reads the trace RunCPM wrote with -x, SIGUSR2 or BDOS call 249 (runcpm.trace
+	by default) and writes it as trace events (to standard output by default),
+	which chrome://tracing and https://ui.perfetto.dev both open. Every call is
+	a complete event on the BDOS or BIOS track, with its registers, FCB file name
+	and result as arguments, and calls dropped when the trace writer fell behind
+	are shown as instant events.
+
+	Build with: make trace2json (in runcpm/)
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../runcpm/trace.h"
+
+static const char *bdos_names[41] = {
+	"System Reset", "Console Input", "Console Output", "Reader Input", "Punch Output", "List Output", "Direct I/O", "Get IOByte",
+	"Set IOByte", "Print String", "Read Buffered", "Console Status", "Get Version", "Reset Disk", "Select Disk", "Open File",
+	"Close File", "Search First", "Search Next", "Delete File", "Read Sequential", "Write Sequential", "Make File", "Rename File",
+	"Get Login Vector", "Get Current Disk", "Set DMA Address", "Get Alloc", "Write Protect Disk", "Get R/O Vector", "Set File Attr", "Get Disk Params",
+	"Get/Set User", "Read Random", "Write Random", "Get File Size", "Set Random Record", "Reset Drive", "N/A", "N/A", "Write Random 0 fill"
+};
+
+static const char *bios_names[18] = {
+	"boot", "wboot", "const", "conin", "conout", "list", "punch/aux", "reader", "home", "seldisk", "settrk", "setsec", "setdma",
+	"read", "write", "listst", "sectran", "altwboot"
+};
+
+// Name of the file in the FCB as d:name.ext
+static void fcb_name(const uint8_t *fcb, char *name) {
+	int i;
+
+	if (fcb[0] && fcb[0] < 17) {
+		*name++ = '@' + fcb[0];
+		*name++ = ':';
+	}
+	for (i = 1; i < 12; i++) {
+		if (i == 9)
+			*name++ = '.';
+		if (fcb[i] > ' ' && fcb[i] != '"' && fcb[i] != '\\' && fcb[i] < 127)
+			*name++ = fcb[i];
+	}
+	if (name[-1] == '.')
+		name--;
+	*name = 0;
+}
+
+int main(int argc, char *argv[]) {
+	FILE *in, *out = stdout;
+	char magic[8], fcb[16];
+	const char *name, *sep = "";
+	trace_record_t record;
+	uint64_t first = 0;
+	unsigned long records = 0;
+
+	if (argc > 3) {
+		fprintf(stderr, "Usage: %s [trace [json]]\n", argv[0]);
+		return(2);
+	}
+	in = fopen(argc > 1 ? argv[1] : "runcpm.trace", "rb");
+	if (!in || fread(magic, 1, 8, in) != 8 || memcmp(magic, TRACE_MAGIC, 8)) {
+		fprintf(stderr, "%s: not a RunCPM trace.\n", argc > 1 ? argv[1] : "runcpm.trace");
+		return(1);
+	}
+	if (argc > 2 && !(out = fopen(argv[2], "w"))) {
+		fprintf(stderr, "%s: unable to create.\n", argv[2]);
+		return(1);
+	}
+
+	fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+	fprintf(out, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"BDOS\"}},\n");
+	fprintf(out, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 2, \"args\": {\"name\": \"BIOS\"}}");
+	while (fread(&record, sizeof(record), 1, in) == 1) {
+		if (!records++)
+			first = record.ns;
+		sep = ",\n";
+		if ((record.kind & ~TRACE_FCB) == TRACE_DROPPED) {
+			fprintf(out, "%s{\"name\": \"%llu calls dropped\", \"ph\": \"i\", \"s\": \"p\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f}",
+				sep, (unsigned long long)record.duration, (record.ns - first) / 1e3);
+			continue;
+		}
+		if ((record.kind & ~TRACE_FCB) == TRACE_BIOS)
+			name = record.function < 18 ? bios_names[record.function] : "";
+		else
+			name = record.function < 41 ? bdos_names[record.function] : "";
+		fprintf(out, "%s{\"name\": \"%s %d%s%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, ",
+			sep, (record.kind & ~TRACE_FCB) == TRACE_BIOS ? "BIOS" : "BDOS", record.function, name[0] ? " " : "", name,
+			(record.kind & ~TRACE_FCB) == TRACE_BIOS ? "bios" : "bdos", (record.kind & ~TRACE_FCB) == TRACE_BIOS ? 2 : 1,
+			(record.ns - first) / 1e3, record.duration / 1e3);
+		fprintf(out, "\"args\": {\"ret\": \"%04X\", \"af\": \"%04X\", \"bc\": \"%04X\", \"de\": \"%04X\", \"hl\": \"%04X\", "
+			"\"af_out\": \"%04X\", \"hl_out\": \"%04X\"", record.ret, record.af, record.bc, record.de, record.hl,
+			record.af_out, record.hl_out);
+		if (record.kind & TRACE_FCB) {
+			fcb_name(record.fcb, fcb);
+			fprintf(out, ", \"fcb\": \"%s\"", fcb);
+		}
+		fprintf(out, "}}");
+	}
+	fprintf(out, "\n]}\n");
+	fclose(in);
+	if (fclose(out)) {
+		fprintf(stderr, "Unable to write the JSON.\n");
+		return(1);
+	}
+	fprintf(stderr, "%lu records.\n", records);
+	return(0);
+}